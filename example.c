@@ -33,6 +33,9 @@ print_dreason(int disconnect_reason)
 		case EKICK_CONNECTION_TIMEOUT:
 			printf("Timed out.\n");
 		break;	
+		case EKICK_QUEUE_FULL:
+			printf("Too many messages queued.\n");
+		break;
 	}
 }
 
@@ -39,6 +39,15 @@ typedef int socklen_t;
 #define CLEANUP_WINSOCKS()
 #endif
 
+#ifdef __linux__
+#include <sys/socket.h>
+#ifdef SO_ATTACH_REUSEPORT_CBPF
+/* Defined if the `server_group_*` functions are available: 
+ * many sockets bound to the same port, with a program steering each peer to one of them */
+#define NET_HAS_SERVER_GROUP 1
+#endif
+#endif
+
 /* 2^3 = max 8 values */
 static const int network_kick_bit_size = 3;
 enum netconn_kick_reason
@@ -52,6 +61,20 @@ enum netconn_kick_reason
 	EKICK_CONNECTION_TIMEOUT,
 	/* The client connection request was refused by the server. */
 	EKICK_CONNECTION_REFUSED,
+	/* The messages waiting for the client went over `max_queued_bytes` (see `EQUEUE_KICK`). */
+	EKICK_QUEUE_FULL,
+};
+
+/* What to do when a tick starts a full tick interval (or more) after it was due */
+enum netconn_tick_catchup
+{
+	/* The schedule is shifted: the next tick is due one interval after the late one. */
+	ETICK_CATCHUP_STRETCH = 0,
+	/* The missed ticks are dropped, keeping the next ticks aligned with the original schedule. */
+	ETICK_CATCHUP_SKIP,
+	/* The missed ticks are run back to back until the schedule is met again.
+	 * Falls back to skipping if more than a second worth of ticks was missed. */
+	ETICK_CATCHUP_BURST,
 };
 
 enum netconn_connect_result
@@ -73,8 +96,39 @@ enum netconn_connect_result
 	ECONNECTION_AGAIN
 };
 
+/* Channels a connection has. Each one has its own delivery mode and order, so a message lost in one does not hold the others back */
+#define NET_MAX_CHANNELS 16
+enum netconn_channel_mode
+{
+	/* Messages are acknowledged (see `onmessageack`) and delivered in the order they were sent. 
+	 * A message that arrives early waits for the ones before it in the channel. 
+	 * Bigger messages than a datagram can hold are split in fragments (see `max_fragmented_len`). */
+	ECHANNEL_RELIABLE_ORDERED = 0,
+	/* Messages are acknowledged and delivered as soon as they arrive, in any order. 
+	 * Sending a message bigger than a datagram can hold fails. */
+	ECHANNEL_RELIABLE_UNORDERED,
+	/* Messages are sent once, with the next packet, and never acknowledged. 
+	 * A message older than the last one delivered in the channel is dropped, as is one that does not fit in the packet. 
+	 * Sending a message bigger than a datagram can hold fails. */
+	ECHANNEL_UNRELIABLE_SEQUENCED,
+};
+
+/* What to do when sending a message would go over `max_queued_bytes` */
+enum netconn_queue_policy
+{
+	/* Sending the message fails (returns 0). */
+	EQUEUE_REJECT = 0,
+	/* Sending the message fails, and the client is kicked with `EKICK_QUEUE_FULL`. 
+	 * For a client connection it is the same as `EQUEUE_REJECT`. */
+	EQUEUE_KICK,
+	/* The oldest messages are dropped until the new one fits, and reported with `onmessageexpire` during the next tick. 
+	 * Sending fails if the message does not fit even then. */
+	EQUEUE_DROP_OLDEST,
+};
+
 typedef struct netconn netconn_t;
 typedef struct srvclient netsrvclient_t;
+typedef struct netsrvgroup netsrvgroup_t;
 
 struct netsettings {
 	/* Amount of ticks with no sucessfull authentication. 
@@ -95,6 +149,103 @@ struct netsettings {
 	 * For a value of 10, the packet will be considered if (`arrived_tick` > `last_considered_tick`) && (`arrived_tick` <= `expected_tick` + 10 && `arrived_tick` >= `expected_tick` - 10).
 	 * A value of 8192 is highly recommended. Smaller values can be a problem with poor connections. A higher value significantly increases the chances of applying the wrong packet. */
 	uint16_t 	expected_tick_tolerance;
+	/* Maximum size of a datagram, in bytes.
+	 * Reliable messages that would make a packet bigger are moved to other datagrams (see `overflow_datagrams`), 
+	 * and `conn_get_bytes_left` tells how much room is left for the packet written in `onsendpkt`.
+	 * Each receive batch buffer has this size, so when batching is enabled bigger datagrams are dropped.
+	 * A value of 0 defaults to 1472 (ethernet MTU minus IPv4 and UDP headers). */
+	uint16_t 	mtu;
+	/* Amount of datagrams received with a single syscall (recvmmsg) during a server tick.
+	 * A value of 0 disables batching, receiving one datagram per syscall.
+	 * Only available on linux. This setting is exclusive to server. */
+	uint16_t 	recv_batch_size;
+	/* Amount of datagrams sent with a single syscall (sendmmsg) during a server tick.
+	 * Every client datagram is built in its own slot of the batch, which is flushed when full and at the end of the tick.
+	 * Datagrams that would block are kept and sent in the next flush instead of being dropped.
+	 * A value of 0 disables batching, sending one datagram per syscall.
+	 * Only available on linux. This setting is exclusive to server. */
+	uint16_t 	send_batch_size;
+	/* Enables UDP segmentation offload (GSO) and receive offload (GRO) if set to 1.
+	 * When the messages being sent would make a packet bigger than `mtu`, the message only datagrams they are moved to 
+	 * are sent together with the packet in a single syscall, each one padded to `mtu` bytes.
+	 * Datagrams coalesced by the kernel on receive are split back before being processed.
+	 * Only available on linux 5.0+. */
+	uint8_t 	udp_segmentation;
+	/* Uses io_uring for the socket I/O if set to 1, falling back to the plain socket calls if it is not available.
+	 * A multishot recvmsg keeps receiving into `recv_batch_size` buffers (default 256) that are processed in place,
+	 * and the server sends of a tick are submitted together in batches of `send_batch_size` (default 64).
+	 * Only available on linux 6.0+. */
+	uint8_t 	io_uring;
+	/* Ticks per second the conn is expected to be processed at. 
+	 * Only used to compute when the next tick is due (`conn_get_time_to_tick`, `conn_wait`).
+	 * A value of 0 defaults to 64. */
+	uint16_t 	tick_rate;
+	/* `enum netconn_tick_catchup`, what to do when a tick runs late. 
+	 * Late ticks are reported in `struct netstats`. */
+	uint8_t 	tick_catchup;
+	/* Capacity mode. If not 0, everything needed by up to `max_clients` clients is allocated by `server_init`, 
+	 * so no memory allocation happens afterwards, other than the reassembly buffer of clients that send fragmented messages. 
+	 * Datagrams from new addresses are ignored while the server is full.
+	 * This setting is exclusive to server. */
+	uint32_t 	max_clients;
+	/* Capacity mode. Messages waiting to be sent or acknowledged, shared by all clients. 
+	 * Sending a message fails (returns 0) when there are none left.
+	 * A value of 0 defaults to 32 per client. */
+	uint32_t 	max_messages;
+	/* Capacity mode. Bytes a message can hold. Messages sent to a client during the same tick share one while they fit.
+	 * Bigger messages are split in fragments, one message each, so sending fails (returns 0) if there are not enough messages left.
+	 * A value of 0 defaults to `mtu`. */
+	uint32_t 	max_message_len;
+	/* Messages sent and not acknowledged yet, per connection. Messages sent once the window is full wait until older ones are acknowledged.
+	 * Bulk transfers on high latency links need a bigger window, as at most this many messages are sent per round trip.
+	 * Messages are taken up to a window ahead of the next one expected (rounded up to a power of two, at least 64), so both ends should use the same value.
+	 * A value of 0 defaults to 128. Values over 16384 are clamped. */
+	uint16_t 	message_window;
+	/* Messages that do not fit in a datagram of `mtu` bytes are split in fragments, sent and acknowledged one by one, 
+	 * and reassembled by the receiver in a buffer that grows up to this many bytes.
+	 * Sending a bigger message fails (returns 0), and bigger ones received are dropped.
+	 * A value of 0 defaults to 1 MB (1048576). */
+	uint32_t 	max_fragmented_len;
+	/* Message only datagrams of up to `mtu` bytes sent to a connection per tick, when the messages due do not fit in its packet.
+	 * Messages that do not fit in them either are sent in the next ticks. With `udp_segmentation` they go in a single syscall.
+	 * A value of 0 defaults to 16. */
+	uint16_t 	overflow_datagrams;
+	/* `enum netconn_channel_mode` of each channel messages are sent to. The receiver reads the mode of each message from it. 
+	 * The default (0) is `ECHANNEL_RELIABLE_ORDERED` for every channel. */
+	uint8_t 	channels[NET_MAX_CHANNELS];
+	/* Free messages kept for reuse, shared by every client of a server (not used in capacity mode).
+	 * Once more than `message_pool_high` messages are free, the ones over `message_pool_low` are released, 
+	 * so the memory taken by a burst is given back. Free messages also give back buffers bigger than twice the `mtu`.
+	 * A value of 0 defaults to 1024 and a quarter of `message_pool_high`, respectively. */
+	uint32_t 	message_pool_high;
+	uint32_t 	message_pool_low;
+	/* Bytes of the reliable messages waiting to be sent or acknowledged, per connection, 
+	 * before `queue_policy` applies to new ones. A value of 0 disables the limit. */
+	uint32_t 	max_queued_bytes;
+	/* `enum netconn_queue_policy`, what to do when `max_queued_bytes` is hit. */
+	uint8_t 	queue_policy;
+	/* Rate limit of each client, in datagrams per tick on average.
+	 * Datagrams over the limit are dropped as soon as the client they belong to is found, before being handled.
+	 * A value of 0 disables the limit. This setting is exclusive to server. */
+	uint16_t 	client_packets_per_tick;
+	/* Rate limit of each client, in bytes per tick on average. Works like `client_packets_per_tick`.
+	 * A value of 0 disables the limit. This setting is exclusive to server. */
+	uint32_t 	client_bytes_per_tick;
+	/* Ticks worth of datagrams and bytes a client can send at once, above the rate limits.
+	 * The byte allowance is never smaller than `mtu`, so a full datagram always fits.
+	 * A value of 0 defaults to 8. This setting is exclusive to server. */
+	uint16_t 	client_rate_burst_ticks;
+	/* Admission budget of pending connections per tick, counting new clients and `onconnect` calls of pending ones.
+	 * Requests over the budget are deferred to a later tick, as clients keep retrying until they get an answer.
+	 * A value of 0 disables the budget. This setting is exclusive to server. */
+	uint16_t 	pending_conn_per_tick;
+};
+
+/* A message received, in the buffer it arrived in (see `onreceivemsgs`) */
+struct netmsgview {
+	const uint8_t 	*data;
+	uint32_t 		len;
+	uint8_t 		channel;
 };
 
 struct srvevents {
@@ -111,11 +262,19 @@ struct srvevents {
 	void	(*ondisconnect)(netconn_t *conn, void *userdata, int disconnect_reason, netsrvclient_t *client, void **cli_userdata);
 	/* Called whenever a message sent was acknowledged by the receiver. */
 	void 	(*onmessageack)(netconn_t *conn, void *userdata, uint32_t message_id, netsrvclient_t *client);
+	/* Called instead of `onmessageack` when a message sent with a time to live (see `server_cli_sendmessage_ex`) 
+	 * was not acknowledged in time, and was dropped. */
+	void 	(*onmessageexpire)(netconn_t *conn, void *userdata, uint32_t message_id, netsrvclient_t *client);
 	/* Called during a server tick if a valid packet is available.
 	 * This event is only called for clients that got approved in the `onconnect` stage. */
 	void	(*onreceivepkt)(netconn_t *conn, void *userdata, packet_t *p_in, netsrvclient_t *client, void *cli_userdata);
 	/* Called when a message arrives. */
 	void 	(*onreceivemsg)(netconn_t *conn, void *userdata, packet_t *p_in, netsrvclient_t *client);
+	/* Optional. If set, called instead of `onreceivemsg` with the messages of a datagram of `client`, in the order they are received in. 
+	 * `msgs` and the data they point to are only valid during the call. */
+	void 	(*onreceivemsgs)(netconn_t *conn, void *userdata, const struct netmsgview *msgs, uint32_t count, netsrvclient_t *client);
+	/* Optional. If set, called instead of `onmessageack` with the ids of the messages acknowledged by a datagram of `client`. */
+	void 	(*onmessageacks)(netconn_t *conn, void *userdata, const uint32_t *message_ids, uint32_t count, netsrvclient_t *client);
 	/* Called before the onsendpkt event occours for any client.
 	 * Only called once per tick. */
 	void 	(*bonsendpkt)(netconn_t *conn, void *userdata, netsrvclient_t *first);
@@ -135,10 +294,16 @@ struct clievents {
 	void	(*ondisconnect)(netconn_t **conn, void *userdata, int disconnect_reason);
 	/* Called whenever a message sent was acknowledged by the receiver. */
 	void 	(*onmessageack)(netconn_t *conn, void *userdata, uint32_t message_id);
+	/* Same as `onmessageexpire` of the server (see `client_sendmessage_ex`). */
+	void 	(*onmessageexpire)(netconn_t *conn, void *userdata, uint32_t message_id);
 	/* Called during a client tick if a valid packet is avaliable. */
 	void	(*onreceivepkt)(netconn_t *conn, void *userdata, packet_t *p_in);
 	/* Called when a message arrives. */
 	void 	(*onreceivemsg)(netconn_t *conn, void *userdata, packet_t *p_in);
+	/* Same as `onreceivemsgs` of the server. */
+	void 	(*onreceivemsgs)(netconn_t *conn, void *userdata, const struct netmsgview *msgs, uint32_t count);
+	/* Same as `onmessageacks` of the server. */
+	void 	(*onmessageacks)(netconn_t *conn, void *userdata, const uint32_t *message_ids, uint32_t count);
 	/* Called every client tick. */
 	void	(*onsendpkt)(netconn_t *conn, void *userdata, packet_t *p_out);
 };
@@ -146,6 +311,17 @@ struct clievents {
 struct netstats {
 	uint64_t 	total_received_bytes;
 	uint64_t	total_sent_bytes;
+	/* ticks that started a full tick interval (or more) after they were due */
+	uint64_t 	late_ticks;
+	/* ticks dropped by `ETICK_CATCHUP_SKIP` */
+	uint64_t 	skipped_ticks;
+	/* how late the last tick started, in nanoseconds */
+	uint64_t 	last_tick_late_ns;
+	uint64_t 	max_tick_late_ns;
+	/* datagrams dropped by the client rate limits */
+	uint64_t 	rate_limited_packets;
+	/* connection requests deferred by `pending_conn_per_tick` */
+	uint64_t 	deferred_connections;
 };
 
 /* Allocates a new `netconn_t` and initiates a server.
@@ -155,6 +331,9 @@ netconn_t *server_init(in_addr_t ip, in_port_t port, const struct srvevents even
  * Each execution is considered a server tick. 
  * If executed with a `NULL` value as `__conn` nothing happens. */
 void server_process(netconn_t **__conn);
+/* Receive and handle every datagram available right now, without sending anything or advancing the tick.
+ * Can be called between ticks, as soon as `conn_wait` or the conn fd reports data, to cut receive latency. */
+void server_drain(netconn_t **__conn);
 /* Initiate the process of closing the server.
  * After called, eventually `onsrvclose` event will be triggered. */
 void server_close(netconn_t *conn);
@@ -164,6 +343,27 @@ void server_free(netconn_t **conn);
 /* Kicks the given `client` from the server it's associated with. */
 void server_kick_client(netsrvclient_t *client, enum netconn_kick_reason reason);
 
+#ifdef NET_HAS_SERVER_GROUP
+/* Allocates `workers` servers bound to the same `ip` and `port` (SO_REUSEPORT), each one with its own clients and thread.
+ * Datagrams of a given client address always land on the same worker.
+ * Events are called from the worker threads: events of different workers may run concurrently.
+ * `onsrvclose` is called once per worker, with the worker `netconn_t`, and should call `server_free` as usual.
+ * Returns `NULL` on failure. */
+netsrvgroup_t 	*server_group_init(in_addr_t ip, in_port_t port, const struct srvevents events, const struct netsettings settings, void *userdata, const unsigned int workers);
+/* Should be executed at a constant rate, until `__group` becomes `NULL`.
+ * Runs one server tick in every worker and waits for all of them, so ticks are kept in sync.
+ * Once every worker is closed, the group is released and `*__group` is set to `NULL`. */
+void 			server_group_process(netsrvgroup_t **__group);
+/* Initiate the process of closing every worker.
+ * Should not be called while `server_group_process` is running. */
+void 			server_group_close(netsrvgroup_t *group);
+/* Stop the worker threads and release every resource, including the workers not closed yet. */
+void 			server_group_free(netsrvgroup_t **group);
+unsigned int 	server_group_get_worker_count(netsrvgroup_t *group);
+/* return the `netconn_t` of the worker `i`, or NULL if it was already released. */
+netconn_t 		*server_group_get_worker(netsrvgroup_t *group, const unsigned int i);
+#endif
+
 /* Allocates a new `netconn_t` and connects to a server. 
  * `ip` and `port` are expected in network byte order. */
 netconn_t *client_init(in_addr_t ip, in_port_t port, const struct clievents events, const struct netsettings settings, void *userdata);
@@ -171,9 +371,20 @@ netconn_t *client_init(in_addr_t ip, in_port_t port, const struct clievents even
  * Each execution is considered a client tick. 
  * If executed with a `NULL` value as `__conn` nothing happens. */
 void client_process(netconn_t **__conn);
-/* Send a message to the server.
- * Returns a message id that can be used to identify the sent message during `onmessageack` event. */
-uint32_t client_sendmessage(netconn_t *conn, const void *buffer, const uint32_t size);
+/* Same as `server_drain`, for a client. 
+ * Might trigger `ondisconnect`. */
+void client_drain(netconn_t **__conn);
+/* Send a message to the server, in `channel` (under `NET_MAX_CHANNELS`).
+ * Returns a message id that can be used to identify the sent message during `onmessageack` event, or 0 on failure. */
+uint32_t client_sendmessage(netconn_t *conn, const uint8_t channel, const void *buffer, const uint32_t size);
+/* Same as `server_cli_sendmessage_ex`, to the server. */
+uint32_t client_sendmessage_ex(netconn_t *conn, const uint8_t channel, const void *buffer, const uint32_t size, const uint8_t priority, const uint16_t ttl);
+/* Same as `server_cli_reservemessage`, to the server. */
+packet_t *client_reservemessage(netconn_t *conn, const uint8_t channel, const uint8_t priority, const uint16_t ttl);
+/* Same as `server_cli_commitmessage`, to the server. */
+uint32_t client_commitmessage(netconn_t *conn);
+/* return the channel of the message being received, during `onreceivemsg` */
+uint8_t client_get_message_channel(netconn_t *conn);
 /* Disconnects the client.
  * After called, eventually `ondisconnect` event will be triggered. */
 void client_disconnect(netconn_t *conn);
@@ -189,13 +400,62 @@ void 			*server_cli_get_userdata(netsrvclient_t *client);
 uint16_t 		server_cli_get_port(netsrvclient_t *client);
 /* return a pointer to the internal array containing the address of the `client` represented as a string */
 char 			*server_cli_get_addrstr(netsrvclient_t *client);
-/* Send a message to a client.
- * Returns a message id that can be used to identify the sent message during `onmessageack` event. */
-uint32_t 		server_cli_sendmessage(netsrvclient_t *client, const void *buffer, const uint32_t size);
+/* Send a message to a client, in `channel` (under `NET_MAX_CHANNELS`).
+ * Returns a message id that can be used to identify the sent message during `onmessageack` event, or 0 on failure. */
+uint32_t 		server_cli_sendmessage(netsrvclient_t *client, const uint8_t channel, const void *buffer, const uint32_t size);
+/* Same as `server_cli_sendmessage`, with a `priority` and a time to live.
+ * Messages with a higher priority are sent first when they do not all fit in the datagrams of a tick, or in the window (0 by default).
+ * If `ttl` is not 0, the message is sent for up to `ttl` ticks. Then it is dropped if not acknowledged yet, and `onmessageexpire` is triggered. */
+uint32_t 		server_cli_sendmessage_ex(netsrvclient_t *client, const uint8_t channel, const void *buffer, const uint32_t size, const uint8_t priority, const uint16_t ttl);
+/* Return a packet to write a message to `client` to, which is sent from there without being copied once `server_cli_commitmessage` is called. 
+ * The message is dropped if another message is sent or reserved to `client`, or the tick ends, before it is committed. 
+ * Return NULL on failure. */
+packet_t 		*server_cli_reservemessage(netsrvclient_t *client, const uint8_t channel, const uint8_t priority, const uint16_t ttl);
+/* Send the message written to the packet returned by `server_cli_reservemessage`, as `server_cli_sendmessage_ex` would. 
+ * Messages bigger than the mtu allows are split in fragments as usual, which takes a copy. 
+ * Returns a message id, or 0 on failure. */
+uint32_t 		server_cli_commitmessage(netsrvclient_t *client);
+/* Send the same message to the `count` clients of `clients`, as `server_cli_sendmessage_ex` would. 
+ * It is copied once and shared by them, then released when the last one acknowledges it. 
+ * If `ids` is not NULL, it is filled with the message id of each client, or 0 where it failed. 
+ * Return the amount of clients the message was sent to. */
+uint32_t 		server_multicastmessage(netconn_t *conn, netsrvclient_t **clients, const uint32_t count, const uint8_t channel, const void *buffer, const uint32_t size, const uint8_t priority, const uint16_t ttl, uint32_t *ids);
+/* Same as `server_multicastmessage`, to every connected client. */
+uint32_t 		server_broadcastmessage(netconn_t *conn, const uint8_t channel, const void *buffer, const uint32_t size, const uint8_t priority, const uint16_t ttl);
+/* return the channel of the message being received, during `onreceivemsg` */
+uint8_t 		server_cli_get_message_channel(netsrvclient_t *client);
+/* Lower the mtu of the datagrams sent to `client`, for a path that does not fit the server `mtu`.
+ * A value of 0 (or above the server `mtu`) sets it back to the server `mtu`. Values under 128 are raised to 128. */
+void 			server_cli_set_mtu(netsrvclient_t *client, uint16_t mtu);
+uint16_t 		server_cli_get_mtu(netsrvclient_t *client);
 
 uint16_t 	server_cli_get_external_tick(netsrvclient_t *client);
 uint16_t 	client_get_external_tick(netconn_t *conn);
 uint16_t 	conn_get_local_tick(netconn_t *conn);
+/* Return the bytes that can still be written to `p_out` during `onsendpkt` before the datagram is bigger than the mtu of the connection, 
+ * or 0 if it already is. The reliable messages are written before `onsendpkt` is called, so they are accounted for. */
+uint32_t 	conn_get_bytes_left(netconn_t *conn);
 /* return a pointer to the internal netstats struct */
 const struct netstats *conn_get_stats(netconn_t *conn);
+
+/* Return a file descriptor that becomes readable when there is data to be received, to be used with poll/epoll.
+ * Only wait for readability on it, and do not read from it: call `server_drain`/`client_drain` or the process function instead. */
+int 		conn_get_fd(netconn_t *conn);
+/* Return the time left until the next tick is due, in nanoseconds. Zero or negative if it is already due.
+ * The first tick is due right after init, then ticks are due every 1/`tick_rate` seconds, 
+ * aligned with the first one (unless a late tick changes the schedule, see `tick_catchup`). */
+int64_t 	conn_get_time_to_tick(netconn_t *conn);
+/* Block until the next tick is due or data arrives.
+ * Returns 1 if the tick is due (call the process function), 0 if data arrived, -1 on error. 
+ * After 0, call the drain function (or the process function) before waiting again: it returns 0 at once while the data is left unread. */
+int 		conn_wait(netconn_t *conn);
+/* Sleep until the next tick is due. 
+ * The deadline is absolute, so time spent processing does not add up as drift. */
+void 		conn_sleep(netconn_t *conn);
+/* Process the server at `tick_rate` until the event `onsrvclose` is triggered, handling incoming data as soon as it arrives.
+ * Blocks the calling thread. */
+void 		server_run(netconn_t **__conn);
+/* Process the client at `tick_rate` until the event `ondisconnect` is triggered, handling incoming data as soon as it arrives.
+ * Blocks the calling thread. */
+void 		client_run(netconn_t **__conn);
 #endif
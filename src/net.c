@@ -18,6 +18,10 @@
  * along with this program.  If not, see <https://www.gnu.org/licenses/>.
  */
 
+#ifdef __linux__
+/* recvmmsg/sendmmsg */
+#define _GNU_SOURCE
+#endif
 
 #include <stdint.h>
 #include <stdlib.h>
@@ -40,21 +44,34 @@
 #include <unistd.h>
 #include <fcntl.h>
 #endif
+#ifdef __linux__
+#include <pthread.h>
+#include <sys/random.h>
+#include <sys/timerfd.h>
+#endif
+#ifndef _WIN32
+#include <poll.h>
+#endif
+#include <time.h>
 #include <errno.h>
 
 #include "../include/packet.h"
 #include "../include/net.h"
 
-#include "../modules/uthash/src/uthash.h"
-
 #include "netmsg.h"
+#include "netio.h"
+#include "neturing.h"
+#include "nettable.h"
+#include "nettimer.h"
+#include "netcookie.h"
+#include "netrate.h"
 
 
 enum network_message
 {
 	/* the number of bits needed to represent the biggest message */
 	MESSAGE_SIZE_BITS_CLI = 2,
-	MESSAGE_SIZE_BITS_SRV = 2,
+	MESSAGE_SIZE_BITS_SRV = 3,
 	
 	/* messages that can be sent by a client to a server*/
 	CLI_NONE = 0,
@@ -67,9 +84,34 @@ enum network_message
 	SRV_PENDING_CONNECTION,
 	SRV_NOTICE_KICK,
 	SRV_REQUEST_RESET_TICK_COUNT,
+	/* reply to a connection attempt without a valid cookie. Carries the cookie to echo */
+	SRV_COOKIE,
 };
 
+/* first 2 bytes of every datagram sent by a client */
+#define NET_PROTOCOL_MAGIC 0x5546
+/* tick, message bits and cookie. Connection attempts without a cookie are padded to this length, 
+ * so the reply is never bigger than the request */
+#define SRV_COOKIE_REPLY_LEN (2 + 1 + 8)
+
 #define SERVER_BUFFER_LEN UINT16_MAX
+/* capacity mode default */
+#define DEFAULT_MESSAGES_PER_CLIENT 32
+#define DEFAULT_RATE_BURST_TICKS 	8
+#define DEFAULT_TICK_RATE 64
+#define DEFAULT_OVERFLOW_DATAGRAMS 	16
+#define NS_PER_SEC 1000000000ULL
+
+/* A connection id is the slot of the client in the server, plus the generation of the slot,
+ * so ids of clients that left are not mistaken for the client that took their slot */
+#define CONNID_SLOT_BITS 20
+#define CONNID_SLOT_MASK ((1U << CONNID_SLOT_BITS) - 1)
+#define CONNID_MAX_SLOTS (1U << CONNID_SLOT_BITS)
+#define CONNID_GENERATION_MASK ((1U << (32 - CONNID_SLOT_BITS)) - 1)
+/* a client assumes its address may have changed, and proves it owns its id, after going without response 
+ * for this fraction of `timeout_tick` (a second without timeout). The token is sent in clear, so not on every hiccup */
+#define CONNID_TOKEN_TIMEOUT_DIV 8
+#define CONNID_TOKEN_MIN_NORESP_TICKS 2
 
 #define SOCKADDR_TO_KEY(sockaddr) \
     ((((uint64_t)(sockaddr.sin_addr.s_addr)) << 16) | \
@@ -91,9 +133,31 @@ struct srvclient {
 	struct msg_handle 			*msghandle;
 	void 						*userdata;
 
-	/* Hash table stuff */
-	uint64_t 		id;
-	UT_hash_handle 	hh;
+	/* Client table stuff */
+	uint64_t 					id;
+	struct srvconn 				*server;
+	/* position in the server slots. `next_free` links the free slots */
+	uint32_t 					slot, next_free;
+	uint_fast8_t 				in_use;
+	/* incremented every time the slot is reused */
+	uint16_t 					generation;
+
+	/* id the client puts in its packets, and the secret that lets it keep the id when its address changes */
+	uint32_t 					connid;
+	uint64_t 					token;
+	/* the client already sent a packet with its id, so the server stops sending it */
+	uint_fast8_t 				connid_acked;
+
+	/* fires when the client may have timed out, or is done being kicked */
+	struct nettimer 			timer;
+	/* server tick of the last packet received. While pending, of the first one */
+	uint64_t 					last_recv_tick;
+	uint64_t 					kick_tick;
+
+	/* rate limits. Unused if disabled */
+	struct tokenbucket 			rate_packets, rate_bytes;
+	/* bytes the datagrams sent to the client are kept under. Up to the server mtu */
+	uint16_t 					mtu;
 };
 
 /* struct that holds data needed by a client */
@@ -102,13 +166,44 @@ struct cliconn {
 	struct conncommon 	common;	
 	struct sockaddr_in 	sockaddr_server;
 	struct msg_handle 	*msghandle;
+	/* given by the server once connected */
+	uint_fast8_t 		has_connid;
+	uint32_t 			connid;
+	uint64_t 			token;
+	/* given by the server while connecting */
+	uint_fast8_t 		has_cookie;
+	uint64_t 			cookie;
+	/* the first packet applied sets the remote tick, no matter what */
+	uint_fast8_t 		has_remote_tick;
 };
 
 /* struct that holds data needed by a server */
 struct srvconn {
 	uint_fast8_t 		is_closing;
 	struct srvevents 	events;
-	struct srvclient 	*connected_clients;
+	/* Clients live in fixed size chunks of slots, so they never move and are iterated with a linear scan.
+	 * Every slot in use is below `slot_count`. Released slots are reused first. */
+	struct srvclient 	**client_chunks;
+	uint32_t 			chunk_count, slot_count, client_count, free_slot, max_slots;
+	/* `settings.mtu`, the most the mtu of a client can be */
+	uint16_t 			mtu;
+	/* address/port key -> slot */
+	struct clitable 	client_table;
+	/* client timeouts and kick notices */
+	struct timerwheel 	timers;
+	/* capacity mode. Zeroed if disabled */
+	struct msg_slab 	msg_slab;
+	/* secret the handshake cookies are made with */
+	uint64_t 			cookie_key[2];
+	/* tokens each client bucket holds at most */
+	uint64_t 			rate_packets_cap, rate_bytes_cap;
+	/* pending connections admitted during the tick `admit_tick` */
+	uint64_t 			admit_tick;
+	uint32_t 			admitted;
+#ifdef NETIO_HAS_MMSG
+	struct recvbatch 	*recvbatch;
+	struct sendbatch 	*sendbatch;
+#endif
 };
 
 /* struct that represents a connection, be it a server or a client. */
@@ -117,10 +212,34 @@ struct netconn {
 	packet_t 			*out_packet;
 	uint8_t 			in_buffer[SERVER_BUFFER_LEN];
 	uint8_t 			out_buffer[SERVER_BUFFER_LEN];
+	/* message only datagrams with the messages that do not fit in the out packet, when not sent with GSO */
+	uint8_t 			overflow_buffer[SERVER_BUFFER_LEN];
+	packet_t 			*overflow_packet;
+	/* mtu of the connection the out packet is being written for */
+	uint16_t 			send_mtu;
+	/* free messages of every message handle */
+	struct msg_pool 	msg_pool;
 	int 				fd;
+#ifdef NETIO_HAS_SEGMENTATION
+	/* message only datagrams sent with UDP GSO. NULL if disabled */
+	uint8_t 			*seg_buffer;
+	packet_t 			*seg_packet;
+#endif
+#ifdef NETIO_HAS_URING
+	/* NULL if disabled */
+	struct uring 		*uring;
+#endif
 
 	uint16_t 			local_tick;
 	uint16_t 			send_skip_count;
+	/* monotonic time the next tick is due, in nanoseconds. 0 until the first tick */
+	uint64_t 			next_tick_ns;
+	uint64_t 			tick_interval_ns;
+#ifdef __linux__
+	/* timerfd used by conn_wait, -1 until needed */
+	int 				tick_fd;
+	uint64_t 			tick_fd_deadline;
+#endif
 	struct netstats 	stats;
 	struct netsettings 	settings;
 	union {
@@ -130,6 +249,103 @@ struct netconn {
 	void 				*userdata;
 };
 
+/* monotonic clock, in nanoseconds */
+static uint64_t
+net_time_ns(void)
+{
+#ifdef _WIN32
+	LARGE_INTEGER freq, count;
+	QueryPerformanceFrequency(&freq);
+	QueryPerformanceCounter(&count);
+	return (uint64_t)(count.QuadPart / freq.QuadPart) * NS_PER_SEC + (uint64_t)(count.QuadPart % freq.QuadPart) * NS_PER_SEC / freq.QuadPart;
+#else
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * NS_PER_SEC + ts.tv_nsec;
+#endif
+}
+
+/* Fills `buff` with random bytes, from the OS if possible */
+static void
+net_random(void *buff, const size_t len)
+{
+	uint64_t 	x;
+	size_t 		i;
+#ifdef __linux__
+	if (getrandom(buff, len, 0) == (ssize_t)len) {
+		return;
+	}
+#endif
+	/* xorshift seeded with the clock. Guessable, but better than nothing */
+	x = net_time_ns() ^ (uint64_t)(uintptr_t)buff ^ 0x9E3779B97F4A7C15ULL;
+	for (i = 0; i < len; i++) {
+		x ^= x << 13;
+		x ^= x >> 7;
+		x ^= x << 17;
+		((uint8_t *)buff)[i] = (uint8_t)x;
+	}
+}
+
+static void
+conn_init_timing(netconn_t *conn)
+{
+	if (conn->settings.tick_rate == 0) {
+		conn->settings.tick_rate = DEFAULT_TICK_RATE;
+	}
+	conn->tick_interval_ns = NS_PER_SEC / conn->settings.tick_rate;
+	conn->next_tick_ns = 0;
+#ifdef __linux__
+	conn->tick_fd = -1;
+	conn->tick_fd_deadline = 0;
+#endif
+}
+
+/* Called when a tick starts. Measures how late it is and applies the catch-up policy.
+ * `conn->next_tick_ns` becomes the time this tick is considered to have been due. */
+static void
+conn_tick_begin(netconn_t *conn)
+{
+	const uint64_t 	now = net_time_ns();
+	uint64_t 		late, missed;
+
+	if (conn->next_tick_ns == 0 || now < conn->next_tick_ns) {
+		/* first tick, or processed before being due: the schedule starts over from here */
+		conn->next_tick_ns = now;
+		conn->stats.last_tick_late_ns = 0;
+		return;
+	}
+	late = now - conn->next_tick_ns;
+	conn->stats.last_tick_late_ns = late;
+	if (late > conn->stats.max_tick_late_ns) {
+		conn->stats.max_tick_late_ns = late;
+	}
+	if ( (missed = late / conn->tick_interval_ns) == 0 ) {
+		/* just jitter, stay on schedule */
+		return;
+	}
+	conn->stats.late_ticks++;
+	switch ((enum netconn_tick_catchup)conn->settings.tick_catchup) {
+		case ETICK_CATCHUP_BURST:
+			if (missed <= conn->settings.tick_rate) {
+				/* the following ticks are already due */
+				break;
+			}
+			/* too far behind */
+			/* fall through */
+		case ETICK_CATCHUP_SKIP:
+			conn->next_tick_ns += missed * conn->tick_interval_ns;
+			conn->stats.skipped_ticks += missed;
+			break;
+		case ETICK_CATCHUP_STRETCH:
+		default:
+			conn->next_tick_ns = now;
+			break;
+	}
+}
+
+/* Called when a tick ends */
+#define CONN_TICK_END(conn) (conn)->next_tick_ns += (conn)->tick_interval_ns
+
 void
 diep(char *s)
 {
@@ -144,26 +360,351 @@ diep(char *s)
 	(conn)->local_tick = 0; \
 	(conn)->in_packet = packet_init_from_buff((conn)->in_buffer, SERVER_BUFFER_LEN); \
 	(conn)->out_packet = packet_init_from_buff((conn)->out_buffer, SERVER_BUFFER_LEN); \
+	(conn)->overflow_packet = packet_init_from_buff((conn)->overflow_buffer, SERVER_BUFFER_LEN); \
 	(conn)->settings = settings; \
 	(conn)->userdata = userdata; \
+	if ((conn)->settings.mtu == 0) { \
+		(conn)->settings.mtu = NETIO_DEFAULT_MTU; \
+	} \
+	if ((conn)->settings.overflow_datagrams == 0) { \
+		(conn)->settings.overflow_datagrams = DEFAULT_OVERFLOW_DATAGRAMS; \
+	} \
+	msgpool_init(&(conn)->msg_pool, &(conn)->settings); \
+	conn_init_timing(conn); \
 	/* stats */ \
 	(conn)->stats.total_sent_bytes = 0; \
 	(conn)->stats.total_received_bytes = 0;
 
-#define SRVCLIENT_FREE(conn, tmp_client, client, kick_reason) \
+#define CLIENT_CHUNK_BITS 8
+#define CLIENT_CHUNK_LEN (1U << CLIENT_CHUNK_BITS)
+#define SRV_CLIENT_AT(srv, i) (&(srv)->client_chunks[(i) >> CLIENT_CHUNK_BITS][(i) & (CLIENT_CHUNK_LEN - 1)])
+
+/* Returns a zeroed client stored in a free slot and indexed by `id`, 
+ * or NULL if memory allocation fails or there are no connection ids left. */
+static struct srvclient *
+srv_client_alloc(struct srvconn *srv, const uint64_t id)
+{
+	struct srvclient 	*client, **chunks;
+	uint32_t 			slot, generation;
+
+	if (srv->free_slot != CLITABLE_NONE) {
+		slot = srv->free_slot;
+		client = SRV_CLIENT_AT(srv, slot);
+		srv->free_slot = client->next_free;
+		generation = (client->generation + 1) & CONNID_GENERATION_MASK;
+	} else {
+		if (srv->slot_count == srv->max_slots) {
+			return NULL;
+		}
+		if (srv->slot_count == srv->chunk_count * CLIENT_CHUNK_LEN) {
+			/* only the chunk pointers move */
+			chunks = realloc(srv->client_chunks, (srv->chunk_count + 1) * sizeof(*chunks));
+			if (chunks == NULL) {
+				return NULL;
+			}
+			srv->client_chunks = chunks;
+			if ( (chunks[srv->chunk_count] = malloc(CLIENT_CHUNK_LEN * sizeof(struct srvclient))) == NULL ) {
+				return NULL;
+			}
+			srv->chunk_count++;
+		}
+		slot = srv->slot_count++;
+		generation = 0;
+		/* the chunk is not zeroed, and the slot is seen by `srv_client_next` even if it goes to the free list below */
+		memset(SRV_CLIENT_AT(srv, slot), 0, sizeof(struct srvclient));
+	}
+	client = SRV_CLIENT_AT(srv, slot);
+	if (clitable_insert(&srv->client_table, id, slot) == -1) {
+		client->next_free = srv->free_slot;
+		srv->free_slot = slot;
+		return NULL;
+	}
+	memset(client, 0, sizeof(*client));
+	client->id = id;
+	client->server = srv;
+	client->slot = slot;
+	client->in_use = 1;
+	client->generation = generation;
+	client->connid = (generation << CONNID_SLOT_BITS) | slot;
+	srv->client_count++;
+	return client;
+}
+
+static void
+srv_client_release(struct srvconn *srv, struct srvclient *client)
+{
+	nettimer_disarm(&client->timer);
+	clitable_remove(&srv->client_table, client->id);
+	client->in_use = 0;
+	client->next_free = srv->free_slot;
+	srv->free_slot = client->slot;
+	srv->client_count--;
+}
+
+/* Returns the client `connid` belongs to, or NULL if it is gone */
+static struct srvclient *
+srv_client_by_connid(struct srvconn *srv, const uint32_t connid)
+{
+	struct srvclient 	*client;
+	const uint32_t 		slot = connid & CONNID_SLOT_MASK;
+
+	if (slot >= srv->slot_count) {
+		return NULL;
+	}
+	client = SRV_CLIENT_AT(srv, slot);
+	if (!client->in_use || client->connid != connid) {
+		return NULL;
+	}
+	return client;
+}
+
+/* Indexes `client` by its new address.
+ * Returns -1 if another client uses the address or memory allocation fails. */
+static int
+srv_client_migrate(struct srvconn *srv, struct srvclient *client, const uint64_t id, const struct sockaddr_in *sockaddr)
+{
+	if (clitable_find(&srv->client_table, id) != CLITABLE_NONE) {
+		return -1;
+	}
+	if (clitable_insert(&srv->client_table, id, client->slot) == -1) {
+		return -1;
+	}
+	clitable_remove(&srv->client_table, client->id);
+	client->id = id;
+	memcpy(&client->sockaddr, sockaddr, sizeof(client->sockaddr));
+	return 0;
+}
+
+/* Returns the first client in a slot >= `slot`, or NULL */
+static struct srvclient *
+srv_client_next(struct srvconn *srv, uint32_t slot)
+{
+	struct srvclient *client;
+	for (; slot < srv->slot_count; slot++) {
+		client = SRV_CLIENT_AT(srv, slot);
+		if (client->in_use) {
+			return client;
+		}
+	}
+	return NULL;
+}
+
+#define SRVCLIENT_FREE(conn, client, kick_reason) \
 	(conn)->data.srv.events.ondisconnect(conn, (conn)->userdata, kick_reason, client, &((client)->userdata)); \
-	tmp_client = client; \
-	client = (client)->hh.next; \
-	HASH_DEL((conn)->data.srv.connected_clients, tmp_client); \
-	msghandle_free(&((tmp_client)->msghandle)); \
-	free(tmp_client);
+	msghandle_free(&((client)->msghandle)); \
+	srv_client_release(&(conn)->data.srv, client);
 
-netconn_t *
-server_init(in_addr_t ip, in_port_t port, const struct srvevents events, const struct netsettings settings, void *userdata)
+/* Writes the header of a packet to `client`. 
+ * Connected clients get their connection id until they start using it */
+static void
+srv_write_header(netconn_t *conn, struct srvclient *client, packet_t *p)
+{
+	const uint8_t has_connid = !client->connid_acked && (client->common.msg == SRV_NONE || client->common.msg == SRV_REQUEST_RESET_TICK_COUNT);
+
+	packet_w_16_t(p, &conn->local_tick);
+	packet_w_bits(p, client->common.msg, MESSAGE_SIZE_BITS_SRV);
+	packet_w_bits(p, has_connid, 1);
+	if (has_connid) {
+		packet_w_32_t(p, &client->connid);
+		packet_w_64_t(p, &client->token);
+	}
+}
+
+/* Returns the ticks without response after which the client sends its token */
+static uint16_t
+cli_token_noresp_ticks(const netconn_t *conn)
+{
+	const uint16_t 	ticks = conn->settings.timeout_tick != 0 ? conn->settings.timeout_tick / CONNID_TOKEN_TIMEOUT_DIV : conn->settings.tick_rate;
+
+	return ticks > CONNID_TOKEN_MIN_NORESP_TICKS ? ticks : CONNID_TOKEN_MIN_NORESP_TICKS;
+}
+
+/* Writes the header of a packet to the server. 
+ * Once no response arrives for a while the token goes along the connection id, 
+ * so the server can follow the client if its address changed (NAT rebinding) */
+static void
+cli_write_header(netconn_t *conn, packet_t *p)
+{
+	const uint16_t 	magic = NET_PROTOCOL_MAGIC;
+	const uint8_t 	has_token = conn->data.cli.has_connid && conn->data.cli.common.n_local_tick_noresp >= cli_token_noresp_ticks(conn);
+	const uint8_t 	has_cookie = conn->data.cli.has_cookie && conn->data.cli.common.msg == CLI_NOTICE_CONNECTING;
+
+	packet_w_16_t(p, &magic);
+	packet_w_16_t(p, &conn->local_tick);
+	packet_w_bits(p, conn->data.cli.common.msg, MESSAGE_SIZE_BITS_CLI);
+	packet_w_bits(p, conn->data.cli.has_connid, 1);
+	packet_w_bits(p, has_token, 1);
+	packet_w_bits(p, has_cookie, 1);
+	if (conn->data.cli.has_connid) {
+		packet_w_32_t(p, &conn->data.cli.connid);
+	}
+	if (has_token) {
+		packet_w_64_t(p, &conn->data.cli.token);
+	}
+	if (has_cookie) {
+		packet_w_64_t(p, &conn->data.cli.cookie);
+	}
+}
+
+/* `client` is NULL for client connections */
+#define CONN_WRITE_HEADER(conn, client, p) \
+	if ((client) != NULL) { \
+		srv_write_header(conn, client, p); \
+	} else { \
+		cli_write_header(conn, p); \
+	}
+
+#ifdef NETIO_HAS_SEGMENTATION
+static void
+conn_init_segmentation(netconn_t *conn)
+{
+	if (conn->settings.udp_segmentation == 0) {
+		return;
+	}
+	/* if GRO is not supported datagrams just arrive one by one */
+	netio_enable_gro(conn->fd);
+	conn->seg_buffer = malloc(NETIO_MAX_UDP_PAYLOAD);
+	conn->seg_packet = packet_init_from_buff(conn->seg_buffer, NETIO_MAX_UDP_PAYLOAD);
+	if (conn->seg_buffer == NULL || conn->seg_packet == NULL) {
+		free(conn->seg_buffer);
+		packet_free(&conn->seg_packet);
+		conn->seg_buffer = NULL;
+	}
+}
+
+static void
+conn_free_segmentation(netconn_t *conn)
+{
+	free(conn->seg_buffer);
+	packet_free(&conn->seg_packet);
+}
+#endif
+
+#ifdef NETIO_HAS_URING
+/* Returns 1 if io_uring is enabled and available */
+static int
+conn_init_uring(netconn_t *conn, const uint32_t send_count)
+{
+	size_t 	payload_len = conn->settings.mtu;
+	int 	with_ctrl = 0;
+
+	if (conn->settings.io_uring == 0) {
+		return 0;
+	}
+#ifdef NETIO_HAS_SEGMENTATION
+	if (conn->seg_buffer != NULL) {
+		/* GRO coalesces up to 64KB per buffer */
+		payload_len = SERVER_BUFFER_LEN;
+		with_ctrl = 1;
+	}
+#endif
+	conn->uring = uring_init(conn->fd, conn->settings.recv_batch_size > 0 ? conn->settings.recv_batch_size : URING_DEFAULT_RECV_BUFFERS, payload_len, with_ctrl, send_count);
+	return conn->uring != NULL;
+}
+#endif
+
+/* Capacity mode: allocates everything `max_clients` clients need up front.
+ * Returns -1 if memory allocation fails. */
+static int
+srv_init_capacity(netconn_t *conn)
+{
+	struct srvconn 	*srv = &conn->data.srv;
+	uint32_t 		max_clients = conn->settings.max_clients, capacity;
+
+	srv->max_slots = CONNID_MAX_SLOTS;
+	if (max_clients == 0) {
+		return 0;
+	}
+	if (max_clients < CONNID_MAX_SLOTS) {
+		srv->max_slots = max_clients;
+	}
+	if ( (srv->client_chunks = malloc((srv->max_slots + CLIENT_CHUNK_LEN - 1) / CLIENT_CHUNK_LEN * sizeof(*srv->client_chunks))) == NULL ) {
+		return -1;
+	}
+	while (srv->chunk_count * CLIENT_CHUNK_LEN < srv->max_slots) {
+		if ( (srv->client_chunks[srv->chunk_count] = malloc(CLIENT_CHUNK_LEN * sizeof(struct srvclient))) == NULL ) {
+			return -1;
+		}
+		/* touched now, so the pages do not fault in while running */
+		memset(srv->client_chunks[srv->chunk_count], 0, CLIENT_CHUNK_LEN * sizeof(struct srvclient));
+		srv->chunk_count++;
+	}
+	/* big enough to never grow */
+	for (capacity = CLITABLE_MIN_CAPACITY; capacity < srv->max_slots * 2; capacity *= 2);
+	clitable_free(&srv->client_table);
+	if (clitable_init(&srv->client_table, capacity) == -1) {
+		return -1;
+	}
+	return msgslab_init(&srv->msg_slab, srv->max_slots, 
+			conn->settings.max_messages > 0 ? conn->settings.max_messages : srv->max_slots * DEFAULT_MESSAGES_PER_CLIENT, 
+			conn->settings.max_message_len > 0 ? conn->settings.max_message_len : conn->settings.mtu, 
+			msg_ring_len(conn->settings.message_window));
+}
+
+static void
+srv_init_rate(netconn_t *conn)
+{
+	struct srvconn *srv = &conn->data.srv;
+
+	if (conn->settings.client_rate_burst_ticks == 0) {
+		conn->settings.client_rate_burst_ticks = DEFAULT_RATE_BURST_TICKS;
+	}
+	srv->rate_packets_cap = (uint64_t)conn->settings.client_packets_per_tick * conn->settings.client_rate_burst_ticks;
+	srv->rate_bytes_cap = (uint64_t)conn->settings.client_bytes_per_tick * conn->settings.client_rate_burst_ticks;
+	if (srv->rate_bytes_cap < conn->settings.mtu) {
+		srv->rate_bytes_cap = conn->settings.mtu;
+	}
+}
+
+/* Returns 1 if a datagram of `len` bytes from `client` is within its rate limits */
+static int
+srv_client_rate_check(netconn_t *conn, struct srvclient *client, const uint64_t len)
+{
+	struct srvconn 	*srv = &conn->data.srv;
+
+	if (conn->settings.client_packets_per_tick > 0 
+			&& !tokenbucket_take(&client->rate_packets, srv->timers.now, conn->settings.client_packets_per_tick, srv->rate_packets_cap, 1)) {
+		return 0;
+	}
+	if (conn->settings.client_bytes_per_tick > 0 
+			&& !tokenbucket_take(&client->rate_bytes, srv->timers.now, conn->settings.client_bytes_per_tick, srv->rate_bytes_cap, len)) {
+		return 0;
+	}
+	return 1;
+}
+
+/* Returns 1 if the admission budget of the current tick allows one more pending connection */
+static int
+srv_admit_pending(netconn_t *conn)
+{
+	struct srvconn 	*srv = &conn->data.srv;
+
+	if (conn->settings.pending_conn_per_tick == 0) {
+		return 1;
+	}
+	if (srv->admit_tick != srv->timers.now) {
+		srv->admit_tick = srv->timers.now;
+		srv->admitted = 0;
+	}
+	if (srv->admitted == conn->settings.pending_conn_per_tick) {
+		conn->stats.deferred_connections++;
+		return 0;
+	}
+	srv->admitted++;
+	return 1;
+}
+
+/* `reuseport` allows many servers to bind to the same address and port */
+static netconn_t *
+server_init_socket(in_addr_t ip, in_port_t port, const struct srvevents events, const struct netsettings settings, void *userdata, const int reuseport)
 {
 	netconn_t 				*conn = malloc(sizeof(netconn_t));
 	struct sockaddr_in 		sockaddr_server = {0};
 
+	if (conn == NULL) {
+		diep("malloc");
+		return NULL;
+	}
 	memset(conn, 0, sizeof(*conn));
 
 	/* obtain socket */
@@ -173,13 +714,24 @@ server_init(in_addr_t ip, in_port_t port, const struct srvevents events, const s
 		return NULL;
 	}
 
+#ifdef NET_HAS_SERVER_GROUP
+	if (reuseport) {
+		const int one = 1;
+		if (setsockopt(conn->fd, SOL_SOCKET, SO_REUSEPORT, &one, sizeof(one)) == SOCKET_ERROR) {
+			diep("setsockopt");
+			goto fail_socket;
+		}
+	}
+#else
+	(void)reuseport;
+#endif
+
 	/* set fd as non-blocking */
 #ifdef _WIN32
 	u_long mode = 1;
 	if (ioctlsocket(conn->fd, FIONBIO, &mode) == SOCKET_ERROR) {
 		diep("ioctlsocket");
-		free(conn);
-		return NULL;
+		goto fail_socket;
 	}
 #else	
 	int flags = fcntl(conn->fd, F_GETFL);
@@ -193,8 +745,7 @@ server_init(in_addr_t ip, in_port_t port, const struct srvevents events, const s
 
 	if ( bind(conn->fd, (struct sockaddr *)&sockaddr_server, sizeof(sockaddr_server)) == SOCKET_ERROR) {
 		diep("bind");
-		free(conn);
-		return NULL;
+		goto fail_socket;
 	}
 
 	/* initialize common stuff */
@@ -203,10 +754,77 @@ server_init(in_addr_t ip, in_port_t port, const struct srvevents events, const s
 	/* initialize srv specific stuff */
 	conn->data.srv.is_closing = 0;
 	conn->data.srv.events = events;
-	conn->data.srv.connected_clients = NULL;
+	conn->data.srv.free_slot = CLITABLE_NONE;
+	conn->data.srv.mtu = conn->settings.mtu;
+	if (clitable_init(&conn->data.srv.client_table, CLITABLE_MIN_CAPACITY) == -1) {
+		diep("malloc");
+		goto fail;
+	}
+	timerwheel_init(&conn->data.srv.timers);
+	net_random(conn->data.srv.cookie_key, sizeof(conn->data.srv.cookie_key));
+	srv_init_rate(conn);
+	if (srv_init_capacity(conn) == -1) {
+		/* expected with a `max_clients` or `max_messages` too big for the memory available */
+		diep("malloc");
+		goto fail;
+	}
+#ifdef NETIO_HAS_SEGMENTATION
+	conn_init_segmentation(conn);
+#endif
+#ifdef NETIO_HAS_URING
+	if (conn_init_uring(conn, conn->settings.send_batch_size > 0 ? conn->settings.send_batch_size : URING_DEFAULT_SEND_BATCH)) {
+		/* sends are queued in the batch and submitted to the ring */
+		conn->data.srv.sendbatch = sendbatch_init(conn->settings.send_batch_size > 0 ? conn->settings.send_batch_size : URING_DEFAULT_SEND_BATCH, conn->settings.mtu, SERVER_BUFFER_LEN);
+		return conn;
+	}
+#endif
+#ifdef NETIO_HAS_SEGMENTATION
+	if (conn->seg_buffer != NULL) {
+		/* GRO coalesces up to 64KB per slot */
+		conn->data.srv.recvbatch = recvbatch_init(conn->settings.recv_batch_size, SERVER_BUFFER_LEN, 1);
+	} else
+#endif
+#ifdef NETIO_HAS_MMSG
+	/* NULL if disabled, falls back to recvfrom */
+	conn->data.srv.recvbatch = recvbatch_init(conn->settings.recv_batch_size, conn->settings.mtu, 0);
+	conn->data.srv.sendbatch = sendbatch_init(conn->settings.send_batch_size, conn->settings.mtu, SERVER_BUFFER_LEN);
+#endif
 
 	return conn;
+fail:
+	/* everything is initialized (or zeroed) at this point */
+	server_free(&conn);
+	return NULL;
+fail_socket:
+#ifdef _WIN32
+	closesocket(conn->fd);
+#else
+	close(conn->fd);
+#endif
+	free(conn);
+	return NULL;
+}
+
+netconn_t *
+server_init(in_addr_t ip, in_port_t port, const struct srvevents events, const struct netsettings settings, void *userdata)
+{
+	return server_init_socket(ip, port, events, settings, userdata, 0);
+}
+
+#ifdef NETIO_HAS_MMSG
+/* Send the datagrams of the server batch, through the ring if enabled. */
+static void
+srv_flush_sendbatch(netconn_t *conn)
+{
+#ifdef NETIO_HAS_URING
+	if (conn->uring != NULL) {
+		conn->stats.total_sent_bytes += uring_send_batch(conn->uring, conn->data.srv.sendbatch);
+		return;
+	}
+#endif
+	conn->stats.total_sent_bytes += sendbatch_flush(conn->data.srv.sendbatch, conn->fd);
 }
+#endif
 
 void
 server_free(netconn_t **conn)
@@ -217,15 +835,40 @@ server_free(netconn_t **conn)
 		return;
 
 	netconn_t 			*c = *conn;
-	struct srvclient 	*client, *tmpcli;
+	struct srvclient 	*client;
+	uint32_t 			i;
 
-	if (HASH_COUNT(c->data.srv.connected_clients) > 0) {
-		/* if for some reason the server is not empty */
-		for (client = c->data.srv.connected_clients; client != NULL; ) {
-			/* free client */
-			SRVCLIENT_FREE(c, tmpcli, client, EKICK_SERVER_CLOSING);
-		}
+	/* if for some reason the server is not empty */
+	for (client = srv_client_next(&c->data.srv, 0); client != NULL; client = srv_client_next(&c->data.srv, client->slot + 1)) {
+		/* free client */
+		SRVCLIENT_FREE(c, client, EKICK_SERVER_CLOSING);
+	}
+	for (i = 0; i < c->data.srv.chunk_count; i++) {
+		free(c->data.srv.client_chunks[i]);
+	}
+	free(c->data.srv.client_chunks);
+	clitable_free(&c->data.srv.client_table);
+	msgslab_free(&c->data.srv.msg_slab);
+	msgpool_free(&c->msg_pool);
+#ifdef NETIO_HAS_MMSG
+	recvbatch_free(&c->data.srv.recvbatch);
+	if (c->data.srv.sendbatch != NULL) {
+		/* last chance for datagrams carried over */
+		srv_flush_sendbatch(c);
 	}
+	sendbatch_free(&c->data.srv.sendbatch);
+#endif
+#ifdef NETIO_HAS_URING
+	uring_free(&c->uring);
+#endif
+#ifdef NETIO_HAS_SEGMENTATION
+	conn_free_segmentation(c);
+#endif
+#ifdef __linux__
+	if (c->tick_fd >= 0) {
+		close(c->tick_fd);
+	}
+#endif
 #ifdef _WIN32
 	closesocket(c->fd);
 #else
@@ -233,6 +876,7 @@ server_free(netconn_t **conn)
 #endif
 	packet_free(&c->in_packet);
 	packet_free(&c->out_packet);
+	packet_free(&c->overflow_packet);
 	free(c);
 	*conn = NULL;
 }
@@ -246,6 +890,17 @@ client_free(netconn_t **conn)
 		return;
 
 	netconn_t 			*c = *conn;
+#ifdef NETIO_HAS_SEGMENTATION
+	conn_free_segmentation(c);
+#endif
+#ifdef NETIO_HAS_URING
+	uring_free(&c->uring);
+#endif
+#ifdef __linux__
+	if (c->tick_fd >= 0) {
+		close(c->tick_fd);
+	}
+#endif
 #ifdef _WIN32
 	closesocket(c->fd);
 #else
@@ -253,7 +908,9 @@ client_free(netconn_t **conn)
 #endif
 	packet_free(&c->in_packet);
 	packet_free(&c->out_packet);
+	packet_free(&c->overflow_packet);
 	msghandle_free(&c->data.cli.msghandle);	
+	msgpool_free(&c->msg_pool);
 	free(c);
 	*conn = NULL;
 
@@ -298,14 +955,20 @@ client_init(in_addr_t ip, in_port_t port, const struct clievents events, const s
 	conn->data.cli.common.cur_remote_tick = 0;
 	conn->data.cli.common.n_local_tick_noresp = 0;
 
-	conn->data.cli.msghandle = msghandle_init();
-
 	/* initialize common stuff */
 	NETCONN_INIT_COMMON(conn);
 
+	conn->data.cli.msghandle = msghandle_init(NULL, &conn->msg_pool, &conn->settings);
+#ifdef NETIO_HAS_SEGMENTATION
+	conn_init_segmentation(conn);
+#endif
+#ifdef NETIO_HAS_URING
+	/* a single datagram is sent per tick, so only receiving goes through the ring */
+	conn_init_uring(conn, 1);
+#endif
+
 	/* prepare first packet */
-	packet_w_16_t(conn->out_packet, &conn->local_tick);
-	packet_w_bits(conn->out_packet, conn->data.cli.common.msg, MESSAGE_SIZE_BITS_CLI);
+	cli_write_header(conn, conn->out_packet);
 	conn->data.cli.events.onconnect(conn, conn->userdata, conn->in_packet, conn->out_packet);
 	return conn;
 }
@@ -328,194 +991,539 @@ client_init(in_addr_t ip, in_port_t port, const struct clievents events, const s
 	if (diff1 > 32768) { diff1 -= 65536; } else if (diff1 < -32768) { diff1 += 65536; } \
 	if (((diff < 0 ? -diff : diff) <= (margin) && diff1 >= 0) extra_condition )
 
-#define SRV_KICK_CLIENT(clientptr,reason) (clientptr)->common.msg = SRV_NOTICE_KICK; (clientptr)->kick_reason = reason; (clientptr)->common.cur_remote_tick = 0;
+/* the timer is due in the current tick, so `srv_expire_clients` pops it in this tick (at once if it is the caller), 
+ * and arms it again for the end of the kick notices from there */
+#define SRV_KICK_CLIENT(clientptr,reason) (clientptr)->common.msg = SRV_NOTICE_KICK; (clientptr)->kick_reason = reason; \
+	(clientptr)->kick_tick = (clientptr)->server->timers.now; \
+	nettimer_arm(&(clientptr)->server->timers, &(clientptr)->timer, (clientptr)->kick_tick);
+
+/* ticks since the last packet from `client` */
+#define SRV_CLIENT_NORESP(client) ((client)->server->timers.now - (client)->last_recv_tick)
 
 #define SRV_CLIENT_ISCONNECTED(client) ((client)->common.msg == SRV_NONE || (client)->common.msg == SRV_REQUEST_RESET_TICK_COUNT)
 
-void
-server_process(netconn_t **__conn)
+/* Returns the server tick `client` times out or is removed at, UINT64_MAX if never */
+static uint64_t
+srv_client_deadline(const netconn_t *conn, const struct srvclient *client)
 {
-	ssize_t 					recvlen;
-	uint64_t 					cli_id;
-	struct srvclient			*client, *tmp_client;
-	uint16_t		 			cli_tick;
-	uint8_t 					cli_msg;
-	int32_t 					diff, diff1;
-	int 						err;
-	struct sockaddr_in 			sockaddr_client;
-	socklen_t 					socklen = sizeof(sockaddr_client);
-	netconn_t 					*conn;
+	uint64_t deadline = UINT64_MAX;
 
-	if(__conn == NULL)
-		return;
-	if(*__conn == NULL)
+	if (client->common.msg == SRV_NOTICE_KICK) {
+		return client->kick_tick + conn->settings.kick_notice_tick;
+	}
+	if (conn->settings.timeout_tick != 0) {
+		deadline = client->last_recv_tick + conn->settings.timeout_tick;
+	}
+	if (client->common.msg == SRV_PENDING_CONNECTION && conn->settings.pending_conn_timeout_tick != 0 
+			&& client->last_recv_tick + conn->settings.pending_conn_timeout_tick < deadline) {
+		deadline = client->last_recv_tick + conn->settings.pending_conn_timeout_tick;
+	}
+	return deadline;
+}
+
+static void
+srv_client_arm_timer(netconn_t *conn, struct srvclient *client)
+{
+	const uint64_t deadline = srv_client_deadline(conn, client);
+	if (deadline == UINT64_MAX) {
+		nettimer_disarm(&client->timer);
 		return;
+	}
+	nettimer_arm(&conn->data.srv.timers, &client->timer, deadline);
+}
 
-	conn = *__conn;
+/* Handle the clients whose timer fires in the current tick, then moves to the next tick.
+ * Receiving a packet does not touch the timer, so the deadline is checked again when it fires. */
+static void
+srv_expire_clients(netconn_t *conn)
+{
+	struct timerwheel 	*timers = &conn->data.srv.timers;
+	struct nettimer 	*timer;
+	struct srvclient 	*client;
 
-	if (conn->data.srv.is_closing == 1) {
-		/* Server is closing. 
-		 * Incoming packets are ignored. 
-		 * All clients common.msg should now be SRV_NOTICE_KICK. */
-		if (HASH_COUNT(conn->data.srv.connected_clients) == 0) {
-			conn->data.srv.events.onsrvclose(__conn, conn->userdata);
-			return;
+	while ( (timer = timerwheel_pop_expired(timers)) != NULL ) {
+		client = NETTIMER_ENTRY(timer, struct srvclient, timer);
+		if (srv_client_deadline(conn, client) > timers->now) {
+			/* got a response since the timer was armed */
+			srv_client_arm_timer(conn, client);
+		} else if (client->common.msg == SRV_NOTICE_KICK) {
+			/* Kick notice already sent multiple times. 
+			 * Call ondisconnect and remove client */
+			SRVCLIENT_FREE(conn, client, client->kick_reason);
+		} else {
+			SRV_KICK_CLIENT(client, EKICK_CONNECTION_TIMEOUT);
 		}
-		goto send_process;
 	}
+	timerwheel_advance(timers);
+}
 
-	/* Receive data from clients */
-	while(1) {
-		if ( (recvlen = recvfrom(conn->fd, (char *)conn->in_buffer, SERVER_BUFFER_LEN, 0, (struct sockaddr *)&sockaddr_client, &socklen)) == SOCKET_ERROR ) {
-			if (SOCKETWOULDBLOCK) {
-				/* no more datagrams */
-				break;
+/* recvfrom into `conn->in_buffer`.
+ * `seg_size` is set to the size of each datagram if the kernel coalesced many of them (GRO), 0 otherwise. */
+static ssize_t
+conn_recv(netconn_t *conn, struct sockaddr_in *addr, uint16_t *seg_size)
+{
+	socklen_t socklen = sizeof(struct sockaddr_in);
+	*seg_size = 0;
+#ifdef NETIO_HAS_SEGMENTATION
+	if (conn->seg_buffer != NULL) {
+		return netio_recv(conn->fd, conn->in_buffer, SERVER_BUFFER_LEN, addr, seg_size);
+	}
+#endif
+	return recvfrom(conn->fd, (char *)conn->in_buffer, SERVER_BUFFER_LEN, 0, (struct sockaddr *)addr, &socklen);
+}
+
+#ifdef NETIO_HAS_SEGMENTATION
+/* Send the first `len` bytes of `conn->seg_buffer` as datagrams of `mtu` bytes */
+static void
+conn_send_segments(netconn_t *conn, const uint32_t len, const uint32_t mtu, struct sockaddr_in *addr)
+{
+	ssize_t sent;
+	if ( (sent = netio_send_segments(conn->fd, conn->seg_buffer, len, mtu, addr)) == -1 ) {
+		if (SOCKETWOULDBLOCK) {
+			fprintf(stderr,"sendmsg would block. OS or network can't keep up\n");
+		} else {
+			perror("sendmsg()");
+		}
+		return;
+	}
+	conn->stats.total_sent_bytes += sent;
+}
+
+/* Sends the messages `msg_onsend_process` left out of `conn->out_packet` as message only datagrams of `mtu` bytes, 
+ * with as few syscalls as possible (UDP GSO). Every datagram is padded to `mtu` bytes, as required by GSO.
+ * `client` is the receiver, NULL for client connections.
+ * If it fits, `conn->out_packet` goes as the last datagram and 1 is returned. 
+ * Otherwise 0 is returned and `conn->out_packet` should be sent by the caller. */
+static int
+conn_send_segmented(netconn_t *conn, struct msg_handle *hmsg, struct srvclient *client, struct sockaddr_in *addr, const uint32_t mtu)
+{
+	const uint32_t 		out_len = packet_get_length(conn->out_packet);
+	uint32_t 			max_segments = NETIO_MAX_UDP_PAYLOAD / mtu, nseg = 0, len = 0, seglen;
+	struct message 		*cursor = hmsg->send, *first;
+
+	if (max_segments > NETIO_MAX_SEGMENTS) {
+		max_segments = NETIO_MAX_SEGMENTS;
+	}
+	if (max_segments > conn->settings.overflow_datagrams + 1U) {
+		max_segments = conn->settings.overflow_datagrams + 1U;
+	}
+	/* the last segment is reserved for the out packet. 
+	 * Messages that do not fit are sent in the next ticks, as they are kept until acknowledged */
+	while (cursor != NULL && nseg + 1 < max_segments) {
+		first = cursor;
+		packet_set_buff(conn->seg_packet, conn->seg_buffer + len, NETIO_MAX_UDP_PAYLOAD - len);
+		CONN_WRITE_HEADER(conn, client, conn->seg_packet);
+		msg_onsend_continuation(conn->seg_packet, hmsg, &cursor, mtu);
+		seglen = packet_get_length(conn->seg_packet);
+		if (seglen > mtu) {
+			/* a single message bigger than mtu. Send it on its own, fragmented by IP */
+			if (len > 0) {
+				conn_send_segments(conn, len, mtu, addr);
+				len = nseg = 0;
+				cursor = first;
+				continue;
 			}
-			/* error */
-			diep("recvfrom()");
+			SENDTO(conn->fd, conn->seg_buffer, seglen, (*addr), sizeof(struct sockaddr_in));
 			continue;
 		}
-		conn->stats.total_received_bytes += recvlen;
-		packet_rewind(conn->in_packet);
-		packet_set_length(conn->in_packet, recvlen);
-		err = 0;
-		/* Read header */
-		err += packet_r_16_t(conn->in_packet, &cli_tick);
-		err += packet_r_bits(conn->in_packet, &cli_msg, MESSAGE_SIZE_BITS_CLI);
-		if (err > 0) {
-			/* Invalid data. Ignore. */
-			continue;
+		memset(conn->seg_buffer + len + seglen, 0, mtu - seglen);
+		len += mtu;
+		nseg++;
+	}
+	packet_set_buff(conn->seg_packet, conn->seg_buffer, NETIO_MAX_UDP_PAYLOAD);
+	if (out_len <= mtu) {
+		memcpy(conn->seg_buffer + len, packet_get_buff(conn->out_packet), out_len);
+		conn_send_segments(conn, len + out_len, mtu, addr);
+		return 1;
+	}
+	if (len > 0) {
+		conn_send_segments(conn, len, mtu, addr);
+	}
+	return 0;
+}
+#endif
+
+/* Sends the messages `msg_onsend_process` left out of `conn->out_packet` as up to `overflow_datagrams` message only datagrams of `mtu` bytes.
+ * Messages that do not fit are sent in the next ticks, as they are kept until acknowledged.
+ * `client` is the receiver, NULL for client connections.
+ * Returns 1 if `conn->out_packet` was sent along them (see `conn_send_segmented`), 0 if it should be sent by the caller. */
+static int
+conn_send_overflow(netconn_t *conn, struct msg_handle *hmsg, struct srvclient *client, struct sockaddr_in *addr, const uint32_t mtu)
+{
+	struct message 	*cursor = hmsg->send;
+	uint32_t 		i;
+
+#ifdef NETIO_HAS_SEGMENTATION
+	if (conn->seg_buffer != NULL) {
+		return conn_send_segmented(conn, hmsg, client, addr, mtu);
+	}
+#endif
+	for (i = 0; cursor != NULL && i < conn->settings.overflow_datagrams; i++) {
+		packet_rewind(conn->overflow_packet);
+		CONN_WRITE_HEADER(conn, client, conn->overflow_packet);
+		if (msg_onsend_continuation(conn->overflow_packet, hmsg, &cursor, mtu) == 0) {
+			break;
 		}
-		/* Find client by id */
-		client = NULL;
-		cli_id = SOCKADDR_TO_KEY(sockaddr_client);
-		HASH_FIND(hh, conn->data.srv.connected_clients, &cli_id, sizeof(cli_id), client);
+		SENDTO(conn->fd, conn->overflow_buffer, packet_get_length(conn->overflow_packet), (*addr), sizeof(struct sockaddr_in));
+	}
+	return 0;
+}
 
-		if (client == NULL) {
-			if (cli_msg == CLI_NOTICE_DISCONNECT) {
-				/* already disconnected client. 
-				 * Send a reply letting it know that it's already considered as disconnected. */
-				packet_rewind(conn->out_packet);
-				packet_w_16_t(conn->out_packet, &conn->local_tick);
-				packet_w_bits(conn->out_packet, SRV_NOTICE_KICK, MESSAGE_SIZE_BITS_SRV);
-				packet_w_bits(conn->out_packet, EKICK_DISCONNECT, network_kick_bit_size);
-				SENDTO(conn->fd,conn->out_buffer, packet_get_length(conn->out_packet), sockaddr_client, socklen)
-				continue;
+/* Handle a single datagram from `sockaddr_client`, already stored in the buffer `conn->in_packet` points to. */
+static void
+server_receive(netconn_t *conn, struct sockaddr_in *sockaddr_client, const ssize_t recvlen)
+{
+	uint64_t 					cli_id;
+	uint32_t 					slot;
+	struct srvclient			*client;
+	uint16_t		 			cli_tick;
+	uint16_t 					magic;
+	uint8_t 					cli_msg, has_connid, has_token, has_cookie;
+	uint32_t 					connid;
+	uint64_t 					token, cookie;
+	int32_t 					diff, diff1;
+	int 						err;
+	const socklen_t 			socklen = sizeof(struct sockaddr_in);
+
+	conn->stats.total_received_bytes += recvlen;
+	packet_rewind(conn->in_packet);
+	packet_set_length(conn->in_packet, recvlen);
+	if (packet_r_16_t(conn->in_packet, &magic) != 0 || magic != NET_PROTOCOL_MAGIC) {
+		/* Stray traffic. Ignore. */
+		return;
+	}
+	err = 0;
+	/* Read header */
+	err += packet_r_16_t(conn->in_packet, &cli_tick);
+	cli_msg = has_connid = has_token = has_cookie = 0;
+	err += packet_r_bits(conn->in_packet, &cli_msg, MESSAGE_SIZE_BITS_CLI);
+	err += packet_r_bits(conn->in_packet, &has_connid, 1);
+	err += packet_r_bits(conn->in_packet, &has_token, 1);
+	err += packet_r_bits(conn->in_packet, &has_cookie, 1);
+	if (has_connid) {
+		err += packet_r_32_t(conn->in_packet, &connid);
+	}
+	if (has_token) {
+		err += packet_r_64_t(conn->in_packet, &token);
+	}
+	if (has_cookie) {
+		err += packet_r_64_t(conn->in_packet, &cookie);
+	}
+	if (err > 0) {
+		/* Invalid data. Ignore. */
+		return;
+	}
+	client = NULL;
+	cli_id = SOCKADDR_TO_KEY((*sockaddr_client));
+	if (has_connid && (client = srv_client_by_connid(&conn->data.srv, connid)) != NULL) {
+		/* Found by connection id */
+		if (client->id != cli_id) {
+			/* the address changed. Only follow the client if it proves it owns the id */
+			if (!has_token || !secret_equal(token, client->token) || srv_client_migrate(&conn->data.srv, client, cli_id, sockaddr_client) == -1) {
+				return;
 			}
-			/* initialize client */
-			client = malloc(sizeof(struct srvclient));
-			client->id = cli_id;
-			client->common.n_local_tick_noresp = 0;
-			client->common.cur_remote_tick = 0;
-			client->common.expected_remote_tick = 0;
-			client->userdata = NULL;
-			client->msghandle = msghandle_init();
-			client->common.msg = SRV_PENDING_CONNECTION;
-			memcpy(&client->sockaddr, &sockaddr_client, socklen);
-			HASH_ADD(hh, conn->data.srv.connected_clients, id, sizeof(cli_id), client);
-
-			goto pending_connection;
-		} 
-		if (client->common.msg == SRV_NOTICE_KICK) {
-			/* the server will kick this client */
-			continue;
 		}
+		client->connid_acked = 1;
+	} else if ( (slot = clitable_find(&conn->data.srv.client_table, cli_id)) != CLITABLE_NONE ) {
+		/* Find client by address */
+		client = SRV_CLIENT_AT(&conn->data.srv, slot);
+	}
 
-		/* Check for messages */
+	if (client == NULL) {
 		if (cli_msg == CLI_NOTICE_DISCONNECT) {
-			/* call ondisconnect and remove client */
-			SRVCLIENT_FREE(conn, tmp_client, client, EKICK_DISCONNECT);
-			continue;
-		} else if (cli_msg == CLI_NOTICE_RESET_TICK_COUNT) {
-			/* client notified that cli tick count was reseted */
-			if (client->common.msg == SRV_REQUEST_RESET_TICK_COUNT) {
-				/* if we got here chances are that the client lost connection at some point and now (super late) is recovering */
-				client->common.msg = SRV_NONE;
+			/* already disconnected client. 
+			 * Send a reply letting it know that it's already considered as disconnected. */
+			packet_rewind(conn->out_packet);
+			packet_w_16_t(conn->out_packet, &conn->local_tick);
+			packet_w_bits(conn->out_packet, SRV_NOTICE_KICK, MESSAGE_SIZE_BITS_SRV);
+			/* no connection id */
+			packet_w_bits(conn->out_packet, 0, 1);
+			packet_w_bits(conn->out_packet, EKICK_DISCONNECT, network_kick_bit_size);
+			SENDTO(conn->fd,conn->out_buffer, packet_get_length(conn->out_packet), (*sockaddr_client), socklen)
+			return;
+		}
+		if (cli_msg != CLI_NOTICE_CONNECTING) {
+			/* Unknown client. Ignore. */
+			return;
+		}
+		if (!has_cookie || !cookie_check(conn->data.srv.cookie_key, cli_id, conn->data.srv.timers.now, cookie)) {
+			/* No state is kept until the client proves it receives datagrams at its address, by echoing a cookie. 
+			 * Requests smaller than the reply are not answered, so spoofed ones can't be amplified. */
+			if (recvlen >= SRV_COOKIE_REPLY_LEN) {
+				cookie = cookie_make(conn->data.srv.cookie_key, cli_id, conn->data.srv.timers.now);
+				packet_rewind(conn->out_packet);
+				packet_w_16_t(conn->out_packet, &conn->local_tick);
+				packet_w_bits(conn->out_packet, SRV_COOKIE, MESSAGE_SIZE_BITS_SRV);
+				/* no connection id */
+				packet_w_bits(conn->out_packet, 0, 1);
+				packet_w_64_t(conn->out_packet, &cookie);
+				SENDTO(conn->fd,conn->out_buffer, packet_get_length(conn->out_packet), (*sockaddr_client), socklen)
 			}
-			goto applypacket;
+			return;
+		}
+		if (!srv_admit_pending(conn)) {
+			/* over budget. The client retries with the same cookie */
+			return;
+		}
+		/* initialize client */
+		if ( (client = srv_client_alloc(&conn->data.srv, cli_id)) == NULL ) {
+			/* out of memory. Ignore. */
+			return;
+		}
+		tokenbucket_init(&client->rate_packets, conn->data.srv.timers.now, conn->data.srv.rate_packets_cap);
+		tokenbucket_init(&client->rate_bytes, conn->data.srv.timers.now, conn->data.srv.rate_bytes_cap);
+		client->common.cur_remote_tick = 0;
+		client->common.expected_remote_tick = 0;
+		client->userdata = NULL;
+		client->mtu = conn->settings.mtu;
+		if ( (client->msghandle = msghandle_init(conn->data.srv.msg_slab.handles != NULL ? &conn->data.srv.msg_slab : NULL, &conn->msg_pool, &conn->settings)) == NULL ) {
+			/* out of memory. Ignore. */
+			srv_client_release(&conn->data.srv, client);
+			return;
+		}
+		client->common.msg = SRV_PENDING_CONNECTION;
+		client->last_recv_tick = conn->data.srv.timers.now;
+		srv_client_arm_timer(conn, client);
+		memcpy(&client->sockaddr, sockaddr_client, socklen);
+
+		goto pending_connection;
+	} 
+	if (!srv_client_rate_check(conn, client, recvlen)) {
+		/* Flooding. Drop. */
+		conn->stats.rate_limited_packets++;
+		return;
+	}
+	if (client->common.msg == SRV_NOTICE_KICK) {
+		/* the server will kick this client */
+		return;
+	}
+
+	/* Check for messages */
+	if (cli_msg == CLI_NOTICE_DISCONNECT) {
+		/* call ondisconnect and remove client */
+		SRVCLIENT_FREE(conn, client, EKICK_DISCONNECT);
+		return;
+	} else if (cli_msg == CLI_NOTICE_RESET_TICK_COUNT) {
+		/* client notified that cli tick count was reseted */
+		if (client->common.msg == SRV_REQUEST_RESET_TICK_COUNT) {
+			/* if we got here chances are that the client lost connection at some point and now (super late) is recovering */
+			client->common.msg = SRV_NONE;
 		}
+		goto applypacket;
+	}
 
-		IF_WHITHIN_EXPECTED(cli_tick, client->common.cur_remote_tick, client->common.expected_remote_tick, conn->settings.expected_tick_tolerance, && (client->common.n_local_tick_noresp <= 16384 && client->common.msg != SRV_REQUEST_RESET_TICK_COUNT)) {
+	IF_WHITHIN_EXPECTED(cli_tick, client->common.cur_remote_tick, client->common.expected_remote_tick, conn->settings.expected_tick_tolerance, && (SRV_CLIENT_NORESP(client) <= 16384 && client->common.msg != SRV_REQUEST_RESET_TICK_COUNT)) {
 applypacket:
-			client->common.cur_remote_tick = cli_tick;
-			client->common.expected_remote_tick = cli_tick;
-			if (cli_msg == CLI_NOTICE_CONNECTING) {
-				if (client->common.msg == SRV_PENDING_CONNECTION) {
+		client->common.cur_remote_tick = cli_tick;
+		client->common.expected_remote_tick = cli_tick;
+		if (cli_msg == CLI_NOTICE_CONNECTING) {
+			if (client->common.msg != SRV_PENDING_CONNECTION) {
+				/* accepted, but the client didn't hear back yet */
+				client->last_recv_tick = conn->data.srv.timers.now;
+			} else if (srv_admit_pending(conn)) {
 pending_connection:
-					/* call onconnect */
-					packet_rewind(conn->out_packet);
-					packet_w_16_t(conn->out_packet, &conn->local_tick);
-					packet_w_bits(conn->out_packet, client->common.msg, MESSAGE_SIZE_BITS_SRV);
-					switch((enum netconn_connect_result)conn->data.srv.events.onconnect(conn, conn->userdata, conn->in_packet, conn->out_packet, client, &client->userdata)) {
-						case ECONNECTION_ALLOW:
-							client->common.msg = SRV_NONE;
-							client->common.expected_remote_tick = cli_tick;
-							break;
-						case ECONNECTION_REFUSE:
-							SRV_KICK_CLIENT(client, EKICK_CONNECTION_REFUSED);
-							break;
-						case ECONNECTION_AGAIN:
-							SENDTO(conn->fd,conn->out_buffer, packet_get_length(conn->out_packet), client->sockaddr, socklen);
-							break;
-					}
-					continue;
+				/* call onconnect */
+				packet_rewind(conn->out_packet);
+				srv_write_header(conn, client, conn->out_packet);
+				switch((enum netconn_connect_result)conn->data.srv.events.onconnect(conn, conn->userdata, conn->in_packet, conn->out_packet, client, &client->userdata)) {
+					case ECONNECTION_ALLOW:
+						net_random(&client->token, sizeof(client->token));
+						client->common.msg = SRV_NONE;
+						client->common.expected_remote_tick = cli_tick;
+						break;
+					case ECONNECTION_REFUSE:
+						SRV_KICK_CLIENT(client, EKICK_CONNECTION_REFUSED);
+						break;
+					case ECONNECTION_AGAIN:
+						SENDTO(conn->fd,conn->out_buffer, packet_get_length(conn->out_packet), client->sockaddr, socklen);
+						break;
 				}
+			}
+			return;
+		}
+		/* call onreceive */
+		client->last_recv_tick = conn->data.srv.timers.now;
+		if (msg_onreceive_process(conn->in_packet, client->msghandle, conn, conn->userdata, &conn->data.srv.events, NULL, client)) {
+			/* message only datagram */
+			return;
+		}
+		conn->data.srv.events.onreceivepkt(conn, conn->userdata, conn->in_packet, client, client->userdata);
+	} else if ( SRV_CLIENT_NORESP(client) > 16384 ) {
+		/* assuming a tickrate of 128 (very high), this client sent a message after 128 secs (2.1 mins) of no response (connection loss?), 
+		 * so the packet is ignored and the message SRV_REQUEST_RESET_TICK_COUNT is sent until client responds with CLI_NOTICE_RESET_TICK_COUNT 
+		 * or the connection times out */
+		client->common.msg = SRV_REQUEST_RESET_TICK_COUNT;
+	}
+}
+
+/* Handle each datagram coalesced by GRO in `buff` as if it arrived on its own */
+static void
+server_receive_segments(netconn_t *conn, struct sockaddr_in *sockaddr_client, uint8_t *buff, const ssize_t recvlen, const uint16_t seg_size)
+{
+	const size_t 	buffsize = packet_get_buffsize(conn->in_packet);
+	ssize_t 		off, seglen;
+
+	if (seg_size == 0 || seg_size >= recvlen) {
+		server_receive(conn, sockaddr_client, recvlen);
+		return;
+	}
+	for (off = 0; off < recvlen; off += seg_size) {
+		seglen = recvlen - off < seg_size ? recvlen - off : seg_size;
+		packet_set_buff(conn->in_packet, buff + off, seglen);
+		server_receive(conn, sockaddr_client, seglen);
+	}
+	packet_set_buff(conn->in_packet, buff, buffsize);
+}
+
+/* Handle every datagram available */
+static void
+server_receive_all(netconn_t *conn)
+{
+	ssize_t 					recvlen;
+	struct sockaddr_in 			sockaddr_client;
+	uint16_t 					seg_size;
+
+#ifdef NETIO_HAS_URING
+	if (conn->uring != NULL) {
+		struct uring_recv 	r;
+		while (uring_recv_next(conn->uring, &r)) {
+			/* processed in place, straight from the buffer the kernel wrote to */
+			packet_set_buff(conn->in_packet, r.buff, r.len);
+			server_receive_segments(conn, r.addr, r.buff, r.len, r.seg_size);
+			uring_recycle(conn->uring, r.bid);
+		}
+		packet_set_buff(conn->in_packet, conn->in_buffer, SERVER_BUFFER_LEN);
+		return;
+	}
+#endif
+#ifdef NETIO_HAS_MMSG
+	if (conn->data.srv.recvbatch != NULL) {
+		struct recvbatch 	*batch = conn->data.srv.recvbatch;
+		int 				n, i;
+		while(1) {
+			if ( (n = recvbatch_recv(batch, conn->fd)) == SOCKET_ERROR ) {
+				if (SOCKETWOULDBLOCK) {
+					/* no more datagrams */
+					break;
+				}
+				/* error */
+				diep("recvmmsg()");
 				continue;
 			}
-			/* call onreceive */
-			msg_onreceive_process(conn->in_packet, client->msghandle, conn, conn->userdata, &conn->data.srv.events, NULL, client);
-			conn->data.srv.events.onreceivepkt(conn, conn->userdata, conn->in_packet, client, client->userdata);
+			for (i = 0; i < n; i++) {
+				if (recvbatch_is_truncated(batch, i)) {
+					/* bigger than the configured mtu. Ignore. */
+					continue;
+				}
+				/* point the in packet straight to the slot, avoiding a copy */
+				packet_set_buff(conn->in_packet, recvbatch_get_buff(batch, i), batch->slot_len);
+				server_receive_segments(conn, &batch->addrs[i], recvbatch_get_buff(batch, i), batch->msgs[i].msg_len, recvbatch_get_segment_size(batch, i));
+			}
+			if ((unsigned int)n < batch->count) {
+				/* socket drained, save the syscall that would return EAGAIN */
+				break;
+			}
+		}
+		packet_set_buff(conn->in_packet, conn->in_buffer, SERVER_BUFFER_LEN);
+		return;
+	}
+#endif
+	while(1) {
+		if ( (recvlen = conn_recv(conn, &sockaddr_client, &seg_size)) == SOCKET_ERROR ) {
+			if (SOCKETWOULDBLOCK) {
+				/* no more datagrams */
+				break;
+			}
+			/* error */
+			diep("recvfrom()");
+			continue;
+		}
+		server_receive_segments(conn, &sockaddr_client, conn->in_buffer, recvlen, seg_size);
+	}
+}
+
+void
+server_process(netconn_t **__conn)
+{
+	struct srvclient			*client;
+	uint32_t 					slot;
+	const socklen_t 			socklen = sizeof(struct sockaddr_in);
+	uint8_t 					msg_did_work;
+	netconn_t 					*conn;
+#ifdef NETIO_HAS_MMSG
+	struct sendbatch 			*sendbatch;
+#endif
+
+	if(__conn == NULL)
+		return;
+	if(*__conn == NULL)
+		return;
+
+	conn = *__conn;
+	conn_tick_begin(conn);
+#ifdef NETIO_HAS_MMSG
+	sendbatch = conn->data.srv.sendbatch;
+#endif
 
-			client->common.n_local_tick_noresp = 0;
-		} else if ( client->common.n_local_tick_noresp > 16384 ) {
-			/* assuming a tickrate of 128 (very high), this client sent a message after 128 secs (2.1 mins) of no response (connection loss?), 
-			 * so the packet is ignored and the message SRV_REQUEST_RESET_TICK_COUNT is sent until client responds with CLI_NOTICE_RESET_TICK_COUNT 
-			 * or the connection times out */
-			client->common.msg = SRV_REQUEST_RESET_TICK_COUNT;
+	if (conn->data.srv.is_closing == 1) {
+		/* Server is closing. 
+		 * Incoming packets are ignored. 
+		 * All clients common.msg should now be SRV_NOTICE_KICK. */
+		if (conn->data.srv.client_count == 0) {
+			conn->data.srv.events.onsrvclose(__conn, conn->userdata);
+			return;
 		}
+		goto send_process;
 	}
+
+	/* Receive data from clients */
+	server_receive_all(conn);
 send_process:
 	if (conn->data.srv.events.bonsendpkt != NULL) {
-		if (HASH_COUNT(conn->data.srv.connected_clients) > 0) {
-			conn->data.srv.events.bonsendpkt(conn, conn->userdata, conn->data.srv.connected_clients);
+		if (conn->data.srv.client_count > 0) {
+			conn->data.srv.events.bonsendpkt(conn, conn->userdata, srv_client_next(&conn->data.srv, 0));
 		}
 	}
+	/* timeouts and kicks */
+	srv_expire_clients(conn);
 	/* process and send data to connected clients */
-	for (client = conn->data.srv.connected_clients; client != NULL; ) {
-		if (client->common.n_local_tick_noresp + 1 < UINT16_MAX) {
-			client->common.n_local_tick_noresp++;
-		}
-		if (client->common.n_local_tick_noresp == conn->settings.timeout_tick) {
-			SRV_KICK_CLIENT(client, EKICK_CONNECTION_TIMEOUT);
+	for (slot = 0; slot < conn->data.srv.slot_count; slot++) {
+		client = SRV_CLIENT_AT(&conn->data.srv, slot);
+		if (!client->in_use) {
+			continue;
 		}
 		if (client->common.msg == SRV_PENDING_CONNECTION) {
 			/* is a pending connection, sendto is handled in recvfrom loop */
-			if (client->common.n_local_tick_noresp == conn->settings.pending_conn_timeout_tick) {
-				/* Client timed out, will be kicked in next tick */
-				SRV_KICK_CLIENT(client, EKICK_CONNECTION_TIMEOUT);
-			}
 			goto next_send_iter;
 		}
 
+#ifdef NETIO_HAS_MMSG
+		if (sendbatch != NULL) {
+			if (sendbatch_is_full(sendbatch)) {
+				srv_flush_sendbatch(conn);
+				if (sendbatch_is_full(sendbatch)) {
+					/* still blocking, make room by dropping the oldest datagram */
+					sendbatch_drop(sendbatch, 1);
+				}
+			}
+			/* write the datagram straight into its batch slot */
+			packet_set_buff(conn->out_packet, sendbatch_get_free(sendbatch), sendbatch_get_free_len(sendbatch));
+		}
+#endif
 		packet_rewind(conn->out_packet);
-		packet_w_16_t(conn->out_packet, &conn->local_tick);
-		packet_w_bits(conn->out_packet, client->common.msg, MESSAGE_SIZE_BITS_SRV);
+		srv_write_header(conn, client, conn->out_packet);
+		msg_did_work = 0;
 		
 		if (client->common.msg == SRV_NOTICE_KICK) {
-			/* this client is being kicked */
-			if (client->common.cur_remote_tick == conn->settings.kick_notice_tick) {
-				/* Kick notice already sent multiple times. 
-				 * Call ondisconnect and remove client */
-				SRVCLIENT_FREE(conn, tmp_client, client, client->kick_reason);
-				continue;
-			}
+			/* this client is being kicked, until its timer fires */
 			packet_w_bits(conn->out_packet, client->kick_reason, network_kick_bit_size);
-			client->common.cur_remote_tick++;
 		} else {
 			/* Is a connected client. Call onsend */
 			client->common.expected_remote_tick++;
-			const uint8_t msg_did_work = msg_onsend_process(conn->out_packet, client->msghandle);
+			msg_expire(client->msghandle, conn, conn->userdata, &conn->data.srv.events, NULL, client);
+			msg_did_work = msg_onsend_process(conn->out_packet, client->msghandle, client->mtu);
 			const uint32_t internal_w_op_cnt = packet_get_write_op_count(conn->out_packet);
+			conn->send_mtu = client->mtu;
 			conn->data.srv.events.onsendpkt(conn, conn->userdata, conn->out_packet, client, client->userdata);
 			if (packet_get_write_op_count(conn->out_packet) == internal_w_op_cnt && !msg_did_work) {
 				/* avoid sending the empty packet if possible */
@@ -526,13 +1534,45 @@ send_process:
 				conn->send_skip_count = 0;
 			}
 		}
+		if (msg_did_work == MSG_SEND_DEFERRED && conn_send_overflow(conn, client->msghandle, client, &client->sockaddr, client->mtu)) {
+			/* the out packet went as the last segment */
+			goto next_send_iter;
+		}
+#ifdef NETIO_HAS_MMSG
+		if (sendbatch != NULL) {
+			sendbatch_push(sendbatch, packet_get_length(conn->out_packet), &client->sockaddr);
+			goto next_send_iter;
+		}
+#endif
 		SENDTO(conn->fd,conn->out_buffer, packet_get_length(conn->out_packet), client->sockaddr, socklen);
 next_send_iter:
 		/* go to next client */
-		client = client->hh.next;
+		continue;
+	}
+#ifdef NETIO_HAS_MMSG
+	if (sendbatch != NULL) {
+		/* datagrams that would block are carried over to the next tick */
+		srv_flush_sendbatch(conn);
+		packet_set_buff(conn->out_packet, conn->out_buffer, SERVER_BUFFER_LEN);
 	}
+#endif
 
 	conn->local_tick++;
+	CONN_TICK_END(conn);
+}
+
+void
+server_drain(netconn_t **__conn)
+{
+	if (__conn == NULL)
+		return;
+	if (*__conn == NULL)
+		return;
+	if ((*__conn)->data.srv.is_closing == 1) {
+		/* incoming packets are ignored */
+		return;
+	}
+	server_receive_all(*__conn);
 }
 
 void
@@ -555,8 +1595,8 @@ server_close(netconn_t *conn)
 	}
 
 	struct srvclient 	*client;
-	if (HASH_COUNT(conn->data.srv.connected_clients) > 0) {
-		for (client = conn->data.srv.connected_clients; client != NULL; client = client->hh.next) {
+	if (conn->data.srv.client_count > 0) {
+		for (client = srv_client_next(&conn->data.srv, 0); client != NULL; client = srv_client_next(&conn->data.srv, client->slot + 1)) {
 			/* kick all clients */
 			SRV_KICK_CLIENT(client, EKICK_SERVER_CLOSING);
 		}
@@ -570,13 +1610,13 @@ server_cli_get_next(netsrvclient_t *client)
 	if (client == NULL)
 		return NULL;
 
-	netsrvclient_t *next = client->hh.next;
+	netsrvclient_t *next = srv_client_next(client->server, client->slot + 1);
 	while (next != NULL) {
 		if (SRV_CLIENT_ISCONNECTED(next)) {
 			/* it's a connected client */
 			return next;
 		}
-		next = next->hh.next;
+		next = srv_client_next(client->server, next->slot + 1);
 	}
 	return NULL;
 }
@@ -607,35 +1647,138 @@ client_disconnect(netconn_t *conn)
 	if (conn == NULL)
 		return;
 	conn->data.cli.common.msg = CLI_NOTICE_DISCONNECT;
+	/* notify the server for kick_notice_tick ticks, or until it replies */
+	conn->data.cli.common.n_local_tick_noresp = 0;
 }
 
-void
-client_process(netconn_t **__conn)
+/* Handle a single datagram from the server, already stored in the buffer `conn->in_packet` points to.
+ * Returns 1 if `ondisconnect` got called, in which case `*__conn` should not be used anymore. */
+static int
+client_receive(netconn_t **__conn, const ssize_t recvlen)
 {
-	ssize_t 					recvlen;
 	uint16_t		 			srv_tick;
-	uint8_t 					srv_msg;
+	uint8_t 					srv_msg, has_connid;
+	uint64_t 					cookie;
 	int32_t 					diff, diff1;
-	socklen_t 					socklen;
-	netconn_t 					*conn;
+	netconn_t 					*conn = *__conn;
+
+	packet_rewind(conn->in_packet);
+	packet_set_length(conn->in_packet, recvlen);
+	/* Read header */
+	srv_msg = has_connid = 0;
+	packet_r_16_t(conn->in_packet, &srv_tick);
+	packet_r_bits(conn->in_packet, &srv_msg, MESSAGE_SIZE_BITS_SRV);
+	packet_r_bits(conn->in_packet, &has_connid, 1);
+	if (has_connid && packet_r_32_t(conn->in_packet, &conn->data.cli.connid) == 0 && packet_r_64_t(conn->in_packet, &conn->data.cli.token) == 0) {
+		conn->data.cli.has_connid = 1;
+	}
+	conn->stats.total_received_bytes += recvlen;
 
-	if (__conn == NULL)
-		return;
-	if(*__conn == NULL)
-		return;
+	if (srv_msg == SRV_COOKIE) {
+		if (conn->data.cli.common.msg == CLI_NOTICE_CONNECTING && packet_r_64_t(conn->in_packet, &cookie) == 0) {
+			/* connect again, echoing the cookie */
+			conn->data.cli.cookie = cookie;
+			conn->data.cli.has_cookie = 1;
+			conn->data.cli.common.n_local_tick_noresp = 0;
+			packet_rewind(conn->out_packet);
+			cli_write_header(conn, conn->out_packet);
+			conn->data.cli.events.onconnect(conn, conn->userdata, conn->in_packet, conn->out_packet);
+		}
+		return 0;
+	}
+	if (srv_msg == SRV_NOTICE_KICK) {
+		/* this client has been kicked. call ondisconnect */
+		srv_msg = 0;
+		packet_r_bits(conn->in_packet, &srv_msg, network_kick_bit_size);
+		conn->data.cli.events.ondisconnect(__conn, conn->userdata, srv_msg);
+		return 1;
+	} else if (!conn->data.cli.has_remote_tick) {
+		conn->data.cli.has_remote_tick = 1;
+		goto applypacket;
+	} else if (srv_msg == SRV_REQUEST_RESET_TICK_COUNT) {
+		/* server wants to restart tick count. connection loss scenario */
+		conn->local_tick = 0;
+		conn->data.cli.common.msg = CLI_NOTICE_RESET_TICK_COUNT;
+		/* force apply to be safe. */
+		goto applypacket;
+	}
 
-	conn = *__conn;
-	socklen = sizeof(conn->data.cli.sockaddr_server);
-	
-	if (conn->data.cli.common.msg == CLI_NOTICE_DISCONNECT) {
-		if (conn->data.cli.common.n_local_tick_noresp == conn->settings.kick_notice_tick) {
-			conn->data.cli.events.ondisconnect(__conn, conn->userdata, EKICK_DISCONNECT);
-			return;
+	IF_WHITHIN_EXPECTED(srv_tick, conn->data.cli.common.cur_remote_tick, conn->data.cli.common.expected_remote_tick, conn->settings.expected_tick_tolerance,) {
+applypacket:
+		conn->data.cli.common.cur_remote_tick = srv_tick;
+		conn->data.cli.common.expected_remote_tick = srv_tick;
+		conn->data.cli.common.n_local_tick_noresp = 0;
+		if (srv_msg == SRV_PENDING_CONNECTION) {
+			packet_rewind(conn->out_packet);
+			cli_write_header(conn, conn->out_packet);
+			conn->data.cli.events.onconnect(conn, conn->userdata, conn->in_packet, conn->out_packet);
+			return 0;
+		} else if (conn->data.cli.common.msg == CLI_NOTICE_CONNECTING) {
+			conn->data.cli.common.msg = CLI_NONE;
+		}
+		/* call onreceive */
+		if (msg_onreceive_process(conn->in_packet, conn->data.cli.msghandle, conn, conn->userdata, NULL, &conn->data.cli.events, NULL)) {
+			/* message only datagram */
+			return 0;
+		}
+		conn->data.cli.events.onreceivepkt(conn, conn->userdata, conn->in_packet);
+		if (srv_msg == SRV_NONE && conn->data.cli.common.msg == CLI_NOTICE_RESET_TICK_COUNT) {
+			/* clear the message being sent to server */
+			conn->data.cli.common.msg = CLI_NONE;
+		}
+	}
+	return 0;
+}
+
+/* Handle each datagram coalesced by GRO in `buff` as if it arrived on its own.
+ * Returns 1 if `ondisconnect` got called. */
+static int
+client_receive_segments(netconn_t **__conn, uint8_t *buff, const ssize_t recvlen, const uint16_t seg_size)
+{
+	netconn_t 	*conn = *__conn;
+	const size_t buffsize = packet_get_buffsize(conn->in_packet);
+	ssize_t 	off, seglen;
+
+	if (seg_size == 0 || seg_size >= recvlen) {
+		return client_receive(__conn, recvlen);
+	}
+	for (off = 0; off < recvlen; off += seg_size) {
+		seglen = recvlen - off < seg_size ? recvlen - off : seg_size;
+		packet_set_buff(conn->in_packet, buff + off, seglen);
+		if (client_receive(__conn, seglen)) {
+			return 1;
 		}
 	}
+	packet_set_buff(conn->in_packet, buff, buffsize);
+	return 0;
+}
 
+/* Handle every datagram available.
+ * Returns 1 if `ondisconnect` got called. */
+static int
+client_receive_all(netconn_t **__conn)
+{
+	ssize_t 					recvlen;
+	uint16_t 					seg_size;
+	netconn_t 					*conn = *__conn;
+
+#ifdef NETIO_HAS_URING
+	if (conn->uring != NULL) {
+		struct uring_recv 	r;
+		while (uring_recv_next(conn->uring, &r)) {
+			packet_set_buff(conn->in_packet, r.buff, r.len);
+			if (client_receive_segments(__conn, r.buff, r.len, r.seg_size)) {
+				/* `conn` is gone, and the ring with it */
+				return 1;
+			}
+			uring_recycle(conn->uring, r.bid);
+		}
+		packet_set_buff(conn->in_packet, conn->in_buffer, SERVER_BUFFER_LEN);
+		return 0;
+	}
+#endif
 	while(1) {
-		if ( (recvlen = recvfrom(conn->fd, (char *)conn->in_buffer, SERVER_BUFFER_LEN, 0, (struct sockaddr *)&conn->data.cli.sockaddr_server, &socklen)) == SOCKET_ERROR ) {
+		if ( (recvlen = conn_recv(conn, &conn->data.cli.sockaddr_server, &seg_size)) == SOCKET_ERROR ) {
 			if (SOCKETWOULDBLOCK) {
 				/* no more datagrams */
 				break;
@@ -644,60 +1787,52 @@ client_process(netconn_t **__conn)
 			diep("recvfrom()");
 			continue;
 		}
-		packet_rewind(conn->in_packet);
-		packet_set_length(conn->in_packet, recvlen);
-		/* Read header */
-		packet_r_16_t(conn->in_packet, &srv_tick);
-		packet_r_bits(conn->in_packet, &srv_msg, MESSAGE_SIZE_BITS_SRV);
-		
-		if(conn->stats.total_received_bytes == 0) {
-			conn->stats.total_received_bytes += recvlen;
-			goto applypacket;
+		if (client_receive_segments(__conn, conn->in_buffer, recvlen, seg_size)) {
+			return 1;
 		}
-		conn->stats.total_received_bytes += recvlen;
+	}
+	return 0;
+}
 
-		if (srv_msg == SRV_NOTICE_KICK) {
-			/* this client has been kicked. call ondisconnect */
-			srv_msg = 0;
-			packet_r_bits(conn->in_packet, &srv_msg, network_kick_bit_size);
-			conn->data.cli.events.ondisconnect(__conn, conn->userdata, srv_msg);
+void
+client_process(netconn_t **__conn)
+{
+	ssize_t 					recvlen;
+	socklen_t 					socklen;
+	uint8_t 					msg_did_work = 0;
+	const uint16_t 				magic = NET_PROTOCOL_MAGIC;
+	netconn_t 					*conn;
+
+	if (__conn == NULL)
+		return;
+	if(*__conn == NULL)
+		return;
+
+	conn = *__conn;
+	conn_tick_begin(conn);
+	socklen = sizeof(conn->data.cli.sockaddr_server);
+	
+	if (conn->data.cli.common.msg == CLI_NOTICE_DISCONNECT) {
+		if (conn->data.cli.common.n_local_tick_noresp == conn->settings.kick_notice_tick) {
+			conn->data.cli.events.ondisconnect(__conn, conn->userdata, EKICK_DISCONNECT);
 			return;
-		} else if (srv_msg == SRV_REQUEST_RESET_TICK_COUNT) {
-			/* server wants to restart tick count. connection loss scenario */
-			conn->local_tick = 0;
-			conn->data.cli.common.msg = CLI_NOTICE_RESET_TICK_COUNT;
-			/* force apply to be safe. */
-			goto applypacket;
 		}
+	}
 
-		IF_WHITHIN_EXPECTED(srv_tick, conn->data.cli.common.cur_remote_tick, conn->data.cli.common.expected_remote_tick, conn->settings.expected_tick_tolerance,) {
-applypacket:
-			conn->data.cli.common.cur_remote_tick = srv_tick;
-			conn->data.cli.common.expected_remote_tick = srv_tick;
-			conn->data.cli.common.n_local_tick_noresp = 0;
-			if (srv_msg == SRV_PENDING_CONNECTION) {
-				packet_rewind(conn->out_packet);
-				packet_w_16_t(conn->out_packet, &conn->local_tick);
-				packet_w_bits(conn->out_packet, conn->data.cli.common.msg, MESSAGE_SIZE_BITS_CLI);
-				conn->data.cli.events.onconnect(conn, conn->userdata, conn->in_packet, conn->out_packet);
-				continue;
-			} else if (conn->data.cli.common.msg == CLI_NOTICE_CONNECTING) {
-				conn->data.cli.common.msg = CLI_NONE;
-			}
-			/* call onreceive */
-			msg_onreceive_process(conn->in_packet, conn->data.cli.msghandle, conn, conn->userdata, NULL, &conn->data.cli.events, NULL);
-			conn->data.cli.events.onreceivepkt(conn, conn->userdata, conn->in_packet);
-			if (srv_msg == SRV_NONE && conn->data.cli.common.msg == CLI_NOTICE_RESET_TICK_COUNT) {
-				/* clear the message being sent to server */
-				conn->data.cli.common.msg = CLI_NONE;
-			}
-		}
+	if (client_receive_all(__conn)) {
+		return;
 	}
 	if (conn->data.cli.common.msg == CLI_NOTICE_CONNECTING) {
 		/* out packet already prepared. 
-		 * overriding the tick number is safe (granted to be the first 2 bytes). */
+		 * overriding the tick number is safe (granted to be the first 2 bytes after the protocol magic). */
 		recvlen = packet_get_length(conn->out_packet);
+		if (!conn->data.cli.has_cookie && recvlen < SRV_COOKIE_REPLY_LEN) {
+			/* the server only answers requests as big as its reply */
+			memset((uint8_t *)packet_get_buff(conn->out_packet) + recvlen, 0, SRV_COOKIE_REPLY_LEN - recvlen);
+			recvlen = SRV_COOKIE_REPLY_LEN;
+		}
 		packet_rewind(conn->out_packet);
+		packet_w_16_t(conn->out_packet, &magic);
 		packet_w_16_t(conn->out_packet, &conn->local_tick);
 		packet_set_length(conn->out_packet, recvlen);
 		goto send_pkt;
@@ -705,12 +1840,13 @@ applypacket:
 	
 	/* prepare packet */
 	packet_rewind(conn->out_packet);
-	packet_w_16_t(conn->out_packet, &conn->local_tick);
-	packet_w_bits(conn->out_packet, conn->data.cli.common.msg, MESSAGE_SIZE_BITS_CLI);
+	cli_write_header(conn, conn->out_packet);
 	/* call onsend */
 	if (conn->data.cli.common.msg != CLI_NOTICE_DISCONNECT) {
-		const uint8_t msg_did_work = msg_onsend_process(conn->out_packet, conn->data.cli.msghandle);
+		msg_expire(conn->data.cli.msghandle, conn, conn->userdata, NULL, &conn->data.cli.events, NULL);
+		msg_did_work = msg_onsend_process(conn->out_packet, conn->data.cli.msghandle, conn->settings.mtu);
 		const uint32_t internal_w_op_cnt = packet_get_write_op_count(conn->out_packet);
+		conn->send_mtu = conn->settings.mtu;
 		conn->data.cli.events.onsendpkt(conn, conn->userdata, conn->out_packet);
 		if (packet_get_write_op_count(conn->out_packet) == internal_w_op_cnt && !msg_did_work) {
 			/* avoid sending the empty packet if possible */
@@ -721,11 +1857,16 @@ applypacket:
 			conn->send_skip_count = 0;
 		}
 	}
+	if (msg_did_work == MSG_SEND_DEFERRED && conn_send_overflow(conn, conn->data.cli.msghandle, NULL, &conn->data.cli.sockaddr_server, conn->settings.mtu)) {
+		/* the out packet went as the last segment */
+		goto skip_send_pkt;
+	}
 send_pkt:
 	SENDTO(conn->fd, conn->out_buffer, packet_get_length(conn->out_packet), conn->data.cli.sockaddr_server, socklen);
 skip_send_pkt:
 	conn->data.cli.common.expected_remote_tick++;
 	conn->local_tick++;
+	CONN_TICK_END(conn);
 	if (conn->data.cli.common.n_local_tick_noresp == conn->settings.timeout_tick) {
 		/* connection timed out. */
 		conn->data.cli.events.ondisconnect(__conn, conn->userdata, EKICK_CONNECTION_TIMEOUT);
@@ -734,6 +1875,16 @@ skip_send_pkt:
 	conn->data.cli.common.n_local_tick_noresp++;
 }
 
+void
+client_drain(netconn_t **__conn)
+{
+	if (__conn == NULL)
+		return;
+	if (*__conn == NULL)
+		return;
+	client_receive_all(__conn);
+}
+
 uint16_t
 client_get_external_tick(netconn_t *conn)
 {
@@ -753,19 +1904,157 @@ server_cli_get_external_tick(netsrvclient_t *client)
 }
 
 uint32_t
-client_sendmessage(netconn_t *conn, const void *buffer, const uint32_t size)
+client_sendmessage(netconn_t *conn, const uint8_t channel, const void *buffer, const uint32_t size)
+{
+	if (conn == NULL)
+		return 0;
+	return message_send(conn->data.cli.msghandle, channel, 0, 0, buffer, size);
+}
+
+uint32_t
+client_sendmessage_ex(netconn_t *conn, const uint8_t channel, const void *buffer, const uint32_t size, const uint8_t priority, const uint16_t ttl)
+{
+	if (conn == NULL)
+		return 0;
+	return message_send(conn->data.cli.msghandle, channel, priority, ttl, buffer, size);
+}
+
+packet_t *
+client_reservemessage(netconn_t *conn, const uint8_t channel, const uint8_t priority, const uint16_t ttl)
+{
+	if (conn == NULL)
+		return NULL;
+	return message_reserve(conn->data.cli.msghandle, channel, priority, ttl);
+}
+
+uint32_t
+client_commitmessage(netconn_t *conn)
+{
+	if (conn == NULL)
+		return 0;
+	return message_commit(conn->data.cli.msghandle);
+}
+
+uint8_t
+client_get_message_channel(netconn_t *conn)
 {
 	if (conn == NULL)
 		return 0;
-	return message_send(conn->data.cli.msghandle, buffer, size);
+	return conn->data.cli.msghandle->recv_channel;
+}
+
+/* Kicks `client` if the message `id` failed because its queue is full and the policy tells so. Returns `id` */
+static uint32_t
+srv_cli_check_queue(netsrvclient_t *client, const uint32_t id)
+{
+	if (id == 0 && client->msghandle->queue_full && client->msghandle->queue_policy == EQUEUE_KICK && client->common.msg != SRV_NOTICE_KICK) {
+		/* it is not keeping up */
+		SRV_KICK_CLIENT(client, EKICK_QUEUE_FULL);
+	}
+	return id;
+}
+
+uint32_t
+server_cli_sendmessage(netsrvclient_t *client, const uint8_t channel, const void *buffer, const uint32_t size)
+{
+	return server_cli_sendmessage_ex(client, channel, buffer, size, 0, 0);
+}
+
+uint32_t
+server_cli_sendmessage_ex(netsrvclient_t *client, const uint8_t channel, const void *buffer, const uint32_t size, const uint8_t priority, const uint16_t ttl)
+{
+	if (client == NULL)
+		return 0;
+	return srv_cli_check_queue(client, message_send(client->msghandle, channel, priority, ttl, buffer, size));
+}
+
+packet_t *
+server_cli_reservemessage(netsrvclient_t *client, const uint8_t channel, const uint8_t priority, const uint16_t ttl)
+{
+	if (client == NULL)
+		return NULL;
+	return message_reserve(client->msghandle, channel, priority, ttl);
 }
 
 uint32_t
-server_cli_sendmessage(netsrvclient_t *client, const void *buffer, const uint32_t size)
+server_cli_commitmessage(netsrvclient_t *client)
 {
 	if (client == NULL)
 		return 0;
-	return message_send(client->msghandle, buffer, size);
+	return srv_cli_check_queue(client, message_commit(client->msghandle));
+}
+
+uint32_t
+server_multicastmessage(netconn_t *conn, netsrvclient_t **clients, const uint32_t count, const uint8_t channel, const void *buffer, const uint32_t size, const uint8_t priority, const uint16_t ttl, uint32_t *ids)
+{
+	struct msg_shared 	*shared;
+	uint32_t 			i, id, sent = 0;
+
+	if (conn == NULL || (shared = msg_shared_init(buffer, size)) == NULL)
+		return 0;
+	for (i = 0; i < count; i++) {
+		id = clients[i] != NULL ? srv_cli_check_queue(clients[i], message_send_shared(clients[i]->msghandle, channel, priority, ttl, shared)) : 0;
+		if (ids != NULL) {
+			ids[i] = id;
+		}
+		sent += id != 0;
+	}
+	/* freed here if no client took it */
+	msg_shared_release(shared);
+	return sent;
+}
+
+uint32_t
+server_broadcastmessage(netconn_t *conn, const uint8_t channel, const void *buffer, const uint32_t size, const uint8_t priority, const uint16_t ttl)
+{
+	struct msg_shared 	*shared;
+	struct srvclient 	*client;
+	uint32_t 			sent = 0;
+
+	if (conn == NULL || (shared = msg_shared_init(buffer, size)) == NULL)
+		return 0;
+	for (client = srv_client_next(&conn->data.srv, 0); client != NULL; client = srv_client_next(&conn->data.srv, client->slot + 1)) {
+		if (SRV_CLIENT_ISCONNECTED(client) && srv_cli_check_queue(client, message_send_shared(client->msghandle, channel, priority, ttl, shared)) != 0) {
+			sent++;
+		}
+	}
+	msg_shared_release(shared);
+	return sent;
+}
+
+uint8_t
+server_cli_get_message_channel(netsrvclient_t *client)
+{
+	if (client == NULL)
+		return 0;
+	return client->msghandle->recv_channel;
+}
+
+void
+server_cli_set_mtu(netsrvclient_t *client, uint16_t mtu)
+{
+	const uint16_t max = client->server->mtu;
+
+	if (mtu == 0 || mtu > max) {
+		mtu = max;
+	} else if (mtu < MSG_MIN_MTU) {
+		mtu = MSG_MIN_MTU;
+	}
+	client->mtu = mtu;
+	msghandle_set_mtu(client->msghandle, mtu);
+}
+
+uint16_t
+server_cli_get_mtu(netsrvclient_t *client)
+{
+	return client->mtu;
+}
+
+uint32_t
+conn_get_bytes_left(netconn_t *conn)
+{
+	const uint32_t len = packet_get_length(conn->out_packet);
+	return len < conn->send_mtu ? conn->send_mtu - len : 0;
 }
 
 uint16_t
@@ -776,8 +2065,375 @@ conn_get_local_tick(netconn_t *conn)
 	return conn->local_tick;
 }
 
+int
+conn_get_fd(netconn_t *conn)
+{
+#ifdef NETIO_HAS_URING
+	if (conn->uring != NULL) {
+		/* datagrams are consumed by the armed recvmsg, so readiness shows up as completions */
+		return conn->uring->ring_fd;
+	}
+#endif
+	return conn->fd;
+}
+
+int64_t
+conn_get_time_to_tick(netconn_t *conn)
+{
+	if (conn->next_tick_ns == 0) {
+		/* first tick */
+		return 0;
+	}
+	return (int64_t)(conn->next_tick_ns - net_time_ns());
+}
+
+#ifdef __linux__
+/* Arm the timerfd to expire when the next tick is due. Returns -1 on failure. */
+static int
+conn_arm_tick_fd(netconn_t *conn)
+{
+	struct itimerspec 	its = {0};
+
+	if (conn->tick_fd < 0 && (conn->tick_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC)) == SOCKET_ERROR) {
+		return -1;
+	}
+	if (conn->tick_fd_deadline == conn->next_tick_ns) {
+		/* still armed from a previous wait */
+		return 0;
+	}
+	its.it_value.tv_sec = conn->next_tick_ns / NS_PER_SEC;
+	its.it_value.tv_nsec = conn->next_tick_ns % NS_PER_SEC;
+	if (timerfd_settime(conn->tick_fd, TFD_TIMER_ABSTIME, &its, NULL) == SOCKET_ERROR) {
+		return -1;
+	}
+	conn->tick_fd_deadline = conn->next_tick_ns;
+	return 0;
+}
+#endif
+
+int
+conn_wait(netconn_t *conn)
+{
+	int 			r;
+
+	if (conn == NULL)
+		return -1;
+#ifdef __linux__
+	/* an absolute timer is not affected by the time spent between computing the timeout and going to sleep, nor by timer slack */
+	struct pollfd 	pfd[2];
+	uint64_t 		expirations;
+
+	if (conn_get_time_to_tick(conn) <= 0) {
+		return 1;
+	}
+	if (conn_arm_tick_fd(conn) == SOCKET_ERROR) {
+		perror("timerfd");
+		return -1;
+	}
+	pfd[0].fd = conn_get_fd(conn);
+	pfd[0].events = POLLIN;
+	pfd[1].fd = conn->tick_fd;
+	pfd[1].events = POLLIN;
+	while (1) {
+		pfd[0].revents = pfd[1].revents = 0;
+		if ( (r = poll(pfd, 2, -1)) == SOCKET_ERROR ) {
+			if (errno == EINTR) {
+				continue;
+			}
+			perror("poll()");
+			return -1;
+		}
+		if (pfd[1].revents & POLLIN) {
+			/* clear the expiration, the timer is armed again for the next tick */
+			r = read(conn->tick_fd, &expirations, sizeof(expirations));
+			conn->tick_fd_deadline = 0;
+			return 1;
+		}
+		return 0;
+	}
+#else
+	struct pollfd 	pfd;
+	int64_t 		left;
+
+	pfd.fd = conn_get_fd(conn);
+	pfd.events = POLLIN;
+	while ( (left = conn_get_time_to_tick(conn)) > 0 ) {
+		pfd.revents = 0;
+		/* round up, waking too early would spin */
+#ifdef _WIN32
+		r = WSAPoll(&pfd, 1, (left + 999999) / 1000000);
+#else
+		r = poll(&pfd, 1, (left + 999999) / 1000000);
+#endif
+		if (r > 0) {
+			return 0;
+		}
+		if (r == SOCKET_ERROR && errno != EINTR) {
+			perror("poll()");
+			return -1;
+		}
+	}
+	return 1;
+#endif
+}
+
+void
+conn_sleep(netconn_t *conn)
+{
+	int64_t left;
+
+	if (conn == NULL || (left = conn_get_time_to_tick(conn)) <= 0)
+		return;
+#ifdef __linux__
+	struct timespec deadline = { .tv_sec = conn->next_tick_ns / NS_PER_SEC, .tv_nsec = conn->next_tick_ns % NS_PER_SEC };
+	/* restarted with the same absolute deadline if interrupted */
+	while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &deadline, NULL) == EINTR);
+#elif defined(_WIN32)
+	Sleep((left + 999999) / 1000000);
+#else
+	struct timespec ts = { .tv_sec = left / NS_PER_SEC, .tv_nsec = left % NS_PER_SEC };
+	nanosleep(&ts, NULL);
+#endif
+}
+
+void
+server_run(netconn_t **__conn)
+{
+	while (__conn != NULL && *__conn != NULL) {
+		switch (conn_wait(*__conn)) {
+			case 0:
+				server_drain(__conn);
+				break;
+			case 1:
+				server_process(__conn);
+				break;
+			default:
+				conn_sleep(*__conn);
+				server_process(__conn);
+				break;
+		}
+	}
+}
+
+void
+client_run(netconn_t **__conn)
+{
+	while (__conn != NULL && *__conn != NULL) {
+		switch (conn_wait(*__conn)) {
+			case 0:
+				client_drain(__conn);
+				break;
+			case 1:
+				client_process(__conn);
+				break;
+			default:
+				conn_sleep(*__conn);
+				client_process(__conn);
+				break;
+		}
+	}
+}
+
 const struct netstats *
 conn_get_stats(netconn_t *conn)
 {
 	return (const struct netstats *)&conn->stats;
 }
+
+#ifdef NET_HAS_SERVER_GROUP
+/* a server of a group, processed by its own thread */
+struct srvworker {
+	netconn_t 			*conn;
+	pthread_t 			thread;
+	struct netsrvgroup 	*group;
+};
+
+struct netsrvgroup {
+	pthread_mutex_t 	lock;
+	/* signaled when a new tick starts and when all workers finished it */
+	pthread_cond_t 		tick_cond, done_cond;
+	uint32_t 			tick;
+	unsigned int 		running;
+	uint_fast8_t 		stop;
+	unsigned int 		count;
+	struct srvworker 	*workers;
+};
+
+static void *
+srvworker_run(void *arg)
+{
+	struct srvworker 	*worker = arg;
+	struct netsrvgroup 	*group = worker->group;
+	uint32_t 			tick = 0;
+
+	pthread_mutex_lock(&group->lock);
+	while (1) {
+		while (group->tick == tick && !group->stop) {
+			pthread_cond_wait(&group->tick_cond, &group->lock);
+		}
+		if (group->stop) {
+			break;
+		}
+		tick = group->tick;
+		pthread_mutex_unlock(&group->lock);
+		/* does nothing once the worker got closed and freed */
+		server_process(&worker->conn);
+		pthread_mutex_lock(&group->lock);
+		if (--group->running == 0) {
+			pthread_cond_signal(&group->done_cond);
+		}
+	}
+	pthread_mutex_unlock(&group->lock);
+	return NULL;
+}
+
+/* stops and joins the first `count` worker threads */
+static void
+server_group_stop(netsrvgroup_t *group, const unsigned int count)
+{
+	unsigned int i;
+	pthread_mutex_lock(&group->lock);
+	group->stop = 1;
+	pthread_cond_broadcast(&group->tick_cond);
+	pthread_mutex_unlock(&group->lock);
+	for (i = 0; i < count; i++) {
+		pthread_join(group->workers[i].thread, NULL);
+	}
+}
+
+netsrvgroup_t *
+server_group_init(in_addr_t ip, in_port_t port, const struct srvevents events, const struct netsettings settings, void *userdata, const unsigned int workers)
+{
+	netsrvgroup_t 	*group;
+	unsigned int 	i;
+
+	if (workers == 0) {
+		return NULL;
+	}
+	group = malloc(sizeof(netsrvgroup_t));
+	if (group == NULL) {
+		return NULL;
+	}
+	memset(group, 0, sizeof(*group));
+	group->count = workers;
+	group->workers = calloc(workers, sizeof(struct srvworker));
+	if (group->workers == NULL) {
+		free(group);
+		return NULL;
+	}
+	pthread_mutex_init(&group->lock, NULL);
+	pthread_cond_init(&group->tick_cond, NULL);
+	pthread_cond_init(&group->done_cond, NULL);
+
+	/* bind order defines the index returned by the steering program */
+	for (i = 0; i < workers; i++) {
+		group->workers[i].group = group;
+		if ( (group->workers[i].conn = server_init_socket(ip, port, events, settings, userdata, 1)) == NULL ) {
+			goto fail;
+		}
+	}
+	if (workers > 1 && netio_attach_reuseport_cbpf(group->workers[0].conn->fd, workers) == SOCKET_ERROR) {
+		/* older kernel, the default reuseport hash also keeps a peer on the same socket while the group does not change */
+		perror("setsockopt(SO_ATTACH_REUSEPORT_CBPF)");
+	}
+	for (i = 0; i < workers; i++) {
+		if (pthread_create(&group->workers[i].thread, NULL, srvworker_run, &group->workers[i]) != 0) {
+			server_group_stop(group, i);
+			i = workers;
+			goto fail;
+		}
+	}
+	return group;
+fail:
+	while (i-- > 0) {
+		server_free(&group->workers[i].conn);
+	}
+	pthread_mutex_destroy(&group->lock);
+	pthread_cond_destroy(&group->tick_cond);
+	pthread_cond_destroy(&group->done_cond);
+	free(group->workers);
+	free(group);
+	return NULL;
+}
+
+void
+server_group_free(netsrvgroup_t **group)
+{
+	unsigned int i;
+
+	if (group == NULL)
+		return;
+	if (*group == NULL)
+		return;
+
+	netsrvgroup_t *g = *group;
+	server_group_stop(g, g->count);
+	for (i = 0; i < g->count; i++) {
+		server_free(&g->workers[i].conn);
+	}
+	pthread_mutex_destroy(&g->lock);
+	pthread_cond_destroy(&g->tick_cond);
+	pthread_cond_destroy(&g->done_cond);
+	free(g->workers);
+	free(g);
+	*group = NULL;
+}
+
+void
+server_group_process(netsrvgroup_t **__group)
+{
+	netsrvgroup_t 	*group;
+	unsigned int 	i;
+
+	if (__group == NULL)
+		return;
+	if (*__group == NULL)
+		return;
+
+	group = *__group;
+	/* every worker runs exactly one tick, keeping them in sync */
+	pthread_mutex_lock(&group->lock);
+	group->running = group->count;
+	group->tick++;
+	pthread_cond_broadcast(&group->tick_cond);
+	while (group->running > 0) {
+		pthread_cond_wait(&group->done_cond, &group->lock);
+	}
+	pthread_mutex_unlock(&group->lock);
+
+	for (i = 0; i < group->count; i++) {
+		if (group->workers[i].conn != NULL) {
+			return;
+		}
+	}
+	/* all workers got closed */
+	server_group_free(__group);
+}
+
+void
+server_group_close(netsrvgroup_t *group)
+{
+	unsigned int i;
+	if (group == NULL)
+		return;
+	for (i = 0; i < group->count; i++) {
+		server_close(group->workers[i].conn);
+	}
+}
+
+unsigned int
+server_group_get_worker_count(netsrvgroup_t *group)
+{
+	if (group == NULL)
+		return 0;
+	return group->count;
+}
+
+netconn_t *
+server_group_get_worker(netsrvgroup_t *group, const unsigned int i)
+{
+	if (group == NULL || i >= group->count)
+		return NULL;
+	return group->workers[i].conn;
+}
+#endif
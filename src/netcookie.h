@@ -0,0 +1,93 @@
+/*
+ * Handshake cookie implementation.
+ * Copyright (C) 2023  Luiz Gustavo Sassanovicz Borsoi
+ *
+ * This file is part of Ufavonet.
+ *
+ * Ufavonet is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published
+ * by the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Ufavonet is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef _netcookie_h_
+#define _netcookie_h_
+
+#include <stdint.h>
+
+/* A cookie is valid during the time bucket it was made in and the next one, 2^COOKIE_BUCKET_BITS ticks each */
+#define COOKIE_BUCKET_BITS 6
+
+#define SIPHASH_ROTL(x, b) (uint64_t)(((x) << (b)) | ((x) >> (64 - (b))))
+#define SIPHASH_ROUND(v0, v1, v2, v3) \
+	v0 += v1; v1 = SIPHASH_ROTL(v1, 13); v1 ^= v0; v0 = SIPHASH_ROTL(v0, 32); \
+	v2 += v3; v3 = SIPHASH_ROTL(v3, 16); v3 ^= v2; \
+	v0 += v3; v3 = SIPHASH_ROTL(v3, 21); v3 ^= v0; \
+	v2 += v1; v1 = SIPHASH_ROTL(v1, 17); v1 ^= v2; v2 = SIPHASH_ROTL(v2, 32);
+
+/* SipHash-2-4 of the 16 bytes `m0` and `m1` */
+static inline uint64_t
+siphash_2u64(const uint64_t key[2], const uint64_t m0, const uint64_t m1)
+{
+	uint64_t 	v0 = key[0] ^ 0x736f6d6570736575ULL;
+	uint64_t 	v1 = key[1] ^ 0x646f72616e646f6dULL;
+	uint64_t 	v2 = key[0] ^ 0x6c7967656e657261ULL;
+	uint64_t 	v3 = key[1] ^ 0x7465646279746573ULL;
+	const uint64_t m[3] = { m0, m1, (uint64_t)16 << 56 };
+	int 		i;
+
+	for (i = 0; i < 3; i++) {
+		v3 ^= m[i];
+		SIPHASH_ROUND(v0, v1, v2, v3);
+		SIPHASH_ROUND(v0, v1, v2, v3);
+		v0 ^= m[i];
+	}
+	v2 ^= 0xff;
+	for (i = 0; i < 4; i++) {
+		SIPHASH_ROUND(v0, v1, v2, v3);
+	}
+	return v0 ^ v1 ^ v2 ^ v3;
+}
+
+/* Returns the cookie of the address/port key `addr_key` at the server tick `tick`.
+ * Only the server knows `key`, so a peer can only echo a cookie it received at that address. */
+static inline uint64_t
+cookie_make(const uint64_t key[2], const uint64_t addr_key, const uint64_t tick)
+{
+	return siphash_2u64(key, addr_key, tick >> COOKIE_BUCKET_BITS);
+}
+
+/* Returns 1 if the secrets `a` and `b` are equal. 
+ * Every byte is compared whatever the first one that differs, so the time taken does not tell a peer how much of a guess was right */
+static inline int
+secret_equal(const uint64_t a, const uint64_t b)
+{
+	volatile uint8_t 	diff = 0;
+	const uint64_t 		x = a ^ b;
+	int 				i;
+
+	for (i = 0; i < 64; i += 8) {
+		diff |= (uint8_t)(x >> i);
+	}
+	return diff == 0;
+}
+
+/* Returns 1 if `cookie` was made for `addr_key` at most one time bucket before `tick` */
+static inline int
+cookie_check(const uint64_t key[2], const uint64_t addr_key, const uint64_t tick, const uint64_t cookie)
+{
+	if (secret_equal(cookie, cookie_make(key, addr_key, tick))) {
+		return 1;
+	}
+	return tick >= (1U << COOKIE_BUCKET_BITS) && secret_equal(cookie, cookie_make(key, addr_key, tick - (1U << COOKIE_BUCKET_BITS)));
+}
+
+#endif
@@ -0,0 +1,446 @@
+/*
+ * Network I/O batching implementation.
+ * Copyright (C) 2023  Luiz Gustavo Sassanovicz Borsoi
+ *
+ * This file is part of Ufavonet.
+ *
+ * Ufavonet is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published
+ * by the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Ufavonet is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef _netio_h_
+#define _netio_h_
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <errno.h>
+
+#ifdef __linux__
+/* recvmmsg/sendmmsg are only available on linux */
+#define NETIO_HAS_MMSG 1
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/udp.h>
+#ifdef UDP_SEGMENT
+/* UDP generic segmentation/receive offload (GSO/GRO) */
+#define NETIO_HAS_SEGMENTATION 1
+#endif
+#include <linux/filter.h>
+#endif
+
+#include "../include/net.h"
+
+#define NETIO_DEFAULT_MTU 1472
+/* biggest UDP payload over IPv4 */
+#define NETIO_MAX_UDP_PAYLOAD 65507
+/* the kernel refuses to segment a buffer in more than 64 datagrams */
+#define NETIO_MAX_SEGMENTS 64
+
+#ifdef NET_HAS_SERVER_GROUP
+/* Attach a program to the reuseport group of `fd` that picks one of the `count` sockets (in bind order) 
+ * from a hash of the source address and port, so datagrams of the same peer always land on the same socket.
+ * Assumes IPv4 headers with no options, otherwise the hash covers other (still per peer) header bytes.
+ * Returns 0 on success. */
+static inline int
+netio_attach_reuseport_cbpf(const int fd, const unsigned int count)
+{
+	struct sock_filter code[] = {
+		/* A = source address */
+		{ BPF_LD | BPF_W | BPF_ABS, 0, 0, SKF_NET_OFF + 12 },
+		{ BPF_MISC | BPF_TAX, 0, 0, 0 },
+		/* A = source port << 16 | destination port */
+		{ BPF_LD | BPF_W | BPF_ABS, 0, 0, SKF_NET_OFF + 20 },
+		{ BPF_ALU | BPF_XOR | BPF_X, 0, 0, 0 },
+		/* spread the bits before the modulo (fibonacci hashing) */
+		{ BPF_ALU | BPF_MUL | BPF_K, 0, 0, 0x9E3779B1 },
+		{ BPF_ALU | BPF_RSH | BPF_K, 0, 0, 16 },
+		{ BPF_ALU | BPF_MOD | BPF_K, 0, 0, count },
+		{ BPF_RET | BPF_A, 0, 0, 0 },
+	};
+	struct sock_fprog prog = { .len = sizeof(code) / sizeof(code[0]), .filter = code };
+	return setsockopt(fd, SOL_SOCKET, SO_ATTACH_REUSEPORT_CBPF, &prog, sizeof(prog));
+}
+#endif
+
+#ifdef NETIO_HAS_SEGMENTATION
+/* Size of the control buffer needed to receive the UDP_GRO segment size */
+#define NETIO_CTRL_LEN CMSG_SPACE(sizeof(int))
+
+/* Allow the kernel to coalesce datagrams of the same flow into a single buffer.
+ * Returns 0 on success. */
+static inline int
+netio_enable_gro(const int fd)
+{
+	const int one = 1;
+	return setsockopt(fd, IPPROTO_UDP, UDP_GRO, &one, sizeof(one));
+}
+
+/* Returns the size of each coalesced datagram in `msg`, or 0 if it holds a single datagram. */
+static inline uint16_t
+netio_get_gro_size(struct msghdr *msg)
+{
+	struct cmsghdr 	*cmsg;
+	int 			gso_size;
+	for (cmsg = CMSG_FIRSTHDR(msg); cmsg != NULL; cmsg = CMSG_NXTHDR(msg, cmsg)) {
+		if (cmsg->cmsg_level == IPPROTO_UDP && cmsg->cmsg_type == UDP_GRO) {
+			memcpy(&gso_size, CMSG_DATA(cmsg), sizeof(gso_size));
+			return (uint16_t)gso_size;
+		}
+	}
+	return 0;
+}
+
+/* recvfrom that also reports the GRO segment size in `seg_size` (0 if not coalesced). */
+static inline ssize_t
+netio_recv(const int fd, void *buff, const size_t len, struct sockaddr_in *addr, uint16_t *seg_size)
+{
+	union {
+		uint8_t 		buff[NETIO_CTRL_LEN];
+		struct cmsghdr 	align;
+	} 				ctrl;
+	struct iovec 	iov = { .iov_base = buff, .iov_len = len };
+	struct msghdr 	msg = {0};
+	ssize_t 		recvlen;
+
+	msg.msg_name = addr;
+	msg.msg_namelen = sizeof(struct sockaddr_in);
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = ctrl.buff;
+	msg.msg_controllen = sizeof(ctrl.buff);
+	if ( (recvlen = recvmsg(fd, &msg, MSG_DONTWAIT)) == -1 ) {
+		return -1;
+	}
+	*seg_size = netio_get_gro_size(&msg);
+	return recvlen;
+}
+
+/* Send `len` bytes of `buff` to `addr` as datagrams of `seg_size` bytes (the last one may be smaller) with a single syscall.
+ * Falls back to one sendto per datagram if the kernel or the route is unable to segment.
+ * Returns the amount of bytes sent, or -1 (errno is set) on failure. */
+static inline ssize_t
+netio_send_segments(const int fd, const uint8_t *buff, const size_t len, const uint16_t seg_size, const struct sockaddr_in *addr)
+{
+	union {
+		uint8_t 		buff[CMSG_SPACE(sizeof(uint16_t))];
+		struct cmsghdr 	align;
+	} 					ctrl;
+	struct iovec 		iov = { .iov_base = (void *)buff, .iov_len = len };
+	struct msghdr 		msg = {0};
+	struct cmsghdr 		*cmsg;
+	ssize_t 			r;
+	size_t 				off, seglen, sent = 0;
+
+	msg.msg_name = (void *)addr;
+	msg.msg_namelen = sizeof(struct sockaddr_in);
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = ctrl.buff;
+	msg.msg_controllen = sizeof(ctrl.buff);
+	cmsg = CMSG_FIRSTHDR(&msg);
+	cmsg->cmsg_level = IPPROTO_UDP;
+	cmsg->cmsg_type = UDP_SEGMENT;
+	cmsg->cmsg_len = CMSG_LEN(sizeof(uint16_t));
+	memcpy(CMSG_DATA(cmsg), &seg_size, sizeof(uint16_t));
+
+	if ( (r = sendmsg(fd, &msg, MSG_DONTWAIT)) != -1 || errno == EAGAIN || errno == EWOULDBLOCK ) {
+		return r;
+	}
+	/* no segmentation offload for this route, send one by one */
+	for (off = 0; off < len; off += seglen) {
+		seglen = len - off < seg_size ? len - off : seg_size;
+		if ( (r = sendto(fd, buff + off, seglen, MSG_DONTWAIT, (const struct sockaddr *)addr, sizeof(struct sockaddr_in))) == -1 ) {
+			return sent > 0 ? (ssize_t)sent : -1;
+		}
+		sent += r;
+	}
+	return sent;
+}
+#endif
+
+#ifdef NETIO_HAS_MMSG
+/* A ring of `count` buffers of `slot_len` bytes each, filled by a single recvmmsg call. */
+struct recvbatch {
+	unsigned int 		count;
+	size_t 				slot_len;
+	uint8_t 			*buffers;
+	struct mmsghdr 		*msgs;
+	struct iovec 		*iov;
+	struct sockaddr_in 	*addrs;
+	/* control buffers to receive the GRO segment size, NULL if not needed */
+	uint8_t 			*ctrl;
+};
+
+static inline void
+recvbatch_free(struct recvbatch **b)
+{
+	if (b == NULL)
+		return;
+	if (*b == NULL)
+		return;
+
+	free((*b)->buffers);
+	free((*b)->msgs);
+	free((*b)->iov);
+	free((*b)->addrs);
+	free((*b)->ctrl);
+	free(*b);
+	*b = NULL;
+}
+
+/* `with_ctrl` should be set if the socket has GRO enabled. */
+static inline struct recvbatch *
+recvbatch_init(const unsigned int count, const size_t slot_len, const int with_ctrl)
+{
+	struct recvbatch 	*b;
+	unsigned int 		i;
+
+	if (count == 0 || slot_len == 0) {
+		return NULL;
+	}
+	b = malloc(sizeof(struct recvbatch));
+	if (b == NULL) {
+		return NULL;
+	}
+	memset(b, 0, sizeof(struct recvbatch));
+	b->count = count;
+	b->slot_len = slot_len;
+	b->buffers = malloc(count * slot_len);
+	b->msgs = calloc(count, sizeof(struct mmsghdr));
+	b->iov = calloc(count, sizeof(struct iovec));
+	b->addrs = calloc(count, sizeof(struct sockaddr_in));
+	if (b->buffers == NULL || b->msgs == NULL || b->iov == NULL || b->addrs == NULL) {
+		recvbatch_free(&b);
+		return NULL;
+	}
+#ifdef NETIO_HAS_SEGMENTATION
+	if (with_ctrl) {
+		b->ctrl = malloc(count * NETIO_CTRL_LEN);
+		if (b->ctrl == NULL) {
+			recvbatch_free(&b);
+			return NULL;
+		}
+	}
+#else
+	(void)with_ctrl;
+#endif
+	for (i = 0; i < count; i++) {
+		b->iov[i].iov_base = b->buffers + i * slot_len;
+		b->iov[i].iov_len = slot_len;
+		b->msgs[i].msg_hdr.msg_iov = &b->iov[i];
+		b->msgs[i].msg_hdr.msg_iovlen = 1;
+		b->msgs[i].msg_hdr.msg_name = &b->addrs[i];
+	}
+	return b;
+}
+
+/* Receive up to `count` datagrams with a single syscall.
+ * Returns the amount of datagrams received, or -1 (errno is set) on failure. */
+static inline int
+recvbatch_recv(struct recvbatch *b, const int fd)
+{
+	unsigned int i;
+	for (i = 0; i < b->count; i++) {
+		/* the kernel overwrites these on every call */
+		b->msgs[i].msg_hdr.msg_namelen = sizeof(struct sockaddr_in);
+		b->msgs[i].msg_hdr.msg_flags = 0;
+#ifdef NETIO_HAS_SEGMENTATION
+		if (b->ctrl != NULL) {
+			b->msgs[i].msg_hdr.msg_control = b->ctrl + i * NETIO_CTRL_LEN;
+			b->msgs[i].msg_hdr.msg_controllen = NETIO_CTRL_LEN;
+		}
+#endif
+	}
+	return recvmmsg(fd, b->msgs, b->count, MSG_DONTWAIT, NULL);
+}
+
+static inline uint8_t *
+recvbatch_get_buff(struct recvbatch *b, const unsigned int i)
+{
+	return b->buffers + i * b->slot_len;
+}
+
+/* Returns 1 if the datagram in slot `i` did not fit in the slot and got truncated. */
+static inline int
+recvbatch_is_truncated(struct recvbatch *b, const unsigned int i)
+{
+	return (b->msgs[i].msg_hdr.msg_flags & MSG_TRUNC) != 0;
+}
+
+/* Returns the GRO segment size of slot `i`, or 0 if it holds a single datagram. */
+static inline uint16_t
+recvbatch_get_segment_size(struct recvbatch *b, const unsigned int i)
+{
+#ifdef NETIO_HAS_SEGMENTATION
+	if (b->ctrl != NULL) {
+		return netio_get_gro_size(&b->msgs[i].msg_hdr);
+	}
+#else
+	(void)b; (void)i;
+#endif
+	return 0;
+}
+
+/* Datagrams waiting to be sent with a single sendmmsg call.
+ * Each datagram is written straight into `arena`, which always has room for one more datagram of `max_datagram` bytes unless the batch is full. */
+struct sendbatch {
+	unsigned int 		count, pending;
+	size_t 				arena_len, used, max_datagram;
+	uint8_t 			*arena;
+	struct mmsghdr 		*msgs;
+	struct iovec 		*iov;
+	struct sockaddr_in 	*addrs;
+};
+
+static inline void
+sendbatch_free(struct sendbatch **b)
+{
+	if (b == NULL)
+		return;
+	if (*b == NULL)
+		return;
+
+	free((*b)->arena);
+	free((*b)->msgs);
+	free((*b)->iov);
+	free((*b)->addrs);
+	free(*b);
+	*b = NULL;
+}
+
+static inline struct sendbatch *
+sendbatch_init(const unsigned int count, const size_t mtu, const size_t max_datagram)
+{
+	struct sendbatch 	*b;
+	unsigned int 		i;
+
+	if (count == 0 || mtu == 0) {
+		return NULL;
+	}
+	b = malloc(sizeof(struct sendbatch));
+	if (b == NULL) {
+		return NULL;
+	}
+	memset(b, 0, sizeof(struct sendbatch));
+	b->count = count;
+	b->max_datagram = max_datagram;
+	b->arena_len = count * mtu + max_datagram;
+	b->arena = malloc(b->arena_len);
+	b->msgs = calloc(count, sizeof(struct mmsghdr));
+	b->iov = calloc(count, sizeof(struct iovec));
+	b->addrs = calloc(count, sizeof(struct sockaddr_in));
+	if (b->arena == NULL || b->msgs == NULL || b->iov == NULL || b->addrs == NULL) {
+		sendbatch_free(&b);
+		return NULL;
+	}
+	for (i = 0; i < count; i++) {
+		b->msgs[i].msg_hdr.msg_iov = &b->iov[i];
+		b->msgs[i].msg_hdr.msg_iovlen = 1;
+		b->msgs[i].msg_hdr.msg_name = &b->addrs[i];
+		b->msgs[i].msg_hdr.msg_namelen = sizeof(struct sockaddr_in);
+	}
+	return b;
+}
+
+/* Returns 1 if there is no room for another datagram of `max_datagram` bytes. */
+static inline int
+sendbatch_is_full(struct sendbatch *b)
+{
+	return b->pending == b->count || b->arena_len - b->used < b->max_datagram;
+}
+
+/* Returns where the next datagram should be written. 
+ * At least `max_datagram` bytes are available if the batch is not full. */
+static inline uint8_t *
+sendbatch_get_free(struct sendbatch *b)
+{
+	return b->arena + b->used;
+}
+
+static inline size_t
+sendbatch_get_free_len(struct sendbatch *b)
+{
+	return b->arena_len - b->used;
+}
+
+/* Queue the `len` bytes written at `sendbatch_get_free` as a datagram to `addr`. */
+static inline void
+sendbatch_push(struct sendbatch *b, const size_t len, const struct sockaddr_in *addr)
+{
+	b->iov[b->pending].iov_base = b->arena + b->used;
+	b->iov[b->pending].iov_len = len;
+	b->addrs[b->pending] = *addr;
+	b->pending++;
+	b->used += len;
+}
+
+/* Remove the `n` oldest datagrams, moving the remaining ones to the beginning of the arena. */
+static inline void
+sendbatch_drop(struct sendbatch *b, const unsigned int n)
+{
+	size_t 			offset;
+	unsigned int 	i;
+
+	if (n == 0) {
+		return;
+	}
+	if (n >= b->pending) {
+		b->pending = 0;
+		b->used = 0;
+		return;
+	}
+	offset = (uint8_t *)b->iov[n].iov_base - b->arena;
+	memmove(b->arena, b->arena + offset, b->used - offset);
+	b->used -= offset;
+	for (i = n; i < b->pending; i++) {
+		b->iov[i - n].iov_base = (uint8_t *)b->iov[i].iov_base - offset;
+		b->iov[i - n].iov_len = b->iov[i].iov_len;
+		b->addrs[i - n] = b->addrs[i];
+	}
+	b->pending -= n;
+}
+
+/* Send the pending datagrams with as few sendmmsg calls as possible.
+ * Datagrams that could not be sent because the socket would block are kept for the next flush.
+ * Returns the amount of bytes sent. */
+static inline size_t
+sendbatch_flush(struct sendbatch *b, const int fd)
+{
+	unsigned int 	sent = 0;
+	size_t 			bytes = 0;
+	int 			r, i;
+
+	while (sent < b->pending) {
+		if ( (r = sendmmsg(fd, b->msgs + sent, b->pending - sent, MSG_DONTWAIT)) == -1 ) {
+			if (errno == EAGAIN || errno == EWOULDBLOCK) {
+				/* OS or network cant keep up. carry the remaining datagrams over */
+				break;
+			}
+			/* some other problem with the first datagram, drop it */
+			perror("sendmmsg()");
+			sent++;
+			continue;
+		}
+		for (i = 0; i < r; i++) {
+			bytes += b->msgs[sent + i].msg_len;
+		}
+		sent += r;
+	}
+	sendbatch_drop(b, sent);
+	return bytes;
+}
+#endif
+
+#endif
@@ -29,67 +29,363 @@
 #include "../include/packet.h"
 #include "../include/net.h"
 
+/* messages after the next expected one that are selectively acknowledged */
+#define MSG_SACK_BITS 	32
+/* messages received and ids acknowledged handed to the batch events at most per call */
+#define MSG_BATCH_LEN 	32
+
+/* A message written once and sent by the handles of many connections (see `message_send_shared`). 
+ * `packet` holds its length and its bytes, as written after the submessage count. It is freed when the last reference is released. */
+struct msg_shared {
+	packet_t 		*packet;
+	uint32_t 		refcount;
+};
+
 struct message {
 	struct message 	*next, *prev;
 	packet_t 		*packet;
+	/* if not NULL, sent instead of `packet` */
+	struct msg_shared 	*shared;
+	/* the other fragments of the message not released yet, linked in a ring. NULL if not a fragment */
+	struct message 	*frag_next, *frag_prev;
+	/* 0 for a fragment of a message too big for a single one. Fragments of a message share its `iid` */
 	int 			submsg_count;
-	uint8_t 		id;
+	uint16_t 		id;
+	/* `id` is set. Ids are given in `msg_assign_ids`, while the ring of the handle has room */
+	uint8_t 		has_id;
 	uint32_t 		iid;
+	/* channel and its mode, as written to the packet (see `MSG_CHANNEL_BYTE`), and the sequence within the channel */
+	uint8_t 		channel;
+	uint16_t 		seq;
+	/* send tick of the handle it was last sent at, and how many times it was sent */
+	uint32_t 		sent_tick;
+	uint8_t 		tx_count;
+	/* a message sent after it was acknowledged first, so it is sent again right away */
+	uint8_t 		lost;
+	/* messages with a higher priority go first */
+	uint8_t 		priority;
+	/* if `expires`, the message is dropped once the handle tick passes `expire_tick`. 
+	 * An `expired` message (`MSG_EXPIRED` or `MSG_DROPPED`) is sent empty, so the receiver can skip its id and sequence */
+	uint8_t 		expires, expired;
+	uint32_t 		expire_tick;
+};
+
+struct msg_channel {
+	enum netconn_channel_mode 	mode;
+	/* sequence of the next message sent, and of the next one expected. Sequenced messages older than that are dropped */
+	uint16_t 		send_seq, recv_seq;
+	/* the message messages sent during this tick are merged in */
+	struct message 	*current;
+	/* fragments received so far of the message being reassembled, and the index of the next one. 
+	 * `frag_pkt` is allocated when the first fragment arrives */
+	packet_t 		*frag_pkt;
+	uint32_t 		frag_next;
+};
+
+/* Free messages shared by the handles of a connection, outside of capacity mode. 
+ * Once it holds more than `high` messages it is trimmed down to `low`, so the memory taken by a burst is given back. */
+struct msg_pool {
+	struct message 	*free;
+	uint32_t 		count, high, low;
+	/* messages with a bigger buffer are put back without it */
+	uint32_t 		buffer_max;
 };
 
 struct msg_handle {
-	struct message 	*send, *pool, *queue, *current;
-	uint8_t 		last_recv, last_id, last_ack, send_count, recv_count;
-	uint32_t 		pool_count, queue_count, last_iid;
+	/* unreliable messages are only in `unreliable`, sent once and released in the next tick */
+	struct message 	*send, *queue, *unreliable;
+	/* where messages come from when there is no slab */
+	struct msg_pool *pool;
+	/* ids are given to messages right before they are first sent (see `msg_assign_ids`), so they follow the order they are sent in */
+	uint16_t 		last_recv, last_id, last_ack, send_count, recv_count;
+	/* ack lookup index of the messages with an id not acknowledged yet, at `id & ring_mask`, so acknowledgments find them without walking `send`. 
+	 * `send_base` is the oldest one, the ring holds the ids from it to `last_id`. The messages themselves stay in `send` */
+	struct message 	**ring;
+	uint16_t 		ring_mask, send_base;
+	/* ids received after `last_ack`, bit `id & ring_mask` set. 
+	 * Ids up to `last_ack + ring_mask + 1` are taken, so the sender can keep its whole ring in flight when one is lost */
+	uint32_t 		*recv_bits;
+	/* messages that can be sent and not acknowledged yet, the rest wait in `queue` */
+	uint16_t 		window;
+	/* bytes a message can hold, bigger ones are split in fragments. Up to `max_fragmented_len` bytes */
+	uint32_t 		message_cap, max_fragmented_len;
+	struct msg_channel 	channels[NET_MAX_CHANNELS];
+	/* channel of the message being delivered */
+	uint8_t 		recv_channel;
+	/* messages received and ids acknowledged while reading a datagram, for `onreceivemsgs` and `onmessageacks` if set */
+	struct netmsgview 	recv_batch[MSG_BATCH_LEN];
+	uint32_t 		ack_batch[MSG_BATCH_LEN];
+	uint8_t 		recv_batch_count, ack_batch_count;
+	uint32_t 		queue_count, last_iid;
+	/* bytes of the reliable messages in `send` and `queue`, kept under `max_queued_bytes` (if not 0) as told by `queue_policy`. 
+	 * `queue_full` is set if the last message sent was rejected because of it */
+	uint32_t 		queued_bytes, max_queued_bytes;
+	uint8_t 		queue_policy, queue_full;
+	/* message returned by `message_reserve` until it is committed, and what it goes with */
+	struct message 	*reserved;
+	uint8_t 		reserved_channel, reserved_priority;
+	uint16_t 		reserved_ttl;
 	packet_t 		*msg_read_pkt;
+	/* incremented by every `msg_onsend_process`, the clock retransmissions are timed with */
+	uint32_t 		tick;
+	/* smoothed round trip time and its variation, in 1/8 of a tick. `rto` is in ticks */
+	uint32_t 		srtt, rttvar, rto;
+	uint8_t 		has_rtt;
+	/* ordered messages that arrived ahead of the previous one of their channel, at `id & ring_mask`, and how many */
+	struct message 	**reorder;
+	uint32_t 		reorder_count;
+	/* where the handle and its messages come from. NULL if allocated on demand */
+	struct msg_slab *slab;
+	/* links the free handles of the slab */
+	struct msg_handle *next_free;
 };
 
-#define SENDCOUNTMAX 128
+/* Every message handle and message a server can use, allocated at once (capacity mode).
+ * Messages are shared by all handles, and each one holds up to `message_len` bytes in a fixed buffer. */
+struct msg_slab {
+	struct msg_handle 	*handles, *free_handles;
+	struct message 		*messages, *free_messages;
+	uint8_t 			*buffers;
+	/* the rings of the handles (see `msg_handle`), `ring_len` slots each (see `msg_ring_size`) */
+	uint8_t 			*rings;
+	uint32_t 			handle_count, message_count, message_len, ring_len;
+};
 
-static inline struct msg_handle *
-msghandle_init()
+/* Messages in flight by default, and at most. 
+ * Ids are 16 bits and compared with wraparound, so the window must stay well below half of them. */
+#define MSG_WINDOW_DEFAULT 	128
+#define MSG_WINDOW_MAX 		16384
+/* Slots of the ring of messages in flight at least. It is a power of two that holds the window */
+#define MSG_RING_MIN 	64
+/* Bytes taken by the length of a reserved message (see `message_reserve`) */
+#define MSG_RESERVED_LEN 	3
+/* Messages written to a message only datagram at most, so its count takes a single byte */
+#define MSG_CONTINUATION_MAX 	127
+/* Bytes of a datagram left for the headers and the acknowledgment when a message fills the rest, 
+ * so fragments go in message only datagrams of `mtu` bytes */
+#define MSG_FRAGMENT_OVERHEAD 	64
+/* Smallest datagram messages are sent in */
+#define MSG_MIN_MTU 	(2 * MSG_FRAGMENT_OVERHEAD)
+/* Bytes the index, fragment count and length of a fragment take at most */
+#define MSG_FRAGMENT_HEADER_LEN 9
+#define MSG_FRAGMENTED_DEFAULT_MAX 	(1 << 20)
+#define MSG_FRAGMENT_INVALID 	UINT32_MAX
+/* The channel of a message and its mode share a byte */
+#define MSG_CHANNEL_BYTE(channel, mode) 	((uint8_t)((channel) | (mode) << 4))
+#define MSG_CHANNEL(byte) 	((byte) & 0x0F)
+#define MSG_CHANNEL_MODE(byte) 	((byte) >> 4)
+/* Values of `expired`. Dropped messages are reported as expired in the next `msg_expire` */
+#define MSG_EXPIRED 	1
+#define MSG_DROPPED 	2
+/* Free messages a pool keeps by default. The low watermark defaults to a quarter of the high one */
+#define MSG_POOL_DEFAULT_HIGH 	1024
+/* Retransmission timeout bounds, in ticks. 
+ * Messages are sent once and then again each time the timeout expires, doubling it on every retry. */
+#define MSG_RTO_INITIAL 8
+#define MSG_RTO_MIN 	2
+#define MSG_RTO_MAX 	64
+/* Returned by `msg_onsend_process` when the messages did not fit in the packet.
+ * They should be sent with `msg_onsend_continuation`. */
+#define MSG_SEND_DEFERRED 2
+
+static inline void
+msgslab_free(struct msg_slab *slab)
 {
-	struct msg_handle *hmsg = malloc(sizeof(struct msg_handle));
-	if (hmsg == NULL) {
-		return NULL;
+	uint32_t i;
+	if (slab->handles != NULL) {
+		for (i = 0; i < slab->handle_count; i++) {
+			packet_free(&slab->handles[i].msg_read_pkt);
+		}
 	}
-	memset(hmsg, 0, sizeof(struct msg_handle));
-	hmsg->msg_read_pkt = packet_init();
-	if (hmsg->msg_read_pkt == NULL) {
-		free(hmsg);
-		return NULL;
+	if (slab->messages != NULL) {
+		for (i = 0; i < slab->message_count; i++) {
+			packet_free(&slab->messages[i].packet);
+		}
 	}
-	hmsg->send = NULL;
-	hmsg->pool = NULL;
-	hmsg->queue = NULL;
-	hmsg->current = NULL;
-	return hmsg;
+	free(slab->handles);
+	free(slab->messages);
+	free(slab->buffers);
+	free(slab->rings);
+	memset(slab, 0, sizeof(*slab));
 }
 
-#define LL_FREEALL(head) \
-	for(msg = head; msg != NULL; ) { \
-		msg2 = msg->next; \
-		packet_free(&msg->packet); \
-		free(msg); \
-		msg = msg2; \
+/* Returns the slots of the ring of messages in flight of a handle with a window of `window` messages (0 for the default) */
+static inline uint32_t
+msg_ring_len(const uint16_t window)
+{
+	const uint16_t 	w = window == 0 ? MSG_WINDOW_DEFAULT : window;
+	uint32_t 		len = MSG_RING_MIN;
+
+	while (len < w && len < MSG_WINDOW_MAX) {
+		len <<= 1;
 	}
+	return len;
+}
+
+/* Returns the bytes taken by the rings of a handle with `ring_len` slots: the messages in flight, the reorder buffer and the ids received */
+static inline size_t
+msg_ring_size(const uint32_t ring_len)
+{
+	return 2 * (size_t)ring_len * sizeof(struct message *) + ring_len / 8;
+}
 
+/* Points the rings of `hmsg` to `ring_len` slots of zeroed memory at `rings` (see `msg_ring_size`) */
 static inline void
-msghandle_free(struct msg_handle **h)
+msg_ring_set(struct msg_handle *hmsg, uint8_t *rings, const uint32_t ring_len)
 {
-	struct message *msg, *msg2;
-	if (h == NULL)
-		return;
-	if (*h == NULL)
-		return;
+	hmsg->ring = (struct message **)rings;
+	hmsg->reorder = hmsg->ring + ring_len;
+	hmsg->recv_bits = (uint32_t *)(hmsg->reorder + ring_len);
+	hmsg->ring_mask = ring_len - 1;
+}
 
-	packet_free(&(*h)->msg_read_pkt);
-	LL_FREEALL((*h)->send);
-	LL_FREEALL((*h)->pool);
-	LL_FREEALL((*h)->queue);
-	/* `current` does not need to be freed as it's always in one of the lists */
-	free(*h);
-	*h = NULL;
+/* Each handle has rings of `ring_len` slots (see `msg_ring_len`). Returns -1 if memory allocation fails */
+static inline int
+msgslab_init(struct msg_slab *slab, const uint32_t handle_count, const uint32_t message_count, const uint32_t message_len, const uint32_t ring_len)
+{
+	/* packet_w needs a spare byte to write up to the end of a fixed buffer */
+	const size_t 	stride = (size_t)message_len + 1;
+	uint32_t 		i;
+
+	memset(slab, 0, sizeof(*slab));
+	slab->handle_count = handle_count;
+	slab->message_count = message_count;
+	slab->message_len = message_len;
+	slab->ring_len = ring_len;
+	slab->handles = calloc(handle_count, sizeof(struct msg_handle));
+	slab->messages = calloc(message_count, sizeof(struct message));
+	slab->buffers = malloc(message_count * stride);
+	slab->rings = calloc(handle_count, msg_ring_size(ring_len));
+	if (slab->handles == NULL || slab->messages == NULL || slab->buffers == NULL || slab->rings == NULL) {
+		msgslab_free(slab);
+		return -1;
+	}
+	/* touched now, so the pages do not fault in while running */
+	memset(slab->buffers, 0, message_count * stride);
+	for (i = handle_count; i-- > 0; ) {
+		if ( (slab->handles[i].msg_read_pkt = packet_init()) == NULL ) {
+			msgslab_free(slab);
+			return -1;
+		}
+		slab->handles[i].next_free = slab->free_handles;
+		slab->free_handles = &slab->handles[i];
+	}
+	for (i = message_count; i-- > 0; ) {
+		if ( (slab->messages[i].packet = packet_init_from_buff(slab->buffers + i * stride, stride)) == NULL ) {
+			msgslab_free(slab);
+			return -1;
+		}
+		slab->messages[i].next = slab->free_messages;
+		slab->free_messages = &slab->messages[i];
+	}
+	return 0;
+}
+
+/* Sets the watermarks of `pool` from `settings`, with `mtu` already set */
+static inline void
+msgpool_init(struct msg_pool *pool, const struct netsettings *settings)
+{
+	memset(pool, 0, sizeof(*pool));
+	pool->high = settings->message_pool_high > 0 ? settings->message_pool_high : MSG_POOL_DEFAULT_HIGH;
+	pool->low = settings->message_pool_low > 0 && settings->message_pool_low <= pool->high ? settings->message_pool_low : pool->high / 4;
+	/* messages hold less than `mtu` bytes, unless they were held for reordering */
+	pool->buffer_max = 2 * (uint32_t)settings->mtu;
+}
+
+/* Frees the messages of `pool` until there are `count` left */
+static inline void
+msgpool_trim(struct msg_pool *pool, const uint32_t count)
+{
+	struct message *msg;
+
+	while (pool->count > count) {
+		msg = pool->free;
+		pool->free = msg->next;
+		packet_free(&msg->packet);
+		free(msg);
+		pool->count--;
+	}
+}
+
+static inline void
+msgpool_free(struct msg_pool *pool)
+{
+	msgpool_trim(pool, 0);
+}
+
+/* Messages will be sent in datagrams of up to `mtu` bytes, so new ones hold less than that */
+static inline void
+msghandle_set_mtu(struct msg_handle *hmsg, const uint16_t mtu)
+{
+	int 	i;
+
+	hmsg->message_cap = mtu >= MSG_MIN_MTU ? mtu - MSG_FRAGMENT_OVERHEAD : MSG_FRAGMENT_OVERHEAD;
+	if (hmsg->slab != NULL && hmsg->slab->message_len < hmsg->message_cap) {
+		hmsg->message_cap = hmsg->slab->message_len;
+	}
+	/* the messages being filled may be bigger already */
+	for (i = 0; i < NET_MAX_CHANNELS; i++) {
+		hmsg->channels[i].current = NULL;
+	}
+}
+
+/* Takes the handle from `slab` if not NULL, otherwise allocates it, with messages from `pool`.
+ * The window, the size of messages, the channels and the queue limit come from `settings`, with `mtu` already set.
+ * Returns NULL if memory allocation fails or the slab has no handles left. */
+static inline struct msg_handle *
+msghandle_init(struct msg_slab *slab, struct msg_pool *pool, const struct netsettings *settings)
+{
+	struct msg_handle 	*hmsg;
+	packet_t 			*msg_read_pkt;
+	uint8_t 			*rings;
+	const uint16_t 		window = settings->message_window;
+	uint32_t 			ring_len = msg_ring_len(window);
+	int 				i;
+
+	if (slab != NULL) {
+		if ( (hmsg = slab->free_handles) == NULL ) {
+			return NULL;
+		}
+		slab->free_handles = hmsg->next_free;
+		msg_read_pkt = hmsg->msg_read_pkt;
+		ring_len = slab->ring_len;
+		rings = slab->rings + (size_t)(hmsg - slab->handles) * msg_ring_size(ring_len);
+		memset(rings, 0, msg_ring_size(ring_len));
+	} else {
+		if ( (hmsg = malloc(sizeof(struct msg_handle))) == NULL ) {
+			return NULL;
+		}
+		if ( (msg_read_pkt = packet_init()) == NULL ) {
+			free(hmsg);
+			return NULL;
+		}
+		if ( (rings = calloc(1, msg_ring_size(ring_len))) == NULL ) {
+			packet_free(&msg_read_pkt);
+			free(hmsg);
+			return NULL;
+		}
+	}
+	memset(hmsg, 0, sizeof(struct msg_handle));
+	hmsg->msg_read_pkt = msg_read_pkt;
+	msg_ring_set(hmsg, rings, ring_len);
+	/* nothing in flight: the next id is the oldest one */
+	hmsg->send_base = 1;
+	hmsg->slab = slab;
+	hmsg->pool = pool;
+	hmsg->send = NULL;
+	hmsg->queue = NULL;
+	hmsg->unreliable = NULL;
+	hmsg->rto = MSG_RTO_INITIAL;
+	hmsg->window = window == 0 ? MSG_WINDOW_DEFAULT : window > MSG_WINDOW_MAX ? MSG_WINDOW_MAX : window;
+	msghandle_set_mtu(hmsg, settings->mtu);
+	hmsg->max_fragmented_len = settings->max_fragmented_len > 0 ? settings->max_fragmented_len : MSG_FRAGMENTED_DEFAULT_MAX;
+	hmsg->max_queued_bytes = settings->max_queued_bytes;
+	hmsg->queue_policy = settings->queue_policy;
+	for (i = 0; i < NET_MAX_CHANNELS; i++) {
+		hmsg->channels[i].mode = settings->channels[i] <= ECHANNEL_UNRELIABLE_SEQUENCED ? settings->channels[i] : ECHANNEL_RELIABLE_ORDERED;
+		hmsg->channels[i].frag_next = MSG_FRAGMENT_INVALID;
+	}
+	return hmsg;
 }
 
 #define LL_REMOVE(head,msg) \
@@ -131,141 +427,1255 @@ msghandle_free(struct msg_handle **h)
 	} \
 	head->prev = msg;
 
+/* Adds `msg` to the list at `head` after every message with the same or a higher priority */
 static inline void
-msg_onreceive_process(packet_t *p_in, struct msg_handle *hmsg, netconn_t *conn, void *userdata, struct srvevents *srvevents, struct clievents *clievents, netsrvclient_t *client)
+msg_insert(struct message **head, struct message *msg)
+{
+	struct message 	*pos = *head;
+
+	if (pos == NULL || pos->prev->priority >= msg->priority) {
+		LL_ADDTOEND(pos, msg);
+		*head = pos;
+		return;
+	}
+	while (pos->priority >= msg->priority) {
+		pos = pos->next;
+	}
+	msg->next = pos;
+	msg->prev = pos->prev;
+	if (pos == *head) {
+		*head = msg;
+	} else {
+		pos->prev->next = msg;
+	}
+	pos->prev = msg;
+}
+
+/* Returns the amount of bytes `value` takes with `packet_w_vlen29` */
+static inline uint32_t
+vlen29_size(const uint32_t value)
+{
+	return value < 0x80 ? 1 : value < 0x4000 ? 2 : value < 0x200000 ? 3 : 4;
+}
+
+/* Returns the amount of bytes of the submessages of `msg` */
+static inline uint32_t
+msg_get_len(const struct message *msg)
+{
+	return packet_get_length(msg->shared != NULL ? msg->shared->packet : msg->packet);
+}
+
+/* Returns the amount of bytes `msg` takes in a packet */
+static inline uint32_t
+msg_get_wire_len(struct message *msg)
+{
+	/* channel, then the id if reliable and the sequence if ordered or sequenced */
+	const uint8_t 	mode = MSG_CHANNEL_MODE(msg->channel);
+
+	return 1 + (mode != ECHANNEL_UNRELIABLE_SEQUENCED ? 2 : 0) + (mode != ECHANNEL_RELIABLE_UNORDERED ? 2 : 0) 
+		+ vlen29_size(msg->submsg_count) + msg_get_len(msg);
+}
+
+static inline void
+msg_write(packet_t *p_out, struct message *msg)
+{
+	const uint8_t 	mode = MSG_CHANNEL_MODE(msg->channel);
+
+	packet_w_8_t(p_out, &msg->channel);
+	if (mode != ECHANNEL_UNRELIABLE_SEQUENCED) {
+		packet_w_16_t(p_out, &msg->id);
+	}
+	if (mode != ECHANNEL_RELIABLE_UNORDERED) {
+		packet_w_16_t(p_out, &msg->seq);
+	}
+	packet_w_vlen29(p_out, msg->submsg_count);
+	packet_w(p_out, packet_get_buff(msg->shared != NULL ? msg->shared->packet : msg->packet), msg_get_len(msg));
+}
+
+/* Updates the round trip time estimate with a sample of `rtt` ticks and computes the timeout from it (RFC 6298) */
+static inline void
+msg_rtt_sample(struct msg_handle *hmsg, const uint32_t rtt)
+{
+	const uint32_t 	r = rtt << 3;
+	uint32_t 		delta, var;
+
+	if (!hmsg->has_rtt) {
+		hmsg->srtt = r;
+		hmsg->rttvar = r >> 1;
+		hmsg->has_rtt = 1;
+	} else {
+		delta = hmsg->srtt > r ? hmsg->srtt - r : r - hmsg->srtt;
+		hmsg->rttvar = (3 * hmsg->rttvar + delta) >> 2;
+		hmsg->srtt = (7 * hmsg->srtt + r) >> 3;
+	}
+	/* at least a tick of variation, as that is the resolution of the samples */
+	var = 4 * hmsg->rttvar > 8 ? 4 * hmsg->rttvar : 8;
+	hmsg->rto = (hmsg->srtt + var + 7) >> 3;
+	if (hmsg->rto < MSG_RTO_MIN) {
+		hmsg->rto = MSG_RTO_MIN;
+	} else if (hmsg->rto > MSG_RTO_MAX) {
+		hmsg->rto = MSG_RTO_MAX;
+	}
+}
+
+/* Returns 1 if `msg` should go in the packets being written: it was never sent, its timeout expired, 
+ * or it was already written during this tick (the datagram it went in may be rewritten) */
+static inline int
+msg_is_due(const struct msg_handle *hmsg, const struct message *msg)
+{
+	uint32_t timeout;
+
+	if (!msg->has_id) {
+		/* waits for room in the ring */
+		return 0;
+	}
+	if (msg->tx_count == 0 || msg->lost || msg->sent_tick == hmsg->tick) {
+		return 1;
+	}
+	timeout = hmsg->rto << (msg->tx_count - 1 < 6 ? msg->tx_count - 1 : 6);
+	return hmsg->tick - msg->sent_tick >= (timeout < MSG_RTO_MAX ? timeout : MSG_RTO_MAX);
+}
+
+static inline void
+msg_mark_sent(struct msg_handle *hmsg, struct message *msg)
+{
+	msg->lost = 0;
+	if (msg->tx_count == 0 || msg->sent_tick != hmsg->tick) {
+		if (msg->tx_count < UINT8_MAX) {
+			msg->tx_count++;
+		}
+		msg->sent_tick = hmsg->tick;
+	}
+}
+
+/* Returns an empty message, or NULL if memory allocation fails or the slab has no messages left */
+static inline struct message *
+msg_acquire(struct msg_handle *hmsg)
+{
+	struct message *msg;
+
+	if (hmsg->slab != NULL) {
+		if ( (msg = hmsg->slab->free_messages) == NULL ) {
+			return NULL;
+		}
+		hmsg->slab->free_messages = msg->next;
+	} else if (hmsg->pool->free == NULL) {
+		if ( (msg = malloc(sizeof(struct message))) == NULL ) {
+			return NULL;
+		}
+		if ( (msg->packet = packet_init()) == NULL ) {
+			free(msg);
+			return NULL;
+		}
+		msg->shared = NULL;
+		msg->frag_next = msg->frag_prev = NULL;
+		return msg;
+	} else {
+		msg = hmsg->pool->free;
+		hmsg->pool->free = msg->next;
+		hmsg->pool->count--;
+	}
+	packet_rewind(msg->packet);
+	return msg;
+}
+
+/* Returns a shared message with a copy of `size` bytes of `buffer`, and a reference to it, or NULL if memory allocation fails */
+static inline struct msg_shared *
+msg_shared_init(const void *buffer, const uint32_t size)
+{
+	struct msg_shared 	*shared;
+
+	if ( (shared = malloc(sizeof(struct msg_shared))) == NULL ) {
+		return NULL;
+	}
+	if ( (shared->packet = packet_init()) == NULL ) {
+		free(shared);
+		return NULL;
+	}
+	if (packet_w_vlen29(shared->packet, size) != 0 || packet_w(shared->packet, buffer, size) != 0) {
+		packet_free(&shared->packet);
+		free(shared);
+		return NULL;
+	}
+	shared->refcount = 1;
+	return shared;
+}
+
+/* Drops a reference to `shared`, freeing it if it was the last one */
+static inline void
+msg_shared_release(struct msg_shared *shared)
+{
+	if (--shared->refcount > 0) {
+		return;
+	}
+	packet_free(&shared->packet);
+	free(shared);
+}
+
+/* Puts `msg` back where it came from, once it is not used anymore */
+static inline void
+msg_release(struct msg_handle *hmsg, struct message *msg)
+{
+	struct msg_pool *pool = hmsg->pool;
+
+	if (msg->shared != NULL) {
+		msg_shared_release(msg->shared);
+		msg->shared = NULL;
+	}
+	if (msg->frag_next != NULL) {
+		/* out of the fragments of its message */
+		msg->frag_next->frag_prev = msg->frag_prev;
+		msg->frag_prev->frag_next = msg->frag_next;
+		msg->frag_next = msg->frag_prev = NULL;
+	}
+	if (hmsg->slab != NULL) {
+		msg->next = hmsg->slab->free_messages;
+		hmsg->slab->free_messages = msg;
+		return;
+	}
+	if (packet_get_buffsize(msg->packet) > pool->buffer_max) {
+		/* allocated again when written to */
+		packet_set_buff(msg->packet, NULL, 0);
+	}
+	msg->next = pool->free;
+	pool->free = msg;
+	pool->count++;
+	if (pool->count > pool->high) {
+		msgpool_trim(pool, pool->low);
+	}
+}
+
+#define LL_RELEASEALL(hmsg, head) \
+	for(msg = head; msg != NULL; msg = msg2) { \
+		msg2 = msg->next; \
+		msg_release(hmsg, msg); \
+	}
+
+static inline void
+msghandle_free(struct msg_handle **h)
 {
 	struct message 	*msg, *msg2;
-	uint8_t 		hasmsg = 0, msg_ack, msg_id;
-	uint32_t 		submsgcount, msglen, j;
+	struct msg_slab *slab;
 	int 			i;
+	if (h == NULL)
+		return;
+	if (*h == NULL)
+		return;
 
-	packet_r_bits(p_in, &hasmsg, 1);
-	if (hasmsg == 0) {
+	for (i = 0; i < NET_MAX_CHANNELS; i++) {
+		packet_free(&(*h)->channels[i].frag_pkt);
+	}
+	/* messages held for reordering are not linked */
+	for (i = 0; i <= (*h)->ring_mask; i++) {
+		if ( (msg = (*h)->reorder[i]) != NULL ) {
+			msg_release(*h, msg);
+		}
+	}
+	if ((*h)->reserved != NULL) {
+		msg_release(*h, (*h)->reserved);
+	}
+	/* back to the slab or the pool. `current` is always in one of the lists */
+	LL_RELEASEALL(*h, (*h)->send);
+	LL_RELEASEALL(*h, (*h)->queue);
+	LL_RELEASEALL(*h, (*h)->unreliable);
+	if ( (slab = (*h)->slab) != NULL ) {
+		(*h)->next_free = slab->free_handles;
+		slab->free_handles = *h;
+		*h = NULL;
 		return;
 	}
-	/* Handle message acknowledgment */
-	packet_r_8_t(p_in, &msg_ack);
-	for (msg = hmsg->send; msg != NULL; ) {
-		msg2 = msg->next;
-		i = msg_ack - msg->id;
-		if (i > 128) { i -= 256; } else if (i < -128) { i += 256; }
-		if (i >= 0) {
-			/* the message was acknowledged. Move back to the pool */
-			LL_REMOVE(hmsg->send, msg);	
-			LL_ADD(hmsg->pool, msg);
-			hmsg->pool_count++;
-			hmsg->send_count--;
-			if (srvevents != NULL) {
-				if (srvevents->onmessageack != NULL)
-					srvevents->onmessageack(conn, userdata, msg->iid, client);
-			} else if (clievents != NULL) {
-				if (clievents->onmessageack != NULL)
-					clievents->onmessageack(conn, userdata, msg->iid);
+	packet_free(&(*h)->msg_read_pkt);
+	free((*h)->ring);
+	free(*h);
+	*h = NULL;
+}
+
+/* Reads past the `submsgcount` messages of `src`, or the fragment if 0.
+ * Returns non-zero if they run past the end of `src` */
+static inline int
+msg_skip(packet_t *src, const uint32_t submsgcount)
+{
+	uint32_t 	j, msglen;
+	int 		err = 0;
+
+	if (submsgcount == 0) {
+		/* index and fragment count */
+		err = packet_skip_vlen29(src) != 0 || packet_skip_vlen29(src) != 0;
+	}
+	for (j = 0; err == 0 && (j == 0 || j < submsgcount); j++) {
+		err = packet_r_vlen29(src, &msglen) != 0 || packet_skip(src, msglen) != 0;
+	}
+	return err;
+}
+
+/* Appends the fragment read from `src` to the message being reassembled in `channel`.
+ * Returns 1 once the last fragment completed it, and it is ready to be read from `frag_pkt`. 
+ * Returns -1 if the fragment runs past the end of `src`. */
+static inline int
+msg_reassemble(packet_t *src, struct msg_handle *hmsg, struct msg_channel *channel)
+{
+	uint32_t 	index = 0, count = 0, len = 0;
+	uint8_t 	*buff;
+
+	if (packet_r_vlen29(src, &index) != 0 || packet_r_vlen29(src, &count) != 0 || packet_r_vlen29(src, &len) != 0 
+			|| len > packet_get_readable(src)) {
+		/* runs past the datagram. The message is dropped with it */
+		channel->frag_next = MSG_FRAGMENT_INVALID;
+		if (channel->frag_pkt != NULL) {
+			packet_rewind(channel->frag_pkt);
+			packet_set_length(channel->frag_pkt, 0);
+		}
+		return -1;
+	}
+	buff = (uint8_t *)packet_get_buff(src) + packet_get_index(src);
+	packet_skip(src, len);
+	if (count == 0) {
+		/* an expired message, with nothing to deliver */
+		return 0;
+	}
+	if (index == 0) {
+		channel->frag_next = 0;
+		if (channel->frag_pkt == NULL && (channel->frag_pkt = packet_init()) == NULL) {
+			channel->frag_next = MSG_FRAGMENT_INVALID;
+		} else {
+			packet_rewind(channel->frag_pkt);
+			packet_set_length(channel->frag_pkt, 0);
+		}
+	}
+	if (index != channel->frag_next || index >= count) {
+		/* the rest of a message that is being dropped */
+		return 0;
+	}
+	if (packet_get_length(channel->frag_pkt) + len > hmsg->max_fragmented_len || packet_w(channel->frag_pkt, buff, len) != 0) {
+		channel->frag_next = MSG_FRAGMENT_INVALID;
+		return 0;
+	}
+	channel->frag_next++;
+	if (channel->frag_next < count) {
+		return 0;
+	}
+	channel->frag_next = MSG_FRAGMENT_INVALID;
+	return 1;
+}
+
+/* Hands the messages batched by `msg_deliver` to `onreceivemsgs` */
+static inline void
+msg_flush_received(struct msg_handle *hmsg, netconn_t *conn, void *userdata, struct srvevents *srvevents, struct clievents *clievents, netsrvclient_t *client)
+{
+	if (hmsg->recv_batch_count == 0) {
+		return;
+	}
+	if (srvevents != NULL) {
+		srvevents->onreceivemsgs(conn, userdata, hmsg->recv_batch, hmsg->recv_batch_count, client);
+	} else {
+		clievents->onreceivemsgs(conn, userdata, hmsg->recv_batch, hmsg->recv_batch_count);
+	}
+	hmsg->recv_batch_count = 0;
+}
+
+/* Hands the ids batched by `msg_on_ack` to `onmessageacks` */
+static inline void
+msg_flush_acks(struct msg_handle *hmsg, netconn_t *conn, void *userdata, struct srvevents *srvevents, struct clievents *clievents, netsrvclient_t *client)
+{
+	if (hmsg->ack_batch_count == 0) {
+		return;
+	}
+	if (srvevents != NULL) {
+		srvevents->onmessageacks(conn, userdata, hmsg->ack_batch, hmsg->ack_batch_count, client);
+	} else {
+		clievents->onmessageacks(conn, userdata, hmsg->ack_batch, hmsg->ack_batch_count);
+	}
+	hmsg->ack_batch_count = 0;
+}
+
+/* Calls `onreceivemsg` for each of the `submsgcount` messages read from `src`, 
+ * or once the message is complete if `src` has a fragment (`submsgcount` is 0).
+ * With `onreceivemsgs`, the messages are batched until the end of the datagram instead (see `msg_onreceive_process`), 
+ * unless their buffer may not last until then. 
+ * Returns non-zero if a message runs past the end of `src`. The ones before it are delivered, and the rest of `src` is not read. */
+static inline int
+msg_deliver(packet_t *src, const uint32_t submsgcount, const uint8_t channel, struct msg_handle *hmsg, netconn_t *conn, void *userdata, struct srvevents *srvevents, struct clievents *clievents, netsrvclient_t *client)
+{
+	struct msg_channel 	*ch = &hmsg->channels[channel];
+	struct netmsgview 	*view;
+	const uint8_t 		batched = srvevents != NULL ? srvevents->onreceivemsgs != NULL : clievents != NULL && clievents->onreceivemsgs != NULL;
+	const uint8_t 		*data;
+	uint32_t 			j, msglen;
+	int 				r;
+
+	if (submsgcount == 0 && (r = msg_reassemble(src, hmsg, ch)) != 1) {
+		return r < 0;
+	}
+	hmsg->recv_channel = channel;
+	for (j = 0; j == 0 || j < submsgcount; j++) {
+		if (submsgcount == 0) {
+			msglen = packet_get_length(ch->frag_pkt);
+			data = packet_get_buff(ch->frag_pkt);
+		} else {
+			if (packet_r_vlen29(src, &msglen) != 0 || msglen > packet_get_readable(src)) {
+				return 1;
+			}
+			data = (uint8_t *)packet_get_buff(src) + packet_get_index(src);
+			packet_skip(src, msglen);
+		}
+		if (batched) {
+			view = &hmsg->recv_batch[hmsg->recv_batch_count++];
+			view->data = data;
+			view->len = msglen;
+			view->channel = channel;
+			if (hmsg->recv_batch_count == MSG_BATCH_LEN) {
+				msg_flush_received(hmsg, conn, userdata, srvevents, clievents, client);
 			}
+			continue;
+		}
+		packet_set_buff(hmsg->msg_read_pkt, (void *)data, msglen);
+		packet_set_length(hmsg->msg_read_pkt, msglen);
+		if (srvevents != NULL) {
+			if (srvevents->onreceivemsg != NULL)
+				srvevents->onreceivemsg(conn, userdata, hmsg->msg_read_pkt, client);
+		} else if (clievents != NULL) {
+			if (clievents->onreceivemsg != NULL)
+				clievents->onreceivemsg(conn, userdata, hmsg->msg_read_pkt);
+		}
+	}
+	if (submsgcount == 0) {
+		/* the next fragment may overwrite it */
+		msg_flush_received(hmsg, conn, userdata, srvevents, clievents, client);
+		if (packet_get_buffsize(ch->frag_pkt) > hmsg->pool->buffer_max) {
+			/* a big message does not keep its buffer for the rest of the connection */
+			packet_set_buff(ch->frag_pkt, NULL, 0);
 		}
-		msg = msg2;
 	}
-	/* If queue has messages, move them to send list */
-	for (msg = hmsg->queue; msg != NULL && hmsg->send_count < SENDCOUNTMAX; ) {
+	return 0;
+}
+
+#define MSG_RECEIVED(hmsg, id) 	((hmsg)->recv_bits[((id) & (hmsg)->ring_mask) >> 5] & (1U << ((id) & 31)))
+
+/* Returns 1 if the message `msg_id` was not received yet, and is within the messages that can be acknowledged */
+static inline int
+msg_is_new(const struct msg_handle *hmsg, const uint16_t msg_id)
+{
+	const uint16_t 	offset = msg_id - (uint16_t)(hmsg->last_ack + 1);
+
+	if (offset > hmsg->ring_mask) {
+		/* old, or too far ahead */
+		return 0;
+	}
+	return !MSG_RECEIVED(hmsg, msg_id);
+}
+
+/* Records that `msg_id` was received, for it to be acknowledged (see `msg_is_new`) */
+static inline void
+msg_mark_received(struct msg_handle *hmsg, const uint16_t msg_id)
+{
+	uint16_t 	id;
+
+	hmsg->recv_bits[(msg_id & hmsg->ring_mask) >> 5] |= 1U << (msg_id & 31);
+	/* then the ones received ahead of it. Their bits are cleared for the ids that take their slot later */
+	for (id = hmsg->last_ack + 1; MSG_RECEIVED(hmsg, id); id++) {
+		hmsg->recv_bits[(id & hmsg->ring_mask) >> 5] &= ~(1U << (id & 31));
+		hmsg->last_ack = id;
+	}
+}
+
+/* Copies the `len` bytes of the ordered message `msg_id` at `buff` to the reorder buffer, until the ones before it in its channel arrive.
+ * Returns 0 if there is no message to hold it, so it is not acknowledged and will be retransmitted. */
+static inline int
+msg_reorder_store(struct msg_handle *hmsg, const uint16_t msg_id, const uint8_t channel, const uint16_t seq, const uint32_t submsgcount, const uint8_t *buff, const uint32_t len)
+{
+	struct message 	*msg;
+	struct message 	**slot = &hmsg->reorder[msg_id & hmsg->ring_mask];
+
+	if (*slot != NULL) {
+		return 0;
+	}
+	if (hmsg->slab != NULL && len > hmsg->slab->message_len) {
+		return 0;
+	}
+	if ( (msg = msg_acquire(hmsg)) == NULL ) {
+		return 0;
+	}
+	if (packet_w(msg->packet, buff, len) != 0) {
+		msg_release(hmsg, msg);
+		return 0;
+	}
+	msg->id = msg_id;
+	msg->channel = channel;
+	msg->seq = seq;
+	msg->submsg_count = submsgcount;
+	*slot = msg;
+	hmsg->reorder_count++;
+	return 1;
+}
+
+/* Delivers the messages held in the reorder buffer that are next in order in `channel` */
+static inline void
+msg_reorder_drain(struct msg_handle *hmsg, const uint8_t channel, netconn_t *conn, void *userdata, struct srvevents *srvevents, struct clievents *clievents, netsrvclient_t *client)
+{
+	struct msg_channel 	*ch = &hmsg->channels[channel];
+	struct message 		*msg;
+	uint32_t 			i, left;
+	uint8_t 			delivered = 1;
+
+	/* sequences mostly follow ids, so a pass usually takes all of them. Another one is needed if one was in a slot already passed */
+	while (delivered && hmsg->reorder_count > 0) {
+		delivered = 0;
+		left = hmsg->reorder_count;
+		for (i = 0; i <= hmsg->ring_mask && left > 0; i++) {
+			if ( (msg = hmsg->reorder[i]) == NULL ) {
+				continue;
+			}
+			left--;
+			if (MSG_CHANNEL(msg->channel) != channel || msg->seq != ch->recv_seq) {
+				continue;
+			}
+			hmsg->reorder[i] = NULL;
+			hmsg->reorder_count--;
+			packet_rewind(msg->packet);
+			msg_deliver(msg->packet, msg->submsg_count, channel, hmsg, conn, userdata, srvevents, clievents, client);
+			/* before its buffer is reused */
+			msg_flush_received(hmsg, conn, userdata, srvevents, clievents, client);
+			msg_release(hmsg, msg);
+			ch->recv_seq++;
+			delivered = 1;
+		}
+	}
+}
+
+/* Writes the acknowledgment: the last message received in order, and which of the `MSG_SACK_BITS` following ones were received. 
+ * Bit i is set if `last_ack + 2 + i` was */
+static inline void
+msg_write_ack(packet_t *p_out, struct msg_handle *hmsg)
+{
+	uint32_t 	sack = 0, i;
+
+	for (i = 0; i < MSG_SACK_BITS && i < hmsg->ring_mask; i++) {
+		if (MSG_RECEIVED(hmsg, (uint16_t)(hmsg->last_ack + 2 + i))) {
+			sack |= 1U << i;
+		}
+	}
+	packet_w_16_t(p_out, &hmsg->last_ack);
+	packet_w_32_t(p_out, &sack);
+}
+
+/* Moves messages from the queue to the ones being sent, while the window has room */
+static inline void
+msg_fill_window(struct msg_handle *hmsg)
+{
+	struct message 	*msg;
+
+	for (msg = hmsg->queue; msg != NULL && hmsg->send_count < hmsg->window; msg = hmsg->queue) {
 		LL_REMOVE(hmsg->queue, msg);
-		LL_ADDTOEND(hmsg->send, msg);
+		msg_insert(&hmsg->send, msg);
 		hmsg->queue_count--;
 		hmsg->send_count++;
-		msg = hmsg->queue;
 	}
+}
+
+/* Takes the acknowledged `msg` out of the ring and the messages being sent, 
+ * and reports it with `onmessageack` once the last of its fragments is acknowledged */
+static inline void
+msg_on_ack(struct msg_handle *hmsg, struct message *msg, netconn_t *conn, void *userdata, struct srvevents *srvevents, struct clievents *clievents, netsrvclient_t *client)
+{
+	const uint32_t 	iid = msg->iid;
+	uint8_t 		report;
+
+	hmsg->ring[msg->id & hmsg->ring_mask] = NULL;
+	if (msg->tx_count == 1) {
+		/* not ambiguous (Karn's algorithm) */
+		msg_rtt_sample(hmsg, hmsg->tick - msg->sent_tick);
+	}
+	/* the message is acknowledged with the last of its fragments. 
+	 * Not reported either if it was reported as expired already */
+	report = !msg->expired && (msg->frag_next == NULL || msg->frag_next == msg);
+	/* back to the pool. It may be freed, so it is not used after this */
+	LL_REMOVE(hmsg->send, msg);
+	hmsg->queued_bytes -= msg_get_len(msg);
+	msg_release(hmsg, msg);
+	hmsg->send_count--;
+	if (!report) {
+		return;
+	}
+	if (srvevents != NULL ? srvevents->onmessageacks != NULL : clievents != NULL && clievents->onmessageacks != NULL) {
+		hmsg->ack_batch[hmsg->ack_batch_count++] = iid;
+		if (hmsg->ack_batch_count == MSG_BATCH_LEN) {
+			msg_flush_acks(hmsg, conn, userdata, srvevents, clievents, client);
+		}
+	} else if (srvevents != NULL) {
+		if (srvevents->onmessageack != NULL)
+			srvevents->onmessageack(conn, userdata, iid, client);
+	} else if (clievents != NULL) {
+		if (clievents->onmessageack != NULL)
+			clievents->onmessageack(conn, userdata, iid);
+	}
+}
+
+/* See `msg_onreceive_process` */
+static inline uint8_t
+msg_onreceive_read(packet_t *p_in, struct msg_handle *hmsg, netconn_t *conn, void *userdata, struct srvevents *srvevents, struct clievents *clievents, netsrvclient_t *client)
+{
+	struct message 	*msg;
+	struct msg_channel 	*ch;
+	uint8_t 		hasmsg = 0, msgonly = 0, channel = 0;
+	uint16_t 		msg_ack = 0, msg_id = 0, seq = 0, base, in_flight;
+	uint32_t 		submsgcount, j, sack = 0, start, sacked_tick = 0, msg_count = 0;
+	uint8_t 		has_sacked = 0;
+
+	packet_r_bits(p_in, &hasmsg, 1);
+	if (hasmsg == 0) {
+		return 0;
+	}
+	packet_r_bits(p_in, &msgonly, 1);
+	/* Handle message acknowledgment */
+	packet_r_16_t(p_in, &msg_ack);
+	packet_r_32_t(p_in, &sack);
+	/* cumulative, then selective. Ids past `last_id` were never sent */
+	base = hmsg->send_base;
+	in_flight = (uint16_t)(hmsg->last_id + 1 - base);
+	for (msg_id = base; (uint16_t)(msg_id - base) < in_flight && (int16_t)(msg_ack - msg_id) >= 0; msg_id++) {
+		if ( (msg = hmsg->ring[msg_id & hmsg->ring_mask]) != NULL ) {
+			msg_on_ack(hmsg, msg, conn, userdata, srvevents, clievents, client);
+		}
+	}
+	for (j = 0; j < MSG_SACK_BITS; j++) {
+		msg_id = msg_ack + 2 + j;
+		if ((sack & (1U << j)) == 0 || (uint16_t)(msg_id - base) >= in_flight) {
+			continue;
+		}
+		if ( (msg = hmsg->ring[msg_id & hmsg->ring_mask]) == NULL ) {
+			continue;
+		}
+		/* messages sent before it and still missing were likely lost */
+		if (!has_sacked || msg->sent_tick > sacked_tick) {
+			sacked_tick = msg->sent_tick;
+		}
+		has_sacked = 1;
+		msg_on_ack(hmsg, msg, conn, userdata, srvevents, clievents, client);
+	}
+	while (hmsg->send_base != (uint16_t)(hmsg->last_id + 1) && hmsg->ring[hmsg->send_base & hmsg->ring_mask] == NULL) {
+		hmsg->send_base++;
+	}
+	if (has_sacked) {
+		/* retransmit the holes without waiting for their timeout */
+		for (msg_id = hmsg->send_base; msg_id != (uint16_t)(hmsg->last_id + 1); msg_id++) {
+			msg = hmsg->ring[msg_id & hmsg->ring_mask];
+			if (msg != NULL && msg->tx_count > 0 && msg->sent_tick < sacked_tick) {
+				msg->lost = 1;
+			}
+		}
+	}
+	msg_flush_acks(hmsg, conn, userdata, srvevents, clievents, client);
+	msg_fill_window(hmsg);
 	/* Handle incoming messages */
-	packet_r_8_t(p_in, &hmsg->recv_count);
-	for (i = 0; i < hmsg->recv_count; i++) {
-		packet_r_8_t(p_in, &msg_id);
-		packet_r_vlen29(p_in, &submsgcount);
-		if (msg_id == (uint8_t)(hmsg->last_ack + 1)) {
-			for (j = 0; j < submsgcount; j++) {
-				packet_r_vlen29(p_in, &msglen);
-				packet_rewind(hmsg->msg_read_pkt);
-				packet_set_buff(hmsg->msg_read_pkt, ((uint8_t *)packet_get_buff(p_in)) + packet_get_index(p_in), msglen);
-				packet_set_length(hmsg->msg_read_pkt, msglen);
-				packet_skip(p_in, msglen);
-				if (srvevents != NULL) {
-					if (srvevents->onreceivemsg != NULL)
-						srvevents->onreceivemsg(conn, userdata, hmsg->msg_read_pkt, client);
-				} else if (clievents != NULL) {
-					if (clievents->onreceivemsg != NULL)
-						clievents->onreceivemsg(conn, userdata, hmsg->msg_read_pkt);
-				}
+	packet_r_vlen29(p_in, &msg_count);
+	if (msg_count > 0) {
+		/* acknowledge in the next send, even if a later datagram of this tick carries no message */
+		hmsg->recv_count = 1;
+	}
+	for (j = 0; j < msg_count; j++) {
+		if (packet_r_8_t(p_in, &channel) != 0 || packet_r_16_t(p_in, &msg_id) != 0) {
+			return msgonly;
+		}
+		if (MSG_CHANNEL_MODE(channel) == ECHANNEL_RELIABLE_ORDERED && packet_r_16_t(p_in, &seq) != 0) {
+			return msgonly;
+		}
+		if (packet_r_vlen29(p_in, &submsgcount) != 0) {
+			return msgonly;
+		}
+		ch = &hmsg->channels[MSG_CHANNEL(channel)];
+		/* a message running past the end of the datagram drops the rest of it */
+		if (!msg_is_new(hmsg, msg_id)) {
+			/* a retransmission of one received already */
+			if (msg_skip(p_in, submsgcount) != 0) {
+				return 1;
+			}
+		} else if (MSG_CHANNEL_MODE(channel) != ECHANNEL_RELIABLE_ORDERED) {
+			msg_mark_received(hmsg, msg_id);
+			if (msg_deliver(p_in, submsgcount, MSG_CHANNEL(channel), hmsg, conn, userdata, srvevents, clievents, client) != 0) {
+				return 1;
+			}
+		} else if (seq == ch->recv_seq) {
+			msg_mark_received(hmsg, msg_id);
+			if (msg_deliver(p_in, submsgcount, MSG_CHANNEL(channel), hmsg, conn, userdata, srvevents, clievents, client) != 0) {
+				return 1;
 			}
-			hmsg->last_ack++;
+			ch->recv_seq++;
+			/* then the ones of the channel that arrived early */
+			msg_reorder_drain(hmsg, MSG_CHANNEL(channel), conn, userdata, srvevents, clievents, client);
 		} else {
-			/* skip */
-			for (j = 0; j < submsgcount; j++) {
-				packet_r_vlen29(p_in, &msglen);
-				packet_skip(p_in, msglen);
+			/* skip, keeping it until the ones before it in the channel arrive */
+			start = packet_get_index(p_in);
+			if (msg_skip(p_in, submsgcount) != 0) {
+				return 1;
 			}
+			if (msg_reorder_store(hmsg, msg_id, channel, seq, submsgcount, (uint8_t *)packet_get_buff(p_in) + start, packet_get_index(p_in) - start)) {
+				msg_mark_received(hmsg, msg_id);
+			}
+		}
+	}
+	if (msgonly || packet_r_vlen29(p_in, &msg_count) != 0) {
+		return msgonly;
+	}
+	/* unreliable messages, delivered unless a newer one of their channel was */
+	for (j = 0; j < msg_count; j++) {
+		if (packet_r_8_t(p_in, &channel) != 0 || packet_r_16_t(p_in, &seq) != 0 || packet_r_vlen29(p_in, &submsgcount) != 0) {
+			break;
+		}
+		ch = &hmsg->channels[MSG_CHANNEL(channel)];
+		if ((int16_t)(seq - ch->recv_seq) < 0) {
+			if (msg_skip(p_in, submsgcount) != 0) {
+				return 1;
+			}
+			continue;
+		}
+		ch->recv_seq = seq + 1;
+		if (msg_deliver(p_in, submsgcount, MSG_CHANNEL(channel), hmsg, conn, userdata, srvevents, clievents, client) != 0) {
+			return 1;
+		}
+	}
+	return msgonly;
+}
+
+/* Reads the acknowledgment and the messages of `p_in`, and delivers the messages. 
+ * The batch events, if set, are called once the datagram is read, or when their batch is full.
+ * Returns 1 if `p_in` is a message only datagram (see `msg_onsend_continuation`), which carries nothing else for the application, 
+ * or if a message runs past its end, so it is not handed to the application either. */
+static inline uint8_t
+msg_onreceive_process(packet_t *p_in, struct msg_handle *hmsg, netconn_t *conn, void *userdata, struct srvevents *srvevents, struct clievents *clievents, netsrvclient_t *client)
+{
+	const uint8_t 	msgonly = msg_onreceive_read(p_in, hmsg, conn, userdata, srvevents, clievents, client);
+
+	msg_flush_received(hmsg, conn, userdata, srvevents, clievents, client);
+	return msgonly;
+}
+
+/* Writes the unreliable messages that fit in `max_len` bytes of `p_out` (or its fixed buffer if 0), 
+ * and releases all of them, as they are sent once */
+static inline void
+msg_onsend_unreliable(packet_t *p_out, struct msg_handle *hmsg, uint32_t max_len)
+{
+	struct message 	*msg, *msg2;
+	uint32_t 		len, total = 0, count = 0;
+
+	/* packet_w needs a spare byte to write up to the end of the buffer */
+	if (max_len == 0 || max_len >= packet_get_buffsize(p_out)) {
+		max_len = packet_get_buffsize(p_out) - 1;
+	}
+	for (msg = hmsg->unreliable; msg != NULL; msg = msg->next) {
+		total++;
+	}
+	len = packet_get_length(p_out) + vlen29_size(total);
+	for (msg = hmsg->unreliable; msg != NULL && len + msg_get_wire_len(msg) <= max_len; msg = msg->next) {
+		len += msg_get_wire_len(msg);
+		count++;
+	}
+	packet_w_vlen29(p_out, count);
+	for (msg = hmsg->unreliable; msg != NULL; msg = msg2) {
+		msg2 = msg->next;
+		if (count > 0) {
+			msg_write(p_out, msg);
+			count--;
 		}
+		LL_REMOVE(hmsg->unreliable, msg);
+		msg_release(hmsg, msg);
 	}
 }
 
+/* Gives ids to the messages not sent yet, in the order they are sent in, while the ring has room for them. 
+ * Those left wait for the oldest message in flight to be acknowledged */
+static inline void
+msg_assign_ids(struct msg_handle *hmsg)
+{
+	struct message 	*msg;
+
+	for (msg = hmsg->send; msg != NULL; msg = msg->next) {
+		if (msg->has_id) {
+			continue;
+		}
+		if ((uint16_t)(hmsg->last_id + 1 - hmsg->send_base) > hmsg->ring_mask) {
+			break;
+		}
+		hmsg->last_id++;
+		msg->id = hmsg->last_id;
+		msg->has_id = 1;
+		hmsg->ring[msg->id & hmsg->ring_mask] = msg;
+	}
+}
+
+/* Writes the acknowledgment, the messages due (see `msg_is_due`) and the unreliable messages to `p_out`. Called once per tick.
+ * If `max_len` is not 0 and the messages due would make `p_out` longer than `max_len` bytes, they are not written and `MSG_SEND_DEFERRED` is returned. 
+ * Otherwise the messages that do not fit in the fixed buffer of `p_out` are left for the next ticks.
+ * Unreliable messages that do not fit are dropped.
+ * Returns 0 if there was nothing to write. */
 static inline uint8_t
-msg_onsend_process(packet_t *p_out, struct msg_handle *hmsg)
+msg_onsend_process(packet_t *p_out, struct msg_handle *hmsg, const uint32_t max_len)
 {
 	struct message 	*msg;
+	uint32_t 		len, due = 0, count = 0;
+	int 			i;
 
-	hmsg->current = NULL;
-	if (hmsg->send_count == 0 && hmsg->recv_count == 0) {
+	for (i = 0; i < NET_MAX_CHANNELS; i++) {
+		hmsg->channels[i].current = NULL;
+	}
+	hmsg->tick++;
+	msg_assign_ids(hmsg);
+	for (msg = hmsg->send; msg != NULL; msg = msg->next) {
+		due += msg_is_due(hmsg, msg);
+	}
+	if (due == 0 && hmsg->recv_count == 0 && hmsg->unreliable == NULL) {
 		/* nothing to send/acknowledge */
 		packet_w_bits(p_out, 0, 1);
 		return 0;
 	}
 	packet_w_bits(p_out, 1, 1);
+	/* not a message only datagram */
+	packet_w_bits(p_out, 0, 1);
 
 	/* send acknowledgment */
-	packet_w_8_t(p_out, &hmsg->last_ack);
+	msg_write_ack(p_out, hmsg);
+	hmsg->recv_count = 0;
 
-	/* send messages */
-	packet_w_8_t(p_out, &hmsg->send_count);
-	for (msg = hmsg->send; msg != NULL; msg = msg->next) {
-		packet_w_8_t(p_out, &msg->id);
-		packet_w_vlen29(p_out, msg->submsg_count);
-		packet_w(p_out, packet_get_buff(msg->packet), packet_get_length(msg->packet));
+	if (max_len != 0 && due > 0) {
+		len = packet_get_length(p_out) + vlen29_size(due);
+		for (msg = hmsg->send; msg != NULL && len <= max_len; msg = msg->next) {
+			if (msg_is_due(hmsg, msg)) {
+				len += msg_get_wire_len(msg);
+			}
+		}
+		if (len > max_len) {
+			/* leave the messages to message only datagrams */
+			packet_w_vlen29(p_out, 0);
+			msg_onsend_unreliable(p_out, hmsg, max_len);
+			return MSG_SEND_DEFERRED;
+		}
 	}
 
-	hmsg->recv_count = 0;
+	/* send messages. packet_w needs a spare byte to write up to the end of the buffer */
+	len = packet_get_length(p_out) + vlen29_size(due) + 1;
+	for (msg = hmsg->send; msg != NULL && count < due; msg = msg->next) {
+		if (msg_is_due(hmsg, msg)) {
+			if (len + msg_get_wire_len(msg) > packet_get_buffsize(p_out)) {
+				break;
+			}
+			len += msg_get_wire_len(msg);
+			count++;
+		}
+	}
+	packet_w_vlen29(p_out, count);
+	for (msg = hmsg->send; count > 0; msg = msg->next) {
+		if (!msg_is_due(hmsg, msg)) {
+			continue;
+		}
+		count--;
+		msg_mark_sent(hmsg, msg);
+		msg_write(p_out, msg);
+	}
+	msg_onsend_unreliable(p_out, hmsg, max_len);
+
 	return 1;
 }
 
+/* Writes a message only block with the messages due starting at `*cursor` that fit in `max_len` bytes of `p_out`, 
+ * up to `MSG_CONTINUATION_MAX`. At least one message is written, even if it does not fit.
+ * `*cursor` is advanced past the written messages, `NULL` when all of them were written.
+ * Returns the amount of messages written. */
+static inline uint8_t
+msg_onsend_continuation(packet_t *p_out, struct msg_handle *hmsg, struct message **cursor, const uint32_t max_len)
+{
+	struct message 	*msg;
+	uint8_t 		count = 0;
+	uint32_t 		count_index;
+
+	packet_w_bits(p_out, 1, 1);
+	packet_w_bits(p_out, 1, 1);
+	msg_write_ack(p_out, hmsg);
+	/* patched once the amount of messages that fit is known */
+	count_index = packet_get_index(p_out);
+	packet_w_8_t(p_out, &count);
+	for (msg = *cursor; msg != NULL && count < MSG_CONTINUATION_MAX; msg = msg->next) {
+		if (!msg_is_due(hmsg, msg)) {
+			continue;
+		}
+		if (count > 0 && packet_get_length(p_out) + msg_get_wire_len(msg) > max_len) {
+			break;
+		}
+		msg_mark_sent(hmsg, msg);
+		msg_write(p_out, msg);
+		count++;
+	}
+	((uint8_t *)packet_get_buff(p_out))[count_index] = count;
+	*cursor = msg;
+	return count;
+}
+
+/* Gives `msg` the next sequence of `channel`, and adds it to the messages being sent, or to the queue if the window is full.
+ * It expires after `ttl` ticks if not 0. Unreliable messages are sent once with the next packet. */
+static inline void
+msg_enqueue(struct msg_handle *hmsg, struct message *msg, const uint8_t channel, const uint32_t iid, const int submsg_count, const uint8_t priority, const uint16_t ttl)
+{
+	struct msg_channel 	*ch = &hmsg->channels[channel];
+
+	msg->channel = MSG_CHANNEL_BYTE(channel, ch->mode);
+	msg->seq = ch->mode != ECHANNEL_RELIABLE_UNORDERED ? ch->send_seq++ : 0;
+	msg->iid = iid;
+	msg->submsg_count = submsg_count;
+	msg->has_id = 0;
+	msg->tx_count = 0;
+	msg->lost = 0;
+	msg->priority = priority;
+	msg->expires = ttl != 0;
+	msg->expired = 0;
+	msg->expire_tick = hmsg->tick + ttl;
+	msg->next = msg->prev = NULL;
+	if (ch->mode == ECHANNEL_UNRELIABLE_SEQUENCED) {
+		msg_insert(&hmsg->unreliable, msg);
+		return;
+	}
+	if (hmsg->send_count >= hmsg->window) {
+		msg_insert(&hmsg->queue, msg);
+		hmsg->queue_count++;
+	} else {
+		msg_insert(&hmsg->send, msg);
+		hmsg->send_count++;
+	}
+}
+
+/* Empties `msg`, leaving an empty fragment (see `msg_reassemble`) to be acknowledged, as the receiver may expect its id and sequence */
+static inline void
+msg_make_empty(struct msg_handle *hmsg, struct message *msg, const uint8_t expired)
+{
+	hmsg->queued_bytes -= msg_get_len(msg);
+	if (msg->shared != NULL) {
+		msg_shared_release(msg->shared);
+		msg->shared = NULL;
+	}
+	msg->expires = 0;
+	msg->expired = expired;
+	msg->submsg_count = 0;
+	packet_rewind(msg->packet);
+	packet_set_length(msg->packet, 0);
+	packet_w_vlen29(msg->packet, 0);
+	packet_w_vlen29(msg->packet, 0);
+	packet_w_vlen29(msg->packet, 0);
+	hmsg->queued_bytes += packet_get_length(msg->packet);
+}
+
+/* Drops the message returned by `message_reserve` if it was not committed */
+static inline void
+message_abort(struct msg_handle *hmsg)
+{
+	if (hmsg->reserved != NULL) {
+		msg_release(hmsg, hmsg->reserved);
+		hmsg->reserved = NULL;
+	}
+}
+
+/* Drops the messages of `*head` whose time to live is over, and reports them and the ones dropped by `msg_drop_oldest` 
+ * with `onmessageexpire`, once for each message id (`*last_iid`, -1 if none yet). 
+ * Returns the amount of messages removed from the list. */
 static inline uint32_t
-message_send(struct msg_handle *hmsg, const void *buffer, const uint32_t size)
+msg_expire_list(struct message **head, struct msg_handle *hmsg, int64_t *last_iid, netconn_t *conn, void *userdata, struct srvevents *srvevents, struct clievents *clievents, netsrvclient_t *client)
 {
-	if (hmsg->current == NULL) {
-		if (hmsg->pool == NULL) {
-			hmsg->current = malloc(sizeof(struct message));
-			hmsg->current->packet = packet_init();
-			if (hmsg->current->packet == NULL) {
-				return 1;
+	struct message 	*msg, *msg2, *list = *head;
+	uint32_t 		removed = 0;
+
+	for (msg = list; msg != NULL; msg = msg2) {
+		msg2 = msg->next;
+		if (msg->expired != MSG_DROPPED && (!msg->expires || (int32_t)(hmsg->tick + 1 - msg->expire_tick) <= 0)) {
+			continue;
+		}
+		if (msg->iid != *last_iid) {
+			/* fragments are contiguous and share the id */
+			if (srvevents != NULL) {
+				if (srvevents->onmessageexpire != NULL)
+					srvevents->onmessageexpire(conn, userdata, msg->iid, client);
+			} else if (clievents != NULL) {
+				if (clievents->onmessageexpire != NULL)
+					clievents->onmessageexpire(conn, userdata, msg->iid);
 			}
+		}
+		*last_iid = msg->iid;
+		if (msg->expired == MSG_DROPPED) {
+			msg->expired = MSG_EXPIRED;
+		} else if (!msg->has_id && MSG_CHANNEL_MODE(msg->channel) == ECHANNEL_RELIABLE_UNORDERED) {
+			/* never sent and not in the ring, the receiver does not know about it */
+			LL_REMOVE(list, msg);
+			hmsg->queued_bytes -= msg_get_len(msg);
+			msg_release(hmsg, msg);
+			removed++;
 		} else {
-			hmsg->current = hmsg->pool;
-			LL_REMOVE(hmsg->pool, hmsg->pool);
-			packet_rewind(hmsg->current->packet);
+			msg_make_empty(hmsg, msg, MSG_EXPIRED);
 		}
-		hmsg->last_id++;
-		hmsg->last_iid++;
-		hmsg->current->id = hmsg->last_id;
-		hmsg->current->iid = hmsg->last_iid;
-		hmsg->current->submsg_count = 0;
-		hmsg->current->next = hmsg->current->prev = NULL;
-		if (hmsg->send_count == SENDCOUNTMAX) {
-			LL_ADDTOEND(hmsg->queue, hmsg->current);
-			hmsg->queue_count++;
+	}
+	*head = list;
+	return removed;
+}
+
+/* Drops the messages whose time to live is over. Called once per tick, before `msg_onsend_process` */
+static inline void
+msg_expire(struct msg_handle *hmsg, netconn_t *conn, void *userdata, struct srvevents *srvevents, struct clievents *clievents, netsrvclient_t *client)
+{
+	int64_t 	last_iid = -1;
+	int 		i;
+
+	message_abort(hmsg);
+	/* the messages being filled may expire */
+	for (i = 0; i < NET_MAX_CHANNELS; i++) {
+		hmsg->channels[i].current = NULL;
+	}
+	hmsg->send_count -= msg_expire_list(&hmsg->send, hmsg, &last_iid, conn, userdata, srvevents, clievents, client);
+	hmsg->queue_count -= msg_expire_list(&hmsg->queue, hmsg, &last_iid, conn, userdata, srvevents, clievents, client);
+	msg_fill_window(hmsg);
+}
+
+/* Drops the oldest messages waiting to be sent or acknowledged, until `len` more bytes fit in `max_queued_bytes` (`EQUEUE_DROP_OLDEST`).
+ * They are emptied right away, and reported as expired in the next tick.
+ * Returns 0 if there is not enough to drop. */
+static inline int
+msg_drop_oldest(struct msg_handle *hmsg, const uint32_t len)
+{
+	struct message 	*msg, *oldest;
+	int 			i;
+
+	while (hmsg->queued_bytes + len > hmsg->max_queued_bytes) {
+		oldest = NULL;
+		for (msg = hmsg->send; msg != NULL; msg = msg->next) {
+			if (!msg->expired && (oldest == NULL || (int32_t)(msg->iid - oldest->iid) < 0)) {
+				oldest = msg;
+			}
+		}
+		for (msg = hmsg->queue; msg != NULL; msg = msg->next) {
+			if (!msg->expired && (oldest == NULL || (int32_t)(msg->iid - oldest->iid) < 0)) {
+				oldest = msg;
+			}
+		}
+		if (oldest == NULL) {
+			return 0;
+		}
+		/* every fragment of it */
+		for (msg = oldest->frag_next; msg != NULL && msg != oldest; msg = msg->frag_next) {
+			msg_make_empty(hmsg, msg, MSG_DROPPED);
+		}
+		msg_make_empty(hmsg, oldest, MSG_DROPPED);
+	}
+	/* the messages being filled may have been dropped */
+	for (i = 0; i < NET_MAX_CHANNELS; i++) {
+		hmsg->channels[i].current = NULL;
+	}
+	return 1;
+}
+
+/* Returns 1 if a message of `len` bytes in `ch` fits in `max_queued_bytes`, after making room for it if `queue_policy` tells so.
+ * Otherwise sets `queue_full` */
+static inline int
+msg_queue_has_room(struct msg_handle *hmsg, const struct msg_channel *ch, const uint32_t len)
+{
+	if (ch->mode != ECHANNEL_UNRELIABLE_SEQUENCED && hmsg->max_queued_bytes != 0 && hmsg->queued_bytes + len > hmsg->max_queued_bytes 
+		&& (hmsg->queue_policy != EQUEUE_DROP_OLDEST || len > hmsg->max_queued_bytes || !msg_drop_oldest(hmsg, len))) {
+		hmsg->queue_full = 1;
+		return 0;
+	}
+	return 1;
+}
+
+/* Splits a message bigger than `message_cap` in fragments, each one sent as a message of its own in `channel`, which must be ordered.
+ * Returns the id of the message, or 0 if it could not be queued. */
+static inline uint32_t
+message_send_fragmented(struct msg_handle *hmsg, const uint8_t channel, const uint8_t priority, const uint16_t ttl, const uint8_t *buffer, const uint32_t size)
+{
+	struct message 	*msg, *msg2, *frags = NULL, *first = NULL;
+	const uint32_t 	frag_len = hmsg->message_cap - MSG_FRAGMENT_HEADER_LEN;
+	const uint32_t 	count = (size + frag_len - 1) / frag_len;
+	uint32_t 		i, len;
+
+	if (size > hmsg->max_fragmented_len) {
+		return 0;
+	}
+	/* every fragment is taken first, so the message is queued whole or not at all */
+	for (i = 0; i < count; i++) {
+		if ( (msg = msg_acquire(hmsg)) == NULL ) {
+			for (msg = frags; msg != NULL; msg = msg2) {
+				msg2 = msg->next;
+				msg_release(hmsg, msg);
+			}
+			return 0;
+		}
+		LL_ADDTOEND(frags, msg);
+	}
+	hmsg->channels[channel].current = NULL;
+	hmsg->last_iid++;
+	for (i = 0; i < count; i++) {
+		msg = frags;
+		LL_REMOVE(frags, msg);
+		len = size - i * frag_len < frag_len ? size - i * frag_len : frag_len;
+		packet_w_vlen29(msg->packet, i);
+		packet_w_vlen29(msg->packet, count);
+		packet_w_vlen29(msg->packet, len);
+		packet_w(msg->packet, buffer + i * frag_len, len);
+		hmsg->queued_bytes += packet_get_length(msg->packet);
+		msg_enqueue(hmsg, msg, channel, hmsg->last_iid, 0, priority, ttl);
+		/* linked with the fragments before it */
+		if (first == NULL) {
+			first = msg->frag_next = msg->frag_prev = msg;
 		} else {
-			LL_ADDTOEND(hmsg->send, hmsg->current);
-			hmsg->send_count++;
+			msg->frag_next = first;
+			msg->frag_prev = first->frag_prev;
+			first->frag_prev->frag_next = msg;
+			first->frag_prev = msg;
+		}
+	}
+	return hmsg->last_iid;
+}
+
+/* Messages sent to the same channel during the same tick, with the same priority and time to live, are merged in a single message, 
+ * while it holds less than `message_cap` bytes. Bigger messages are sent in fragments if the channel is ordered, and fail otherwise.
+ * Reliable messages that would take more than `max_queued_bytes` fail, or make room for themselves (see `queue_policy`).
+ * Returns the id of the message, or 0 if it could not be queued. */
+static inline uint32_t
+message_send(struct msg_handle *hmsg, const uint8_t channel, const uint8_t priority, const uint16_t ttl, const void *buffer, const uint32_t size)
+{
+	struct msg_channel 	*ch;
+	const uint32_t 		len = vlen29_size(size) + size;
+
+	hmsg->queue_full = 0;
+	message_abort(hmsg);
+	if (channel >= NET_MAX_CHANNELS) {
+		return 0;
+	}
+	ch = &hmsg->channels[channel];
+	if (!msg_queue_has_room(hmsg, ch, len)) {
+		return 0;
+	}
+	if (vlen29_size(size) + size > hmsg->message_cap) {
+		if (ch->mode != ECHANNEL_RELIABLE_ORDERED) {
+			return 0;
+		}
+		return message_send_fragmented(hmsg, channel, priority, ttl, buffer, size);
+	}
+	if (ch->current != NULL && (packet_get_length(ch->current->packet) + vlen29_size(size) + size > hmsg->message_cap 
+		|| ch->current->priority != priority || ch->current->expires != (ttl != 0) || ch->current->expire_tick != hmsg->tick + ttl)) {
+		/* full or different, start another one */
+		ch->current = NULL;
+	}
+	if (ch->current == NULL) {
+		if ( (ch->current = msg_acquire(hmsg)) == NULL ) {
+			return 0;
+		}
+		hmsg->last_iid++;
+		msg_enqueue(hmsg, ch->current, channel, hmsg->last_iid, 0, priority, ttl);
+	}
+
+	packet_w_vlen29(ch->current->packet, size);
+	packet_w(ch->current->packet, buffer, size);
+	ch->current->submsg_count++;
+	if (ch->mode != ECHANNEL_UNRELIABLE_SEQUENCED) {
+		hmsg->queued_bytes += len;
+	}
+
+	return ch->current->iid;
+}
+/* Returns the packet of a new message of `channel` for the message to be written to, as it will be sent, without a copy. 
+ * It is sent with `message_commit`, and dropped if a message is sent or reserved, or the tick ends before that.
+ * Returns NULL on failure. */
+static inline packet_t *
+message_reserve(struct msg_handle *hmsg, const uint8_t channel, const uint8_t priority, const uint16_t ttl)
+{
+	/* the longest form of `packet_w_vlen29` under 2^21, so the length can be patched in once known */
+	static const uint8_t 	len[MSG_RESERVED_LEN] = { 0x80, 0x80, 0 };
+	struct message 			*msg;
+
+	message_abort(hmsg);
+	if (channel >= NET_MAX_CHANNELS || (msg = msg_acquire(hmsg)) == NULL) {
+		return NULL;
+	}
+	if (packet_w(msg->packet, len, MSG_RESERVED_LEN) != 0) {
+		msg_release(hmsg, msg);
+		return NULL;
+	}
+	hmsg->reserved = msg;
+	hmsg->reserved_channel = channel;
+	hmsg->reserved_priority = priority;
+	hmsg->reserved_ttl = ttl;
+	return msg->packet;
+}
+
+/* Sends the message written to the packet returned by `message_reserve`, as `message_send` would, in a message of its own. 
+ * Messages of the same channel sent during the rest of the tick may be merged in it. 
+ * Messages bigger than `message_cap` are split in fragments, which copies them.
+ * Returns the id of the message, or 0 if it could not be queued. */
+static inline uint32_t
+message_commit(struct msg_handle *hmsg)
+{
+	struct message 		*msg = hmsg->reserved;
+	struct msg_channel 	*ch;
+	uint8_t 			*buff;
+	uint32_t 			size, id = 0;
+
+	hmsg->queue_full = 0;
+	if (msg == NULL) {
+		return 0;
+	}
+	hmsg->reserved = NULL;
+	ch = &hmsg->channels[hmsg->reserved_channel];
+	size = packet_get_length(msg->packet) - MSG_RESERVED_LEN;
+	buff = packet_get_buff(msg->packet);
+	if (!msg_queue_has_room(hmsg, ch, MSG_RESERVED_LEN + size)) {
+		msg_release(hmsg, msg);
+		return 0;
+	}
+	if (MSG_RESERVED_LEN + size > hmsg->message_cap) {
+		if (ch->mode == ECHANNEL_RELIABLE_ORDERED) {
+			id = message_send_fragmented(hmsg, hmsg->reserved_channel, hmsg->reserved_priority, hmsg->reserved_ttl, buff + MSG_RESERVED_LEN, size);
 		}
+		msg_release(hmsg, msg);
+		return id;
+	}
+	buff[0] = (uint8_t)(size >> 14) | 128;
+	buff[1] = (uint8_t)(size >> 7) | 128;
+	buff[2] = size & 127;
+	hmsg->last_iid++;
+	msg_enqueue(hmsg, msg, hmsg->reserved_channel, hmsg->last_iid, 1, hmsg->reserved_priority, hmsg->reserved_ttl);
+	if (ch->mode != ECHANNEL_UNRELIABLE_SEQUENCED) {
+		hmsg->queued_bytes += packet_get_length(msg->packet);
 	}
+	ch->current = msg;
+	return msg->iid;
+}
 
-	packet_w_vlen29(hmsg->current->packet, size);
-	packet_w(hmsg->current->packet, buffer, size);
-	hmsg->current->submsg_count++;
+/* Sends the message held by `shared` as `message_send` would, referencing it instead of copying it, in a message of its own. 
+ * If it is bigger than `message_cap`, it is sent with `message_send` instead.
+ * Returns the id of the message, or 0 if it could not be queued. */
+static inline uint32_t
+message_send_shared(struct msg_handle *hmsg, const uint8_t channel, const uint8_t priority, const uint16_t ttl, struct msg_shared *shared)
+{
+	struct msg_channel 	*ch;
+	struct message 		*msg;
+	const uint32_t 		len = packet_get_length(shared->packet);
+	uint32_t 			size = 0;
 
-	return hmsg->current->iid;
+	if (len > hmsg->message_cap) {
+		packet_rewind(shared->packet);
+		packet_r_vlen29(shared->packet, &size);
+		return message_send(hmsg, channel, priority, ttl, (uint8_t *)packet_get_buff(shared->packet) + vlen29_size(size), size);
+	}
+	hmsg->queue_full = 0;
+	message_abort(hmsg);
+	if (channel >= NET_MAX_CHANNELS) {
+		return 0;
+	}
+	ch = &hmsg->channels[channel];
+	if (!msg_queue_has_room(hmsg, ch, len) || (msg = msg_acquire(hmsg)) == NULL) {
+		return 0;
+	}
+	msg->shared = shared;
+	shared->refcount++;
+	hmsg->last_iid++;
+	msg_enqueue(hmsg, msg, channel, hmsg->last_iid, 1, priority, ttl);
+	if (ch->mode != ECHANNEL_UNRELIABLE_SEQUENCED) {
+		hmsg->queued_bytes += len;
+	}
+	/* nothing can be merged in it */
+	ch->current = NULL;
+	return msg->iid;
 }
 #endif
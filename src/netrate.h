@@ -0,0 +1,64 @@
+/*
+ * Token bucket implementation.
+ * Copyright (C) 2023  Luiz Gustavo Sassanovicz Borsoi
+ *
+ * This file is part of Ufavonet.
+ *
+ * Ufavonet is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published
+ * by the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Ufavonet is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef _netrate_h_
+#define _netrate_h_
+
+#include <stdint.h>
+
+/* Gains `rate` tokens per tick, holding at most `capacity` of them.
+ * Refilled lazily when tokens are taken, so idle buckets cost nothing. */
+struct tokenbucket {
+	uint64_t 	tokens;
+	/* tick of the last refill */
+	uint64_t 	tick;
+};
+
+/* starts full */
+static inline void
+tokenbucket_init(struct tokenbucket *b, const uint64_t now, const uint64_t capacity)
+{
+	b->tokens = capacity;
+	b->tick = now;
+}
+
+/* Returns 1 and takes `cost` tokens if there are enough, 0 otherwise */
+static inline int
+tokenbucket_take(struct tokenbucket *b, const uint64_t now, const uint64_t rate, const uint64_t capacity, const uint64_t cost)
+{
+	uint64_t elapsed;
+
+	if (now > b->tick) {
+		elapsed = now - b->tick;
+		/* past `capacity / rate` ticks the bucket is full anyway, and the product can't overflow */
+		b->tokens = elapsed > capacity / rate ? capacity : b->tokens + elapsed * rate;
+		if (b->tokens > capacity) {
+			b->tokens = capacity;
+		}
+		b->tick = now;
+	}
+	if (b->tokens < cost) {
+		return 0;
+	}
+	b->tokens -= cost;
+	return 1;
+}
+
+#endif
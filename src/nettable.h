@@ -0,0 +1,154 @@
+/*
+ * Client table implementation.
+ * Copyright (C) 2023  Luiz Gustavo Sassanovicz Borsoi
+ *
+ * This file is part of Ufavonet.
+ *
+ * Ufavonet is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published
+ * by the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Ufavonet is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef _nettable_h_
+#define _nettable_h_
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* value of an empty entry, and returned when a key is not found */
+#define CLITABLE_NONE UINT32_MAX
+#define CLITABLE_MIN_CAPACITY 64
+
+struct clitable_entry {
+	uint64_t 	key;
+	uint32_t 	value;
+};
+
+/* Open addressing (linear probing) hash table mapping the address/port key of a client to its slot.
+ * Entries are kept in a single array, so a lookup usually touches a single cache line.
+ * The load factor is kept at or below 1/2, and removals shift the following entries back instead of leaving tombstones. */
+struct clitable {
+	struct clitable_entry 	*entries;
+	uint32_t 				mask, count;
+};
+
+static inline uint32_t
+clitable_hash(const struct clitable *t, const uint64_t key)
+{
+	/* fibonacci hashing, the high bits are the well mixed ones */
+	return (uint32_t)((key * 0x9E3779B97F4A7C15ULL) >> 32) & t->mask;
+}
+
+/* `capacity` must be a power of 2.
+ * Returns -1 if memory allocation fails. */
+static inline int
+clitable_init(struct clitable *t, const uint32_t capacity)
+{
+	uint32_t i;
+	t->entries = malloc(capacity * sizeof(struct clitable_entry));
+	if (t->entries == NULL) {
+		return -1;
+	}
+	for (i = 0; i < capacity; i++) {
+		t->entries[i].value = CLITABLE_NONE;
+	}
+	t->mask = capacity - 1;
+	t->count = 0;
+	return 0;
+}
+
+static inline void
+clitable_free(struct clitable *t)
+{
+	free(t->entries);
+	t->entries = NULL;
+	t->mask = t->count = 0;
+}
+
+static inline uint32_t
+clitable_find(const struct clitable *t, const uint64_t key)
+{
+	uint32_t i = clitable_hash(t, key);
+	while (t->entries[i].value != CLITABLE_NONE) {
+		if (t->entries[i].key == key) {
+			return t->entries[i].value;
+		}
+		i = (i + 1) & t->mask;
+	}
+	return CLITABLE_NONE;
+}
+
+/* `key` must not be in the table yet */
+static inline void
+clitable_put(struct clitable *t, const uint64_t key, const uint32_t value)
+{
+	uint32_t i = clitable_hash(t, key);
+	while (t->entries[i].value != CLITABLE_NONE) {
+		i = (i + 1) & t->mask;
+	}
+	t->entries[i].key = key;
+	t->entries[i].value = value;
+	t->count++;
+}
+
+/* `key` must not be in the table yet.
+ * Returns -1 if memory allocation fails. */
+static inline int
+clitable_insert(struct clitable *t, const uint64_t key, const uint32_t value)
+{
+	struct clitable 	grown;
+	uint32_t 			i;
+
+	if ((t->count + 1) * 2 > t->mask + 1) {
+		/* rehash into twice the capacity */
+		if (clitable_init(&grown, (t->mask + 1) * 2) == -1) {
+			return -1;
+		}
+		for (i = 0; i <= t->mask; i++) {
+			if (t->entries[i].value != CLITABLE_NONE) {
+				clitable_put(&grown, t->entries[i].key, t->entries[i].value);
+			}
+		}
+		free(t->entries);
+		*t = grown;
+	}
+	clitable_put(t, key, value);
+	return 0;
+}
+
+static inline void
+clitable_remove(struct clitable *t, const uint64_t key)
+{
+	uint32_t i = clitable_hash(t, key), j, home;
+
+	while (t->entries[i].key != key || t->entries[i].value == CLITABLE_NONE) {
+		if (t->entries[i].value == CLITABLE_NONE) {
+			/* not found */
+			return;
+		}
+		i = (i + 1) & t->mask;
+	}
+	/* shift back the following entries that would become unreachable */
+	for (j = (i + 1) & t->mask; t->entries[j].value != CLITABLE_NONE; j = (j + 1) & t->mask) {
+		home = clitable_hash(t, t->entries[j].key);
+		/* move if `home` is not cyclically within (i, j] */
+		if (((j - home) & t->mask) >= ((j - i) & t->mask)) {
+			t->entries[i] = t->entries[j];
+			i = j;
+		}
+	}
+	t->entries[i].value = CLITABLE_NONE;
+	t->count--;
+}
+
+#endif
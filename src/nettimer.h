@@ -0,0 +1,154 @@
+/*
+ * Timer wheel implementation.
+ * Copyright (C) 2023  Luiz Gustavo Sassanovicz Borsoi
+ *
+ * This file is part of Ufavonet.
+ *
+ * Ufavonet is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published
+ * by the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Ufavonet is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef _nettimer_h_
+#define _nettimer_h_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#define TIMERWHEEL_BITS 	6
+#define TIMERWHEEL_SLOTS 	(1U << TIMERWHEEL_BITS)
+#define TIMERWHEEL_MASK 	(TIMERWHEEL_SLOTS - 1)
+/* 2^24 ticks ahead at most. Timers further than that are clamped */
+#define TIMERWHEEL_LEVELS 	4
+#define TIMERWHEEL_MAX_DELTA ((1ULL << (TIMERWHEEL_BITS * TIMERWHEEL_LEVELS)) - 1)
+
+/* A timer embedded in the struct it belongs to. */
+struct nettimer {
+	struct nettimer 	*next;
+	/* the pointer pointing to this timer. NULL if not armed */
+	struct nettimer 	**pprev;
+	uint64_t 			expires;
+};
+
+/* Hierarchical timer wheel, with a resolution of one tick.
+ * Level 0 has a slot per tick, each slot of level n spans all the slots of level n - 1.
+ * Timers of the upper levels cascade down as time approaches,
+ * so arming, disarming and expiring a timer are O(1) regardless of how many timers there are. */
+struct timerwheel {
+	struct nettimer 	*slots[TIMERWHEEL_LEVELS][TIMERWHEEL_SLOTS];
+	uint64_t 			now;
+};
+
+/* Returns the struct that contains `timer` as the field `member` */
+#define NETTIMER_ENTRY(timer, type, member) ((type *)((char *)(timer) - offsetof(type, member)))
+
+static inline void
+timerwheel_init(struct timerwheel *w)
+{
+	memset(w->slots, 0, sizeof(w->slots));
+	w->now = 0;
+}
+
+static inline void
+nettimer_disarm(struct nettimer *t)
+{
+	if (t->pprev == NULL) {
+		return;
+	}
+	*t->pprev = t->next;
+	if (t->next != NULL) {
+		t->next->pprev = t->pprev;
+	}
+	t->next = NULL;
+	t->pprev = NULL;
+}
+
+/* links `t` in the slot matching its expiry */
+static inline void
+timerwheel_link(struct timerwheel *w, struct nettimer *t)
+{
+	uint64_t 		delta, expires = t->expires;
+	struct nettimer **slot;
+	int 			level;
+
+	if (expires < w->now) {
+		expires = w->now;
+	}
+	delta = expires - w->now;
+	if (delta > TIMERWHEEL_MAX_DELTA) {
+		/* checked again when it fires */
+		delta = TIMERWHEEL_MAX_DELTA;
+		expires = w->now + delta;
+	}
+	for (level = 0; level < TIMERWHEEL_LEVELS - 1 && delta >= (1ULL << (TIMERWHEEL_BITS * (level + 1))); level++);
+	slot = &w->slots[level][(expires >> (TIMERWHEEL_BITS * level)) & TIMERWHEEL_MASK];
+	t->next = *slot;
+	if (t->next != NULL) {
+		t->next->pprev = &t->next;
+	}
+	t->pprev = slot;
+	*slot = t;
+}
+
+/* (Re)arms `t` to expire at the tick `expires`. If that tick is already past, it expires in the current tick */
+static inline void
+nettimer_arm(struct timerwheel *w, struct nettimer *t, const uint64_t expires)
+{
+	nettimer_disarm(t);
+	t->expires = expires;
+	timerwheel_link(w, t);
+}
+
+/* Moves the timers of a slot of `level` to the lower levels */
+static inline void
+timerwheel_cascade(struct timerwheel *w, const int level)
+{
+	struct nettimer *t, *next;
+	struct nettimer **slot = &w->slots[level][(w->now >> (TIMERWHEEL_BITS * level)) & TIMERWHEEL_MASK];
+
+	t = *slot;
+	*slot = NULL;
+	for (; t != NULL; t = next) {
+		next = t->next;
+		timerwheel_link(w, t);
+	}
+}
+
+/* Moves the wheel to the next tick */
+static inline void
+timerwheel_advance(struct timerwheel *w)
+{
+	int level;
+
+	w->now++;
+	for (level = 1; level < TIMERWHEEL_LEVELS; level++) {
+		if ((w->now & ((1ULL << (TIMERWHEEL_BITS * level)) - 1)) != 0) {
+			break;
+		}
+		timerwheel_cascade(w, level);
+	}
+}
+
+/* Returns a disarmed timer that expires in the current tick, or NULL if there are none left.
+ * Timers armed for the current tick while popping are returned as well. */
+static inline struct nettimer *
+timerwheel_pop_expired(struct timerwheel *w)
+{
+	struct nettimer *t = w->slots[0][w->now & TIMERWHEEL_MASK];
+	if (t != NULL) {
+		nettimer_disarm(t);
+	}
+	return t;
+}
+
+#endif
@@ -0,0 +1,479 @@
+/*
+ * io_uring transport implementation.
+ * Copyright (C) 2023  Luiz Gustavo Sassanovicz Borsoi
+ *
+ * This file is part of Ufavonet.
+ *
+ * Ufavonet is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published
+ * by the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Ufavonet is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef _neturing_h_
+#define _neturing_h_
+
+#include "netio.h"
+
+#if defined(NETIO_HAS_MMSG) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#ifdef IORING_RECV_MULTISHOT
+/* multishot recvmsg with provided buffer rings (linux 6.0) */
+#define NETIO_HAS_URING 1
+#endif
+#endif
+#endif
+
+#ifdef NETIO_HAS_URING
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+/* receive buffers used when the setting is 0 */
+#define URING_DEFAULT_RECV_BUFFERS 256
+/* sends submitted at once when the setting is 0 */
+#define URING_DEFAULT_SEND_BATCH 64
+
+enum uring_udata
+{
+	URING_UDATA_RECV = 0,
+	URING_UDATA_SEND,
+	URING_UDATA_CANCEL,
+};
+
+/* A ring with a single multishot recvmsg always armed on `fd`, writing into provided buffers.
+ * Sends are queued from a `struct sendbatch` and submitted together.
+ * Receiving costs no syscall while the recvmsg stays armed, as completions are read straight from the shared ring. */
+struct uring {
+	int 						ring_fd, fd;
+	/* submission queue */
+	uint32_t 					*sq_head, *sq_tail, *sq_flags, *sq_array;
+	uint32_t 					sq_mask, sq_entries, sq_local_tail, to_submit;
+	struct io_uring_sqe 		*sqes;
+	/* completion queue */
+	uint32_t 					*cq_head, *cq_tail;
+	uint32_t 					cq_mask;
+	struct io_uring_cqe 		*cqes;
+	void 						*sq_ring, *cq_ring;
+	size_t 						sq_ring_len, cq_ring_len, sqes_len;
+	/* buffers the kernel picks from when a datagram arrives */
+	struct io_uring_buf_ring 	*buf_ring;
+	uint8_t 					*buffers;
+	uint32_t 					buf_count, buf_len;
+	uint16_t 					buf_tail;
+	struct msghdr 				recv_msg;
+	uint_fast8_t 				recv_armed;
+	/* receive completions set aside while waiting for sends, handled before the ring ones */
+	struct io_uring_cqe 		*deferred;
+	uint32_t 					deferred_head, deferred_count;
+	uint32_t 					sends_inflight;
+};
+
+/* A datagram received by `uring_recv_next`.
+ * `buff` is owned by the caller until `uring_recycle` is called with `bid`. */
+struct uring_recv {
+	uint8_t 			*buff;
+	uint32_t 			len;
+	uint16_t 			seg_size;
+	uint16_t 			bid;
+	struct sockaddr_in 	*addr;
+};
+
+static inline int
+uring_enter(struct uring *u, const uint32_t to_submit, const uint32_t min_complete, const uint32_t flags)
+{
+	return syscall(__NR_io_uring_enter, u->ring_fd, to_submit, min_complete, flags, NULL, 0);
+}
+
+/* Give the buffer `bid` back to the kernel */
+static inline void
+uring_recycle(struct uring *u, const uint16_t bid)
+{
+	struct io_uring_buf *buf = &u->buf_ring->bufs[u->buf_tail & (u->buf_count - 1)];
+	buf->addr = (uintptr_t)(u->buffers + (size_t)bid * u->buf_len);
+	buf->len = u->buf_len;
+	buf->bid = bid;
+	u->buf_tail++;
+	__atomic_store_n(&u->buf_ring->tail, u->buf_tail, __ATOMIC_RELEASE);
+}
+
+/* Returns a zeroed submission queue entry, or NULL if the queue is full. */
+static inline struct io_uring_sqe *
+uring_get_sqe(struct uring *u)
+{
+	struct io_uring_sqe *sqe;
+	uint32_t 			idx;
+
+	if (u->sq_local_tail - __atomic_load_n(u->sq_head, __ATOMIC_ACQUIRE) >= u->sq_entries) {
+		return NULL;
+	}
+	idx = u->sq_local_tail & u->sq_mask;
+	u->sq_array[idx] = idx;
+	u->sq_local_tail++;
+	u->to_submit++;
+	sqe = &u->sqes[idx];
+	memset(sqe, 0, sizeof(*sqe));
+	return sqe;
+}
+
+/* Submit the queued entries, waiting for `min_complete` completions. */
+static inline int
+uring_submit(struct uring *u, const uint32_t min_complete)
+{
+	int r;
+	__atomic_store_n(u->sq_tail, u->sq_local_tail, __ATOMIC_RELEASE);
+	r = uring_enter(u, u->to_submit, min_complete, min_complete > 0 ? IORING_ENTER_GETEVENTS : 0);
+	if (r >= 0) {
+		u->to_submit -= r;
+	} else if (errno != EINTR) {
+		perror("io_uring_enter()");
+	}
+	return r;
+}
+
+/* Queue the multishot recvmsg. It stays armed until the kernel runs out of buffers or something fails. */
+static inline void
+uring_arm_recv(struct uring *u)
+{
+	struct io_uring_sqe *sqe = uring_get_sqe(u);
+	if (sqe == NULL) {
+		return;
+	}
+	sqe->opcode = IORING_OP_RECVMSG;
+	sqe->fd = u->fd;
+	sqe->addr = (uintptr_t)&u->recv_msg;
+	sqe->len = 1;
+	sqe->ioprio = IORING_RECV_MULTISHOT;
+	sqe->flags = IOSQE_BUFFER_SELECT;
+	sqe->buf_group = 0;
+	sqe->user_data = URING_UDATA_RECV;
+	u->recv_armed = 1;
+}
+
+/* Pop the next completion. Returns 0 if there is none. */
+static inline int
+uring_cqe_next(struct uring *u, struct io_uring_cqe *cqe, const int with_deferred)
+{
+	uint32_t head;
+
+	if (with_deferred && u->deferred_count > 0) {
+		*cqe = u->deferred[u->deferred_head];
+		u->deferred_head = (u->deferred_head + 1) % u->buf_count;
+		u->deferred_count--;
+		return 1;
+	}
+	head = *u->cq_head;
+	if (head == __atomic_load_n(u->cq_tail, __ATOMIC_ACQUIRE)) {
+		return 0;
+	}
+	*cqe = u->cqes[head & u->cq_mask];
+	__atomic_store_n(u->cq_head, head + 1, __ATOMIC_RELEASE);
+	return 1;
+}
+
+/* Cancel the armed recvmsg and wait for it to finish.
+ * Closing the ring releases it asynchronously, which would keep the socket (and its port) alive for a while after being closed. */
+static inline void
+uring_cancel_recv(struct uring *u)
+{
+	struct io_uring_sqe *sqe;
+	struct io_uring_cqe cqe;
+
+	if (!u->recv_armed || (sqe = uring_get_sqe(u)) == NULL) {
+		return;
+	}
+	sqe->opcode = IORING_OP_ASYNC_CANCEL;
+	sqe->addr = URING_UDATA_RECV;
+	sqe->user_data = URING_UDATA_CANCEL;
+	while (u->recv_armed) {
+		if (!uring_cqe_next(u, &cqe, 0)) {
+			if (uring_submit(u, 1) < 0 && errno != EINTR) {
+				return;
+			}
+			continue;
+		}
+		if (cqe.user_data == URING_UDATA_RECV && !(cqe.flags & IORING_CQE_F_MORE)) {
+			u->recv_armed = 0;
+		} else if (cqe.user_data == URING_UDATA_CANCEL && cqe.res < 0 && cqe.res != -EALREADY) {
+			/* nothing to cancel */
+			u->recv_armed = 0;
+		}
+	}
+}
+
+static inline void
+uring_free(struct uring **u)
+{
+	if (u == NULL)
+		return;
+	if (*u == NULL)
+		return;
+
+	struct uring *r = *u;
+	if (r->sqes != NULL && r->sqes != MAP_FAILED) {
+		uring_cancel_recv(r);
+	}
+	if (r->sqes != NULL && r->sqes != MAP_FAILED) {
+		munmap(r->sqes, r->sqes_len);
+	}
+	if (r->cq_ring != NULL && r->cq_ring != MAP_FAILED && r->cq_ring != r->sq_ring) {
+		munmap(r->cq_ring, r->cq_ring_len);
+	}
+	if (r->sq_ring != NULL && r->sq_ring != MAP_FAILED) {
+		munmap(r->sq_ring, r->sq_ring_len);
+	}
+	if (r->ring_fd >= 0) {
+		/* cancels the armed recvmsg */
+		close(r->ring_fd);
+	}
+	free(r->buf_ring);
+	free(r->buffers);
+	free(r->deferred);
+	free(r);
+	*u = NULL;
+}
+
+/* Allocates a ring receiving datagrams of up to `payload_len` bytes from `fd` into `buf_count` buffers (rounded up to a power of 2).
+ * `with_ctrl` reserves room for the UDP_GRO control message. `send_count` is the amount of sends submitted at once.
+ * Returns `NULL` if io_uring is not available, in which case the socket calls should be used instead. */
+static inline struct uring *
+uring_init(const int fd, uint32_t buf_count, const size_t payload_len, const int with_ctrl, const uint32_t send_count)
+{
+	struct io_uring_params 	p;
+	struct io_uring_buf_reg reg;
+	struct uring 			*u;
+	uint32_t 				i, n;
+
+	/* buffer rings must be a power of 2 */
+	for (n = 1; n < buf_count && n < 32768; n <<= 1);
+	buf_count = n;
+
+	u = malloc(sizeof(struct uring));
+	if (u == NULL) {
+		return NULL;
+	}
+	memset(u, 0, sizeof(struct uring));
+	u->fd = fd;
+
+	memset(&p, 0, sizeof(p));
+	/* every buffer may hold a completion, plus the sends */
+	p.flags = IORING_SETUP_CQSIZE;
+	p.cq_entries = buf_count + 2 * send_count + 2;
+	if ( (u->ring_fd = syscall(__NR_io_uring_setup, send_count + 1, &p)) < 0 ) {
+		free(u);
+		return NULL;
+	}
+
+	u->sq_ring_len = p.sq_off.array + p.sq_entries * sizeof(uint32_t);
+	u->cq_ring_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		if (u->cq_ring_len > u->sq_ring_len) {
+			u->sq_ring_len = u->cq_ring_len;
+		}
+		u->cq_ring_len = u->sq_ring_len;
+	}
+	u->sq_ring = mmap(NULL, u->sq_ring_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, u->ring_fd, IORING_OFF_SQ_RING);
+	if (u->sq_ring == MAP_FAILED) {
+		goto fail;
+	}
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		u->cq_ring = u->sq_ring;
+	} else if ( (u->cq_ring = mmap(NULL, u->cq_ring_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, u->ring_fd, IORING_OFF_CQ_RING)) == MAP_FAILED ) {
+		goto fail;
+	}
+	u->sqes_len = p.sq_entries * sizeof(struct io_uring_sqe);
+	if ( (u->sqes = mmap(NULL, u->sqes_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, u->ring_fd, IORING_OFF_SQES)) == MAP_FAILED ) {
+		goto fail;
+	}
+	u->sq_head = (uint32_t *)((uint8_t *)u->sq_ring + p.sq_off.head);
+	u->sq_tail = (uint32_t *)((uint8_t *)u->sq_ring + p.sq_off.tail);
+	u->sq_flags = (uint32_t *)((uint8_t *)u->sq_ring + p.sq_off.flags);
+	u->sq_array = (uint32_t *)((uint8_t *)u->sq_ring + p.sq_off.array);
+	u->sq_mask = *(uint32_t *)((uint8_t *)u->sq_ring + p.sq_off.ring_mask);
+	u->sq_entries = p.sq_entries;
+	u->sq_local_tail = *u->sq_tail;
+	u->cq_head = (uint32_t *)((uint8_t *)u->cq_ring + p.cq_off.head);
+	u->cq_tail = (uint32_t *)((uint8_t *)u->cq_ring + p.cq_off.tail);
+	u->cq_mask = *(uint32_t *)((uint8_t *)u->cq_ring + p.cq_off.ring_mask);
+	u->cqes = (struct io_uring_cqe *)((uint8_t *)u->cq_ring + p.cq_off.cqes);
+
+	/* each buffer: struct io_uring_recvmsg_out, the source address, the control message and the payload */
+	u->recv_msg.msg_namelen = sizeof(struct sockaddr_in);
+#ifdef NETIO_HAS_SEGMENTATION
+	u->recv_msg.msg_controllen = with_ctrl ? NETIO_CTRL_LEN : 0;
+#else
+	(void)with_ctrl;
+#endif
+	u->buf_count = buf_count;
+	u->buf_len = sizeof(struct io_uring_recvmsg_out) + u->recv_msg.msg_namelen + u->recv_msg.msg_controllen + payload_len;
+	/* every buffer starts aligned for its struct io_uring_recvmsg_out and the address after it */
+	u->buf_len = (u->buf_len + 7) & ~(uint32_t)7;
+	u->buffers = malloc((size_t)buf_count * u->buf_len);
+	u->deferred = calloc(buf_count, sizeof(struct io_uring_cqe));
+	if (u->buffers == NULL || u->deferred == NULL
+			|| posix_memalign((void **)&u->buf_ring, sysconf(_SC_PAGESIZE), buf_count * sizeof(struct io_uring_buf)) != 0) {
+		goto fail;
+	}
+	memset(u->buf_ring, 0, buf_count * sizeof(struct io_uring_buf));
+	memset(&reg, 0, sizeof(reg));
+	reg.ring_addr = (uintptr_t)u->buf_ring;
+	reg.ring_entries = buf_count;
+	reg.bgid = 0;
+	if (syscall(__NR_io_uring_register, u->ring_fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0) {
+		/* kernel older than 5.19 */
+		goto fail;
+	}
+	for (i = 0; i < buf_count; i++) {
+		uring_recycle(u, i);
+	}
+	return u;
+fail:
+	uring_free(&u);
+	return NULL;
+}
+
+/* Account a send completion. Returns the amount of bytes sent. */
+static inline size_t
+uring_send_complete(struct uring *u, const struct io_uring_cqe *cqe)
+{
+	u->sends_inflight--;
+	if (cqe->res < 0) {
+		fprintf(stderr, "io_uring sendmsg(): %s\n", strerror(-cqe->res));
+		return 0;
+	}
+	return cqe->res;
+}
+
+/* Wait until every send completed, setting receive completions aside.
+ * Returns the amount of bytes sent. */
+static inline size_t
+uring_wait_sends(struct uring *u)
+{
+	struct io_uring_cqe cqe;
+	size_t 				bytes = 0;
+
+	while (u->sends_inflight > 0) {
+		if (!uring_cqe_next(u, &cqe, 0)) {
+			uring_submit(u, 1);
+			continue;
+		}
+		if (cqe.user_data == URING_UDATA_SEND) {
+			bytes += uring_send_complete(u, &cqe);
+			continue;
+		}
+		if (!(cqe.flags & IORING_CQE_F_MORE)) {
+			u->recv_armed = 0;
+		}
+		if (cqe.flags & IORING_CQE_F_BUFFER) {
+			/* holds a buffer, so there is always room */
+			u->deferred[(u->deferred_head + u->deferred_count) % u->buf_count] = cqe;
+			u->deferred_count++;
+		}
+	}
+	return bytes;
+}
+
+/* Submit every datagram pending in `b` at once and wait for them, so the batch can be reused.
+ * Returns the amount of bytes sent. */
+static inline size_t
+uring_send_batch(struct uring *u, struct sendbatch *b)
+{
+	struct io_uring_sqe *sqe;
+	unsigned int 		i;
+	size_t 				bytes = 0;
+
+	for (i = 0; i < b->pending; i++) {
+		while ( (sqe = uring_get_sqe(u)) == NULL ) {
+			/* more datagrams than entries */
+			uring_submit(u, 0);
+		}
+		sqe->opcode = IORING_OP_SENDMSG;
+		sqe->fd = u->fd;
+		sqe->addr = (uintptr_t)&b->msgs[i].msg_hdr;
+		sqe->len = 1;
+		sqe->user_data = URING_UDATA_SEND;
+		u->sends_inflight++;
+	}
+	if (u->to_submit > 0) {
+		/* UDP sends usually complete within the submission */
+		uring_submit(u, 0);
+	}
+	bytes = uring_wait_sends(u);
+	b->pending = 0;
+	b->used = 0;
+	return bytes;
+}
+
+/* Get the next received datagram, arming the recvmsg again if needed.
+ * Returns 0 if there are no more datagrams for now. */
+static inline int
+uring_recv_next(struct uring *u, struct uring_recv *r)
+{
+	struct io_uring_cqe 		cqe;
+	struct io_uring_recvmsg_out *out;
+	uint8_t 					*name;
+
+	if (__atomic_load_n(u->sq_flags, __ATOMIC_RELAXED) & IORING_SQ_CQ_OVERFLOW) {
+		/* completions that did not fit in the ring are waiting in the kernel */
+		uring_enter(u, 0, 0, IORING_ENTER_GETEVENTS);
+	}
+	while (1) {
+		if (!uring_cqe_next(u, &cqe, 1)) {
+			if (!u->recv_armed) {
+				/* datagrams that arrived meanwhile wait in the socket */
+				uring_arm_recv(u);
+				uring_submit(u, 0);
+			}
+			return 0;
+		}
+		if (cqe.user_data == URING_UDATA_SEND) {
+			/* sends are waited for, so this only happens after an error in uring_wait_sends */
+			uring_send_complete(u, &cqe);
+			continue;
+		}
+		if (!(cqe.flags & IORING_CQE_F_MORE)) {
+			/* out of buffers or failed */
+			u->recv_armed = 0;
+		}
+		if (!(cqe.flags & IORING_CQE_F_BUFFER)) {
+			if (cqe.res < 0 && cqe.res != -ENOBUFS) {
+				fprintf(stderr, "io_uring recvmsg(): %s\n", strerror(-cqe.res));
+			}
+			continue;
+		}
+		r->bid = cqe.flags >> IORING_CQE_BUFFER_SHIFT;
+		out = (struct io_uring_recvmsg_out *)(u->buffers + (size_t)r->bid * u->buf_len);
+		if (out->flags & MSG_TRUNC) {
+			/* bigger than the buffers. Ignore. */
+			uring_recycle(u, r->bid);
+			continue;
+		}
+		name = (uint8_t *)(out + 1);
+		r->addr = (struct sockaddr_in *)name;
+		r->buff = name + u->recv_msg.msg_namelen + u->recv_msg.msg_controllen;
+		r->len = out->payloadlen;
+		r->seg_size = 0;
+#ifdef NETIO_HAS_SEGMENTATION
+		if (out->controllen > 0) {
+			struct msghdr msg;
+			memset(&msg, 0, sizeof(msg));
+			msg.msg_control = name + u->recv_msg.msg_namelen;
+			msg.msg_controllen = out->controllen;
+			r->seg_size = netio_get_gro_size(&msg);
+		}
+#endif
+		return 1;
+	}
+}
+#endif
+
+#endif
@@ -7,6 +7,12 @@
 #include "include/packet.h"
 #include "include/net.h"
 
+#ifdef __linux__
+#include <pthread.h>
+#include <sys/socket.h>
+#include <fcntl.h>
+#endif
+
 #ifdef _WIN32
 #define random() rand()
 #define srandom(val) srand(val)
@@ -14,7 +20,7 @@
 
 #define TEST(testfunc) printf(#testfunc"\t\t\t\t\t"); total++; if (testfunc == EXIT_SUCCESS) { printf("OK\n"); ok++; }
 
-#define TEST_CMP(in,out,printtype,before_exit) if (in != out) { printf("FAILED\n%d:\tout != in (" #printtype " != " #printtype ")\n", __LINE__, out, in); before_exit; return EXIT_FAILURE; }
+#define TEST_CMP(in,out,printtype,before_exit) if ((in) != (out)) { printf("FAILED\n%d:\tout != in (" #printtype " != " #printtype ")\n", __LINE__, (out), (in)); before_exit; return EXIT_FAILURE; }
 
 #define TEST_CMPSTR(in,out,printtype,before_exit) if (strcmp(in,out) != 0) { printf("FAILED\n%d:\tout != in (" #printtype " != " #printtype ")\n", __LINE__, out, in); before_exit; return EXIT_FAILURE; }
 
@@ -356,18 +362,35 @@ onsrvclose(netconn_t **conn, void *userdata)
 	server_free(conn);
 }
 
+/* Wait until the server tick is due, receiving early whatever arrives meanwhile. */
+void
+nettest_wait(netconn_t **srv_info, netconn_t **cli_info)
+{
+	uint16_t tick;
+	while (*srv_info != NULL && conn_wait(*srv_info) == 0) {
+		tick = conn_get_local_tick(*srv_info);
+		server_drain(srv_info);
+		client_drain(cli_info);
+		if (tick != conn_get_local_tick(*srv_info) && nettest_fail == 0) {
+			nettest_fail = 1;
+			sprintf(nettest_failmsg, "%d: server_drain advanced the tick.\n", __LINE__);
+		}
+	}
+}
+
+/* default settings used by the networking tests */
+#define NETTEST_SETTINGS \
+	.pending_conn_timeout_tick = 200, \
+	.kick_notice_tick = 10, \
+	.timeout_tick = 400, \
+	.expected_tick_tolerance = 8192
+
 int
-test_all()
+nettest_run(const struct netsettings settings)
 {
 	printf("\n");
 	int i;
-	/* setup settings */
-	const struct netsettings settings = {
-		.pending_conn_timeout_tick = 200,
-		.kick_notice_tick = 10,
-		.timeout_tick = 400,
-		.expected_tick_tolerance = 8192,
-	};
+	nettest_clistep = nettest_srvstep = nettest_step = nettest_fail = 0;
 	/* setup events */
 	const struct clievents clievents = { 
 		.onconnect=&cli_onconnect, 
@@ -399,7 +422,11 @@ test_all()
 			server_close(srv_info);
 			nettest_srvstep++;
 		}
-		usleep(5000);	
+		if (settings.tick_rate != 0) {
+			nettest_wait(&srv_info, &cli_info);
+		} else {
+			usleep(5000);	
+		}
 	}
 	if (srv_info != NULL) {
 		server_free(&srv_info);
@@ -414,22 +441,1797 @@ test_all()
 }
 
 int
-main()
+test_all()
 {
-	INITIALIZE_WINSOCKS();
+	const struct netsettings settings = { NETTEST_SETTINGS };
+	return nettest_run(settings);
+}
 
-	int total = 0, ok = 0;
-	srandom(time(NULL));
+int
+test_wait()
+{
+	const struct netsettings settings = { NETTEST_SETTINGS, .tick_rate = 200 };
+	return nettest_run(settings);
+}
 
-	TEST(test_packet_rw_bits());
-	TESTPACKET_RW_N_T(8);
-	TESTPACKET_RW_N_T(16);
-	TESTPACKET_RW_N_T(32);
-	TESTPACKET_RW_N_T(64);
-	//slow af in wine
-//	TEST(test_packet_rw_vlen29());
-	TEST(test_packet_all());
-	TEST(test_all());
+int
+test_recvbatch()
+{
+	const struct netsettings settings = { NETTEST_SETTINGS, .recv_batch_size = 32 };
+	return nettest_run(settings);
+}
+
+int
+test_sendbatch()
+{
+	const struct netsettings settings = { NETTEST_SETTINGS, .send_batch_size = 32 };
+	return nettest_run(settings);
+}
+
+/* tick scheduling tests */
+#define TICKTEST_RATE 		500
+#define TICKTEST_INTERVAL 	(1000000000LL / TICKTEST_RATE)
+struct netstats ticktest_stats;
+uint16_t ticktest_ticks = 0;
+
+int64_t
+ticktest_now()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+void
+ticktest_ondisconnect(netconn_t **conn, void *userdata, int disconnect_reason)
+{
+	ticktest_stats = *conn_get_stats(*conn);
+	ticktest_ticks = conn_get_local_tick(*conn);
+	client_free(conn);
+}
+void
+ticktest_onconnect(netconn_t *conn, void *userdata, packet_t *p_in, packet_t *p_out)
+{
+}
+void
+ticktest_onreceivepkt(netconn_t *conn, void *userdata, packet_t *p_in)
+{
+}
+void
+ticktest_onsendpkt(netconn_t *conn, void *userdata, packet_t *p_out)
+{
+}
+
+/* Run `count` ticks of a client without a server, processing tick `stall_at` `stall_ns` late.
+ * Returns the time taken, in nanoseconds. */
+int64_t
+ticktest_run(const enum netconn_tick_catchup catchup, const int count, const int stall_at, const int64_t stall_ns)
+{
+	const struct netsettings settings = { NETTEST_SETTINGS, .tick_rate = TICKTEST_RATE, .tick_catchup = catchup };
+	const struct clievents clievents = { 
+		.onconnect = &ticktest_onconnect, 
+		.ondisconnect = &ticktest_ondisconnect, 
+		.onreceivepkt = &ticktest_onreceivepkt,
+		.onsendpkt = &ticktest_onsendpkt
+	};
+	netconn_t 	*cli_info = client_init(inet_addr("127.0.0.1"), htons(25566), clievents, settings, NULL);
+	int64_t 	start = ticktest_now();
+	int 		i;
+
+	for (i = 0; i < count; i++) {
+		conn_sleep(cli_info);
+		if (i == stall_at) {
+			usleep(stall_ns / 1000);
+		}
+		client_process(&cli_info);
+	}
+	ticktest_stats = *conn_get_stats(cli_info);
+	client_free(&cli_info);
+	return ticktest_now() - start;
+}
+
+int
+test_tick_catchup()
+{
+	const int64_t 	stall = 12 * TICKTEST_INTERVAL;
+	int64_t 		elapsed;
+
+	printf("\n");
+	/* the missed ticks are dropped, so the schedule is kept */
+	elapsed = ticktest_run(ETICK_CATCHUP_SKIP, 40, 10, stall);
+	printf("\t[skip] %ld us, %lu late, %lu skipped\n", elapsed / 1000, ticktest_stats.late_ticks, ticktest_stats.skipped_ticks);
+	TEST_CMP(1, ticktest_stats.late_ticks >= 1, %d, {});
+	TEST_CMP(1, ticktest_stats.skipped_ticks >= 10, %d, {});
+	TEST_CMP(1, elapsed >= (40 - 1 + 10) * TICKTEST_INTERVAL, %d, {});
+	/* the missed ticks run back to back, so 40 ticks take about as long as without the stall */
+	elapsed = ticktest_run(ETICK_CATCHUP_BURST, 40, 10, stall);
+	printf("\t[burst] %ld us, %lu late, %lu skipped\n", elapsed / 1000, ticktest_stats.late_ticks, ticktest_stats.skipped_ticks);
+	TEST_CMP(1, ticktest_stats.late_ticks >= 10, %d, {});
+	TEST_CMP(0, (int)ticktest_stats.skipped_ticks, %d, {});
+	TEST_CMP(1, elapsed < (40 - 1 + 10) * TICKTEST_INTERVAL, %d, {});
+	/* the whole schedule is pushed by the stall */
+	elapsed = ticktest_run(ETICK_CATCHUP_STRETCH, 40, 10, stall);
+	printf("\t[stretch] %ld us, %lu late, %lu skipped\n", elapsed / 1000, ticktest_stats.late_ticks, ticktest_stats.skipped_ticks);
+	TEST_CMP(1, ticktest_stats.late_ticks >= 1, %d, {});
+	TEST_CMP(0, (int)ticktest_stats.skipped_ticks, %d, {});
+	TEST_CMP(1, elapsed >= (40 - 1 + 12) * TICKTEST_INTERVAL, %d, {});
+	return EXIT_SUCCESS;
+}
+
+int
+test_client_run()
+{
+	/* with no server, the client times out after `timeout_tick` ticks */
+	const struct netsettings settings = { .pending_conn_timeout_tick = 200, .kick_notice_tick = 10, .timeout_tick = 100, .expected_tick_tolerance = 8192, .tick_rate = TICKTEST_RATE };
+	const struct clievents clievents = { 
+		.onconnect = &ticktest_onconnect, 
+		.ondisconnect = &ticktest_ondisconnect, 
+		.onreceivepkt = &ticktest_onreceivepkt,
+		.onsendpkt = &ticktest_onsendpkt
+	};
+	netconn_t 	*cli_info = client_init(inet_addr("127.0.0.1"), htons(25566), clievents, settings, NULL);
+	int64_t 	elapsed = ticktest_now();
+
+	printf("\n");
+	client_run(&cli_info);
+	elapsed = ticktest_now() - elapsed;
+	printf("\t%u ticks in %ld us, %lu late, max %lu ns late\n", ticktest_ticks, elapsed / 1000, ticktest_stats.late_ticks, ticktest_stats.max_tick_late_ns);
+	TEST_CMP(1, (cli_info == NULL), %d, {});
+	/* ticks are due at absolute times, the time spent processing does not add up */
+	TEST_CMP(1, elapsed >= (ticktest_ticks - 1) * TICKTEST_INTERVAL, %d, {});
+	TEST_CMP(1, elapsed < (ticktest_ticks + 10) * TICKTEST_INTERVAL, %d, {});
+	return EXIT_SUCCESS;
+}
+
+/* messaging test */
+#define MSGTEST_COUNT 	256
+#define MSGTEST_LEN 	400
+/* every n-th message is bigger than any mtu */
+#define MSGTEST_BIG_N 	64
+#define MSGTEST_BIG_LEN 3000
+uint32_t msgtest_sent = 0;
+uint32_t msgtest_received = 0;
+uint32_t msgtest_connected = 0;
+/* the client socket changes its port after receiving this many messages */
+uint32_t msgtest_rebind_at = UINT32_MAX;
+/* if not 0, the packets written by the server are checked to stay under it */
+uint32_t msgtest_mtu = 0;
+/* messages are written straight to the message store, with `server_cli_reservemessage` */
+int msgtest_reserve = 0;
+/* messages are received and acknowledged with the batch events */
+int msgtest_batch = 0;
+uint32_t msgtest_acked = 0;
+/* if not 0, messages are sent with `server_broadcastmessage` once this many clients are connected */
+uint32_t msgtest_broadcast = 0;
+
+/* Writes message `msgtest_sent` to `buff`, and returns its length */
+uint32_t
+msgtest_fill(uint8_t *buff)
+{
+	const uint32_t 	len = msgtest_sent % MSGTEST_BIG_N == 0 ? MSGTEST_BIG_LEN : MSGTEST_LEN;
+
+	*(uint32_t *)buff = htonl(msgtest_sent);
+	memset(buff + 4, (uint8_t)msgtest_sent, len - 4);
+	return len;
+}
+
+/* Checks message `i` of `len` bytes, without its first 4 at `buff`, 
+ * counted in the client `userdata` if not NULL, otherwise in `msgtest_received` */
+void
+msgtest_check(void *userdata, const uint32_t i, const uint8_t *buff, const uint32_t len)
+{
+	uint32_t 	*received = userdata != NULL ? userdata : &msgtest_received;
+
+	if (nettest_fail == 0 && (i != *received || len != (i % MSGTEST_BIG_N == 0 ? MSGTEST_BIG_LEN : MSGTEST_LEN) || buff[len - 5] != (uint8_t)i)) {
+		nettest_fail = 1;
+		sprintf(nettest_failmsg, "%d: message %u arrived as %u with %u bytes.\n", __LINE__, *received, i, len);
+	}
+	(*received)++;
+}
+void
+msg_cli_onconnect(netconn_t *conn, void *userdata, packet_t *p_in, packet_t *p_out)
+{
+}
+void
+msg_cli_onreceivepkt(netconn_t *conn, void *userdata, packet_t *p_in)
+{
+}
+void
+msg_cli_onsendpkt(netconn_t *conn, void *userdata, packet_t *p_out)
+{
+}
+void
+msg_cli_onreceivemsg(netconn_t *conn, void *userdata, packet_t *p_in)
+{
+	uint32_t 	i, len;
+	uint8_t 	buff[MSGTEST_BIG_LEN];
+
+	len = packet_get_readable(p_in);
+	packet_r_32_t(p_in, &i);
+	packet_r(p_in, buff, len - 4);
+	msgtest_check(userdata, i, buff, len);
+}
+void
+msg_cli_onreceivemsgs(netconn_t *conn, void *userdata, const struct netmsgview *msgs, uint32_t count)
+{
+	uint32_t 	i;
+
+	for (i = 0; i < count; i++) {
+		if (msgs[i].channel != 0 || msgs[i].len < 4) {
+			nettest_fail = 1;
+			sprintf(nettest_failmsg, "%d: message %u arrived in channel %u with %u bytes.\n", __LINE__, msgtest_received, msgs[i].channel, msgs[i].len);
+			return;
+		}
+		msgtest_check(userdata, ntohl(*(uint32_t *)msgs[i].data), msgs[i].data + 4, msgs[i].len);
+	}
+}
+void
+msg_onmessageacks(netconn_t *conn, void *userdata, const uint32_t *message_ids, uint32_t count, netsrvclient_t *client)
+{
+	msgtest_acked += count;
+}
+int
+msg_onconnect(netconn_t *conn, void *userdata, packet_t *p_in, packet_t *p_out, netsrvclient_t *client, void **cliuserdata)
+{
+	msgtest_connected++;
+	return ECONNECTION_ALLOW;
+}
+void
+msg_onreceivepkt(netconn_t *conn, void *userdata, packet_t *p_in, netsrvclient_t *client, void *cliuserdata)
+{
+}
+void
+msg_onsendpkt(netconn_t *conn, void *userdata, packet_t *p_out, netsrvclient_t *client, void *cliuserdata)
+{
+	uint8_t 	buff[MSGTEST_BIG_LEN];
+	uint32_t 	len, i;
+	packet_t 	*msg;
+	if (msgtest_mtu != 0 && nettest_fail == 0 && (packet_get_length(p_out) > msgtest_mtu || conn_get_bytes_left(conn) != msgtest_mtu - packet_get_length(p_out))) {
+		nettest_fail = 1;
+		sprintf(nettest_failmsg, "%d: packet of %u bytes with %u bytes left.\n", __LINE__, packet_get_length(p_out), conn_get_bytes_left(conn));
+	}
+	/* one message per tick, so they pile up while waiting for acknowledgment */
+	if (msgtest_sent < MSGTEST_COUNT && msgtest_broadcast == 0) {
+		len = msgtest_fill(buff);
+		if (!msgtest_reserve) {
+			server_cli_sendmessage(client, 0, buff, len);
+		} else if ( (msg = server_cli_reservemessage(client, 0, 0, 0)) != NULL ) {
+			packet_w_32_t(msg, &msgtest_sent);
+			for (i = 4; i < len; i++) {
+				packet_w_8_t(msg, buff + i);
+			}
+			if (server_cli_commitmessage(client) == 0) {
+				nettest_fail = 1;
+				sprintf(nettest_failmsg, "%d: message %u was not committed.\n", __LINE__, msgtest_sent);
+			}
+		}
+		msgtest_sent++;
+	}
+}
+
+void
+msg_bonsendpkt(netconn_t *conn, void *userdata, netsrvclient_t *first)
+{
+	uint8_t 	buff[MSGTEST_BIG_LEN];
+
+	/* once per tick for every client, rather than from each `onsendpkt` */
+	if (msgtest_sent < MSGTEST_COUNT && msgtest_connected >= msgtest_broadcast) {
+		server_broadcastmessage(conn, 0, buff, msgtest_fill(buff), 0, 0);
+		msgtest_sent++;
+	}
+}
+
+#ifdef __linux__
+/* Replaces the socket of `conn` with one bound to another port, as a NAT rebinding would look like to the server */
+void
+msgtest_rebind(netconn_t *conn)
+{
+	int fd = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+	fcntl(fd, F_SETFL, O_NONBLOCK);
+	dup2(fd, conn_get_fd(conn));
+	close(fd);
+}
+
+/* UDP relay between the client and the server that loses and reorders datagrams */
+#define LOSSYPROXY_PORT 	25566
+/* every n-th datagram of the server is dropped, and the one after it is delayed past the next one */
+#define LOSSYPROXY_DROP_N 	5
+/* every n-th datagram of the client is dropped */
+#define LOSSYPROXY_CLI_DROP_N 	9
+int lossyproxy_fd = -1;
+struct sockaddr_in lossyproxy_client;
+uint8_t lossyproxy_held[65536];
+ssize_t lossyproxy_held_len = 0;
+uint32_t lossyproxy_count = 0;
+
+int
+lossyproxy_init()
+{
+	struct sockaddr_in addr = {0};
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = inet_addr("127.0.0.1");
+	addr.sin_port = htons(LOSSYPROXY_PORT);
+	lossyproxy_fd = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+	fcntl(lossyproxy_fd, F_SETFL, O_NONBLOCK);
+	lossyproxy_held_len = lossyproxy_count = 0;
+	return bind(lossyproxy_fd, (struct sockaddr *)&addr, sizeof(addr));
+}
+
+void
+lossyproxy_pump()
+{
+	uint8_t 			buff[65536];
+	ssize_t 			len;
+	struct sockaddr_in 	from, server = {0};
+	socklen_t 			socklen = sizeof(from);
+
+	server.sin_family = AF_INET;
+	server.sin_addr.s_addr = inet_addr("127.0.0.1");
+	server.sin_port = htons(25565);
+	while ( (len = recvfrom(lossyproxy_fd, buff, sizeof(buff), 0, (struct sockaddr *)&from, &socklen)) >= 0 ) {
+		lossyproxy_count++;
+		if (from.sin_port != server.sin_port) {
+			lossyproxy_client = from;
+			if (lossyproxy_count % LOSSYPROXY_CLI_DROP_N != 0) {
+				sendto(lossyproxy_fd, buff, len, 0, (struct sockaddr *)&server, sizeof(server));
+			}
+		} else if (lossyproxy_count % LOSSYPROXY_DROP_N == 0) {
+			/* lost */
+		} else if (lossyproxy_held_len == 0 && lossyproxy_count % LOSSYPROXY_DROP_N == 1) {
+			memcpy(lossyproxy_held, buff, len);
+			lossyproxy_held_len = len;
+		} else {
+			sendto(lossyproxy_fd, buff, len, 0, (struct sockaddr *)&lossyproxy_client, sizeof(lossyproxy_client));
+			if (lossyproxy_held_len > 0) {
+				sendto(lossyproxy_fd, lossyproxy_held, lossyproxy_held_len, 0, (struct sockaddr *)&lossyproxy_client, sizeof(lossyproxy_client));
+				lossyproxy_held_len = 0;
+			}
+		}
+		socklen = sizeof(from);
+	}
+}
+#endif
+
+int
+msgtest_run(const struct netsettings settings)
+{
+	int i;
+	msgtest_sent = msgtest_received = msgtest_connected = msgtest_acked = 0;
+	nettest_fail = 0;
+	const struct clievents clievents = { 
+		.onconnect = &msg_cli_onconnect, 
+		.ondisconnect = &cli_ondisconnect, 
+		.onreceivepkt = &msg_cli_onreceivepkt,
+		.onreceivemsg = &msg_cli_onreceivemsg,
+		.onreceivemsgs = msgtest_batch ? &msg_cli_onreceivemsgs : NULL,
+		.onsendpkt = &msg_cli_onsendpkt
+	};
+	const struct srvevents srvevents = {
+		.onconnect = &msg_onconnect,
+		.ondisconnect = &ondisconnect,
+		.onreceivepkt = &msg_onreceivepkt,
+		.onsendpkt = &msg_onsendpkt,
+		.bonsendpkt = msgtest_broadcast != 0 ? &msg_bonsendpkt : NULL,
+		.onmessageacks = msgtest_batch ? &msg_onmessageacks : NULL,
+		.onsrvclose = &onsrvclose
+	};
+	printf("\n");
+	netconn_t *cli_info = NULL, *srv_info = NULL;
+	srv_info = server_init(htonl(INADDR_ANY), htons(25565), srvevents, settings, NULL);
+#ifdef __linux__
+	/* through the proxy if there is one */
+	cli_info = client_init(inet_addr("127.0.0.1"), htons(lossyproxy_fd != -1 ? LOSSYPROXY_PORT : 25565), clievents, settings, NULL);
+#else
+	cli_info = client_init(inet_addr("127.0.0.1"), htons(25565), clievents, settings, NULL);
+#endif
+
+	for(i = 0; srv_info != NULL && i < 4096; i++) {
+		client_process(&cli_info);
+#ifdef __linux__
+		if (lossyproxy_fd != -1) {
+			usleep(500);
+			lossyproxy_pump();
+		}
+#endif
+		server_process(&srv_info);
+#ifdef __linux__
+		if (lossyproxy_fd != -1) {
+			usleep(500);
+			lossyproxy_pump();
+		}
+		if (cli_info != NULL && msgtest_received == msgtest_rebind_at) {
+			msgtest_rebind(cli_info);
+			msgtest_rebind_at = UINT32_MAX;
+		}
+#endif
+		if (cli_info != NULL && msgtest_received == MSGTEST_COUNT) {
+			client_disconnect(cli_info);
+		} else if (cli_info == NULL) {
+			server_close(srv_info);
+		}
+		usleep(1000);
+	}
+	if (srv_info != NULL) {
+		server_free(&srv_info);
+		client_free(&cli_info);
+		printf("FAILED\n\tReceived %u of %u messages.\n", msgtest_received, MSGTEST_COUNT);
+		return EXIT_FAILURE;
+	} else if (nettest_fail == 1) {
+		printf("FAILED\n%s",nettest_failmsg);
+		return EXIT_FAILURE;
+	}
+	/* the client may have timed out */
+	TEST_CMP(MSGTEST_COUNT, msgtest_received, %u, {});
+	return EXIT_SUCCESS;
+}
+
+int
+test_messages()
+{
+	const struct netsettings settings = { NETTEST_SETTINGS };
+	return msgtest_run(settings);
+}
+
+int
+test_message_window()
+{
+	/* messages pile up in the queue, as one is sent per tick */
+	const struct netsettings settings = { NETTEST_SETTINGS, .message_window = 4 };
+	return msgtest_run(settings);
+}
+
+int
+test_mtu_budget()
+{
+	int 	ret;
+	/* messages go in a few extra datagrams per tick */
+	const struct netsettings settings = { NETTEST_SETTINGS, .mtu = 600, .overflow_datagrams = 2 };
+	msgtest_mtu = 600;
+	ret = msgtest_run(settings);
+	msgtest_mtu = 0;
+	return ret;
+}
+
+int
+test_reserved_messages()
+{
+	int 	ret;
+	/* the big ones go in fragments */
+	const struct netsettings settings = { NETTEST_SETTINGS, .mtu = 1200 };
+	msgtest_reserve = 1;
+	ret = msgtest_run(settings);
+	msgtest_reserve = 0;
+	return ret;
+}
+
+int
+test_udp_segmentation()
+{
+	const struct netsettings settings = { NETTEST_SETTINGS, .mtu = 600, .udp_segmentation = 1 };
+	return msgtest_run(settings);
+}
+
+/* capacity mode test */
+netsrvclient_t *capacitytest_client = NULL;
+
+int
+capacity_onconnect(netconn_t *conn, void *userdata, packet_t *p_in, packet_t *p_out, netsrvclient_t *client, void **cliuserdata)
+{
+	msgtest_connected++;
+	capacitytest_client = client;
+	return ECONNECTION_ALLOW;
+}
+
+int
+test_capacity()
+{
+	int 		i;
+	uint32_t 	id, last_id = 0;
+	uint8_t 	buff[64] = {0};
+	netconn_t 	*clients[2], *srv_info;
+	const struct netsettings msg_settings = { NETTEST_SETTINGS, .max_clients = 1, .max_messages = MSGTEST_COUNT, .max_message_len = MSGTEST_BIG_LEN + 4 };
+	const struct netsettings settings = { NETTEST_SETTINGS, .max_clients = 1, .max_messages = 4, .max_message_len = sizeof(buff) };
+	const struct clievents clievents = { 
+		.onconnect = &msg_cli_onconnect, 
+		.ondisconnect = &cli_ondisconnect, 
+		.onreceivepkt = &msg_cli_onreceivepkt,
+		.onsendpkt = &msg_cli_onsendpkt
+	};
+	const struct srvevents srvevents = {
+		.onconnect = &capacity_onconnect,
+		.ondisconnect = &ondisconnect,
+		.onreceivepkt = &msg_onreceivepkt,
+		.onsendpkt = &msg_onsendpkt,
+		.onsrvclose = &onsrvclose
+	};
+
+	if (msgtest_run(msg_settings) == EXIT_FAILURE) {
+		return EXIT_FAILURE;
+	}
+	/* a second client does not fit */
+	msgtest_sent = MSGTEST_COUNT;
+	msgtest_connected = 0;
+	srv_info = server_init(htonl(INADDR_ANY), htons(25565), srvevents, settings, NULL);
+	for (i = 0; i < 2; i++) {
+		clients[i] = client_init(inet_addr("127.0.0.1"), htons(25565), clievents, settings, NULL);
+	}
+	for (i = 0; i < 32; i++) {
+		client_process(&clients[0]);
+		if (i > 4) {
+			client_process(&clients[1]);
+		}
+		server_process(&srv_info);
+		usleep(1000);
+	}
+	TEST_CMP(1, msgtest_connected, %u, {});
+	/* messages sent in the same tick share one until it is full */
+	for (i = 0; i < 4; i++) {
+		id = server_cli_sendmessage(capacitytest_client, 0, buff, sizeof(buff) - 1);
+		TEST_CMP(1, id > last_id, %d, {});
+		last_id = id;
+	}
+	TEST_CMP(0, server_cli_sendmessage(capacitytest_client, 0, buff, sizeof(buff) - 1), %u, {});
+	TEST_CMP(0, server_cli_sendmessage(capacitytest_client, 0, buff, sizeof(buff)), %u, {});
+	server_free(&srv_info);
+	client_free(&clients[0]);
+	client_free(&clients[1]);
+	return EXIT_SUCCESS;
+}
+
+/* queue limit test */
+#define QUEUETEST_LIMIT 	256
+#define QUEUETEST_SENDS 	16
+uint32_t queuetest_expired = 0;
+int queuetest_kick_reason = -1;
+
+void
+queue_onmessageexpire(netconn_t *conn, void *userdata, uint32_t message_id, netsrvclient_t *client)
+{
+	queuetest_expired++;
+}
+void
+queue_ondisconnect(netconn_t *conn, void *userdata, int disconnect_reason, netsrvclient_t *client, void **cliuserdata)
+{
+	queuetest_kick_reason = disconnect_reason;
+}
+
+int
+test_queue_limit()
+{
+	int 		i, policy;
+	uint8_t 	buff[64] = {0};
+	netconn_t 	*cli_info, *srv_info;
+	struct netsettings settings = { NETTEST_SETTINGS, .max_queued_bytes = QUEUETEST_LIMIT, .message_pool_high = 8, .message_pool_low = 2 };
+	const struct clievents clievents = { 
+		.onconnect = &msg_cli_onconnect, 
+		.ondisconnect = &cli_ondisconnect, 
+		.onreceivepkt = &msg_cli_onreceivepkt,
+		.onsendpkt = &msg_cli_onsendpkt
+	};
+	const struct srvevents srvevents = {
+		.onconnect = &capacity_onconnect,
+		.ondisconnect = &queue_ondisconnect,
+		.onmessageexpire = &queue_onmessageexpire,
+		.onreceivepkt = &msg_onreceivepkt,
+		.onsendpkt = &msg_onsendpkt,
+		.onsrvclose = &onsrvclose
+	};
+
+	msgtest_sent = MSGTEST_COUNT;
+	for (policy = EQUEUE_REJECT; policy <= EQUEUE_DROP_OLDEST; policy++) {
+		settings.queue_policy = policy;
+		msgtest_connected = queuetest_expired = 0;
+		queuetest_kick_reason = -1;
+		srv_info = server_init(htonl(INADDR_ANY), htons(25565), srvevents, settings, NULL);
+		cli_info = client_init(inet_addr("127.0.0.1"), htons(25565), clievents, settings, NULL);
+		for (i = 0; i < 32; i++) {
+			client_process(&cli_info);
+			server_process(&srv_info);
+			usleep(1000);
+		}
+		TEST_CMP(1, msgtest_connected, %u, {});
+		/* the client stops acknowledging, so a message per tick piles up */
+		for (i = 0; i < QUEUETEST_SENDS; i++) {
+			if (server_cli_sendmessage(capacitytest_client, 0, buff, sizeof(buff)) == 0) {
+				break;
+			}
+			server_process(&srv_info);
+		}
+		if (policy == EQUEUE_DROP_OLDEST) {
+			/* the oldest ones make room */
+			TEST_CMP(QUEUETEST_SENDS, i, %d, {});
+			TEST_CMP(1, (queuetest_expired > 0 && queuetest_expired <= QUEUETEST_SENDS - QUEUETEST_LIMIT / sizeof(buff) + 1), %d, {});
+		} else {
+			TEST_CMP(QUEUETEST_LIMIT / (sizeof(buff) + 1), (unsigned long)i, %lu, {});
+		}
+		for (i = 0; i < 32; i++) {
+			server_process(&srv_info);
+		}
+		TEST_CMP((policy == EQUEUE_KICK ? EKICK_QUEUE_FULL : -1), queuetest_kick_reason, %d, {});
+		server_free(&srv_info);
+		client_free(&cli_info);
+	}
+	return EXIT_SUCCESS;
+}
+
+/* rate limit test */
+#define RATETEST_CLIENTS 	8
+#define RATETEST_BUDGET 	2
+#define RATETEST_BURST 		2
+#define RATETEST_TICKS 		16
+#define RATETEST_FLOOD 		10
+int ratetest_connected = 0;
+int ratetest_received = 0;
+
+int
+rate_onconnect(netconn_t *conn, void *userdata, packet_t *p_in, packet_t *p_out, netsrvclient_t *client, void **cliuserdata)
+{
+	ratetest_connected++;
+	return ECONNECTION_ALLOW;
+}
+void
+rate_onreceivepkt(netconn_t *conn, void *userdata, packet_t *p_in, netsrvclient_t *client, void *cliuserdata)
+{
+	ratetest_received++;
+}
+void
+rate_onsendpkt(netconn_t *conn, void *userdata, packet_t *p_out, netsrvclient_t *client, void *cliuserdata)
+{
+	const uint8_t byte = 0;
+	packet_w_8_t(p_out, &byte);
+}
+void
+rate_cli_onsendpkt(netconn_t *conn, void *userdata, packet_t *p_out)
+{
+	const uint8_t byte = 0;
+	packet_w_8_t(p_out, &byte);
+}
+
+int
+test_rate_limit()
+{
+	int 		i, j, last_connected;
+	netconn_t 	*clients[RATETEST_CLIENTS], *srv_info;
+	const struct netsettings settings = { 
+		NETTEST_SETTINGS, 
+		.client_packets_per_tick = 1, 
+		.client_rate_burst_ticks = RATETEST_BURST, 
+		.pending_conn_per_tick = RATETEST_BUDGET 
+	};
+	const struct clievents clievents = { 
+		.onconnect = &msg_cli_onconnect, 
+		.ondisconnect = &cli_ondisconnect, 
+		.onreceivepkt = &msg_cli_onreceivepkt,
+		.onsendpkt = &rate_cli_onsendpkt
+	};
+	const struct srvevents srvevents = {
+		.onconnect = &rate_onconnect,
+		.ondisconnect = &ondisconnect,
+		.onreceivepkt = &rate_onreceivepkt,
+		.onsendpkt = &rate_onsendpkt,
+		.onsrvclose = &onsrvclose
+	};
+
+	ratetest_connected = 0;
+	srv_info = server_init(htonl(INADDR_ANY), htons(25565), srvevents, settings, NULL);
+	for (j = 0; j < RATETEST_CLIENTS; j++) {
+		clients[j] = client_init(inet_addr("127.0.0.1"), htons(25565), clievents, settings, NULL);
+	}
+	/* everyone asks at once, a few are admitted per tick */
+	for (i = 0; i < 4 * RATETEST_CLIENTS && ratetest_connected < RATETEST_CLIENTS; i++) {
+		for (j = 0; j < RATETEST_CLIENTS; j++) {
+			client_process(&clients[j]);
+		}
+		usleep(1000);
+		last_connected = ratetest_connected;
+		server_process(&srv_info);
+		TEST_CMP(1, ratetest_connected - last_connected <= RATETEST_BUDGET, %d, {});
+	}
+	TEST_CMP(RATETEST_CLIENTS, ratetest_connected, %d, {});
+	TEST_CMP(1, conn_get_stats(srv_info)->deferred_connections > 0, %d, {});
+	/* let the first client hear back */
+	for (i = 0; i < 4; i++) {
+		client_process(&clients[0]);
+		usleep(1000);
+		server_process(&srv_info);
+	}
+	/* then it floods */
+	ratetest_received = 0;
+	for (i = 0; i < RATETEST_TICKS; i++) {
+		for (j = 0; j < RATETEST_FLOOD; j++) {
+			client_process(&clients[0]);
+		}
+		usleep(1000);
+		server_process(&srv_info);
+	}
+	TEST_CMP(1, ratetest_received <= RATETEST_TICKS + RATETEST_BURST, %d, {});
+	TEST_CMP(1, conn_get_stats(srv_info)->rate_limited_packets > 0, %d, {});
+	server_free(&srv_info);
+	for (j = 0; j < RATETEST_CLIENTS; j++) {
+		client_free(&clients[j]);
+	}
+	return EXIT_SUCCESS;
+}
+
+/* retransmission test */
+#define RETRANSMITTEST_TICKS 	32
+/* sent, then retransmitted with the timeout doubling each time */
+#define RETRANSMITTEST_MAX_SENDS 8
+int retransmittest_datagrams = 0;
+int retransmittest_messages = 0;
+
+void
+retransmit_cli_onreceivepkt(netconn_t *conn, void *userdata, packet_t *p_in)
+{
+	retransmittest_datagrams++;
+}
+void
+retransmit_cli_onreceivemsg(netconn_t *conn, void *userdata, packet_t *p_in)
+{
+	retransmittest_messages++;
+}
+
+int
+test_retransmit()
+{
+	int 		i;
+	uint8_t 	buff[16] = {0};
+	netconn_t 	*cli_info, *srv_info;
+	const struct netsettings settings = { NETTEST_SETTINGS };
+	const struct clievents clievents = { 
+		.onconnect = &msg_cli_onconnect, 
+		.ondisconnect = &cli_ondisconnect, 
+		.onreceivepkt = &retransmit_cli_onreceivepkt,
+		.onreceivemsg = &retransmit_cli_onreceivemsg,
+		.onsendpkt = &msg_cli_onsendpkt
+	};
+	const struct srvevents srvevents = {
+		.onconnect = &capacity_onconnect,
+		.ondisconnect = &ondisconnect,
+		.onreceivepkt = &msg_onreceivepkt,
+		.onsendpkt = &msg_onsendpkt,
+		.onsrvclose = &onsrvclose
+	};
+
+	msgtest_connected = 0;
+	/* nothing but the message below */
+	msgtest_sent = MSGTEST_COUNT;
+	srv_info = server_init(htonl(INADDR_ANY), htons(25565), srvevents, settings, NULL);
+	cli_info = client_init(inet_addr("127.0.0.1"), htons(25565), clievents, settings, NULL);
+	for (i = 0; i < 8; i++) {
+		client_process(&cli_info);
+		usleep(1000);
+		server_process(&srv_info);
+		usleep(1000);
+	}
+	client_process(&cli_info);
+	TEST_CMP(1, msgtest_connected, %u, {});
+	/* the client stops answering, so the message is never acknowledged */
+	retransmittest_datagrams = retransmittest_messages = 0;
+	server_cli_sendmessage(capacitytest_client, 0, buff, sizeof(buff));
+	for (i = 0; i < RETRANSMITTEST_TICKS; i++) {
+		server_process(&srv_info);
+		usleep(1000);
+	}
+	client_process(&cli_info);
+	TEST_CMP(1, retransmittest_messages, %d, {});
+	TEST_CMP(1, (retransmittest_datagrams > 1 && retransmittest_datagrams <= RETRANSMITTEST_MAX_SENDS), %d, {});
+	server_free(&srv_info);
+	client_free(&cli_info);
+	return EXIT_SUCCESS;
+}
+
+/* timeout test */
+#define TIMEOUTTEST_PENDING_TIMEOUT 20
+#define TIMEOUTTEST_TIMEOUT 		40
+#define TIMEOUTTEST_KICK_NOTICE 	5
+int timeouttest_pending = 0;
+int timeouttest_reason = -1;
+int timeouttest_tick = 0;
+int timeouttest_connect_tick = -1;
+int timeouttest_now = 0;
+
+int
+timeout_onconnect(netconn_t *conn, void *userdata, packet_t *p_in, packet_t *p_out, netsrvclient_t *client, void **cliuserdata)
+{
+	timeouttest_connect_tick = timeouttest_now;
+	return timeouttest_pending ? ECONNECTION_AGAIN : ECONNECTION_ALLOW;
+}
+void
+timeout_ondisconnect(netconn_t *conn, void *userdata, int disconnect_reason, netsrvclient_t *client, void **cliuserdata)
+{
+	timeouttest_reason = disconnect_reason;
+	timeouttest_tick = timeouttest_now;
+}
+
+/* The client goes silent right after echoing the handshake cookie. 
+ * Returns how many server ticks after connecting it got removed, or -1 if it did not time out. */
+int
+timeouttest_run(const int pending)
+{
+	const struct netsettings settings = { 
+		.expected_tick_tolerance = 8192, 
+		.pending_conn_timeout_tick = TIMEOUTTEST_PENDING_TIMEOUT, 
+		.timeout_tick = TIMEOUTTEST_TIMEOUT, 
+		.kick_notice_tick = TIMEOUTTEST_KICK_NOTICE 
+	};
+	const struct clievents clievents = { 
+		.onconnect = &msg_cli_onconnect, 
+		.ondisconnect = &cli_ondisconnect, 
+		.onreceivepkt = &msg_cli_onreceivepkt,
+		.onsendpkt = &msg_cli_onsendpkt
+	};
+	const struct srvevents srvevents = {
+		.onconnect = &timeout_onconnect,
+		.ondisconnect = &timeout_ondisconnect,
+		.onreceivepkt = &msg_onreceivepkt,
+		.onsendpkt = &msg_onsendpkt,
+		.onsrvclose = &onsrvclose
+	};
+	netconn_t *cli_info = NULL, *srv_info = NULL;
+	timeouttest_pending = pending;
+	timeouttest_reason = -1;
+	timeouttest_connect_tick = -1;
+	msgtest_sent = MSGTEST_COUNT;
+	srv_info = server_init(htonl(INADDR_ANY), htons(25565), srvevents, settings, NULL);
+	cli_info = client_init(inet_addr("127.0.0.1"), htons(25565), clievents, settings, NULL);
+	for (timeouttest_now = 0; timeouttest_reason == -1 && timeouttest_now < 4 * TIMEOUTTEST_TIMEOUT; timeouttest_now++) {
+		if (timeouttest_connect_tick == -1) {
+			/* request, then echo the cookie */
+			client_process(&cli_info);
+			usleep(1000);
+		}
+		server_process(&srv_info);
+		usleep(1000);
+	}
+	server_free(&srv_info);
+	client_free(&cli_info);
+	return timeouttest_reason == EKICK_CONNECTION_TIMEOUT ? timeouttest_tick - timeouttest_connect_tick : -1;
+}
+
+int
+test_timeouts()
+{
+	printf("\n");
+	/* kicked once the timeout is reached, removed after the kick notices */
+	TEST_CMP(TIMEOUTTEST_PENDING_TIMEOUT + TIMEOUTTEST_KICK_NOTICE, timeouttest_run(1), %d, {});
+	TEST_CMP(TIMEOUTTEST_TIMEOUT + TIMEOUTTEST_KICK_NOTICE, timeouttest_run(0), %d, {});
+	return EXIT_SUCCESS;
+}
+
+/* many clients test */
+#define MANYTEST_CLIENTS 	600
+int manytest_connected = 0;
+int manytest_disconnected = 0;
+int manytest_max_iterated = 0;
+
+int
+many_onconnect(netconn_t *conn, void *userdata, packet_t *p_in, packet_t *p_out, netsrvclient_t *client, void **cliuserdata)
+{
+	manytest_connected++;
+	return ECONNECTION_ALLOW;
+}
+void
+many_ondisconnect(netconn_t *conn, void *userdata, int disconnect_reason, netsrvclient_t *client, void **cliuserdata)
+{
+	manytest_disconnected++;
+}
+void
+many_bonsendpkt(netconn_t *conn, void *userdata, netsrvclient_t *first)
+{
+	netsrvclient_t 	*client;
+	int 			count = 1;
+	for (client = server_cli_get_next(first); client != NULL; client = server_cli_get_next(client)) {
+		count++;
+	}
+	if (count > manytest_max_iterated) {
+		manytest_max_iterated = count;
+	}
+}
+
+int
+test_many_clients()
+{
+	int i, j, alive, phase;
+	netconn_t *clients[MANYTEST_CLIENTS];
+	const struct netsettings settings = { NETTEST_SETTINGS };
+	const struct clievents clievents = { 
+		.onconnect = &msg_cli_onconnect, 
+		.ondisconnect = &cli_ondisconnect, 
+		.onreceivepkt = &msg_cli_onreceivepkt,
+		.onsendpkt = &msg_cli_onsendpkt
+	};
+	const struct srvevents srvevents = {
+		.onconnect = &many_onconnect,
+		.ondisconnect = &many_ondisconnect,
+		.onreceivepkt = &msg_onreceivepkt,
+		.onsendpkt = &msg_onsendpkt,
+		.bonsendpkt = &many_bonsendpkt,
+		.onsrvclose = &onsrvclose
+	};
+	printf("\n");
+	msgtest_sent = MSGTEST_COUNT;
+	manytest_connected = manytest_disconnected = manytest_max_iterated = 0;
+	netconn_t *srv_info = server_init(htonl(INADDR_ANY), htons(25565), srvevents, settings, NULL);
+	for (j = 0; j < MANYTEST_CLIENTS; j++) {
+		clients[j] = client_init(inet_addr("127.0.0.1"), htons(25565), clievents, settings, NULL);
+	}
+
+	for (i = 0, phase = 0; srv_info != NULL && i < 4096; i++) {
+		alive = 0;
+		for (j = 0; j < MANYTEST_CLIENTS; j++) {
+			client_process(&clients[j]);
+			alive += clients[j] != NULL;
+		}
+		server_process(&srv_info);
+		if (phase == 0 && manytest_connected == MANYTEST_CLIENTS) {
+			/* half of them leave */
+			for (j = 0; j < MANYTEST_CLIENTS; j += 2) {
+				client_disconnect(clients[j]);
+			}
+			phase++;
+		} else if (phase == 1 && manytest_disconnected == MANYTEST_CLIENTS / 2 && alive == MANYTEST_CLIENTS / 2) {
+			/* and come back from other ports, reusing the released slots */
+			for (j = 0; j < MANYTEST_CLIENTS; j += 2) {
+				clients[j] = client_init(inet_addr("127.0.0.1"), htons(25565), clievents, settings, NULL);
+			}
+			phase++;
+		} else if (phase == 2 && manytest_connected == MANYTEST_CLIENTS + MANYTEST_CLIENTS / 2) {
+			for (j = 0; j < MANYTEST_CLIENTS; j++) {
+				client_disconnect(clients[j]);
+			}
+			phase++;
+		} else if (phase == 3 && alive == 0) {
+			server_close(srv_info);
+		}
+		usleep(1000);
+	}
+	if (srv_info != NULL) {
+		server_free(&srv_info);
+		for (j = 0; j < MANYTEST_CLIENTS; j++) {
+			client_free(&clients[j]);
+		}
+		printf("FAILED\n\t%d of %d connections.\n", manytest_connected, MANYTEST_CLIENTS + MANYTEST_CLIENTS / 2);
+		return EXIT_FAILURE;
+	}
+	TEST_CMP(MANYTEST_CLIENTS + MANYTEST_CLIENTS / 2, manytest_connected, %d, {});
+	TEST_CMP(MANYTEST_CLIENTS + MANYTEST_CLIENTS / 2, manytest_disconnected, %d, {});
+	TEST_CMP(MANYTEST_CLIENTS, manytest_max_iterated, %d, {});
+	return EXIT_SUCCESS;
+}
+
+/* broadcast test, to clients with different mtus */
+#define BCASTTEST_CLIENTS 	4
+/* this client stops for a while, so it acknowledges the shared messages after the others */
+#define BCASTTEST_LATE 		0
+const uint16_t bcasttest_mtus[BCASTTEST_CLIENTS] = { 0, 600, 300, 128 };
+
+int
+bcast_onconnect(netconn_t *conn, void *userdata, packet_t *p_in, packet_t *p_out, netsrvclient_t *client, void **cliuserdata)
+{
+	server_cli_set_mtu(client, bcasttest_mtus[msgtest_connected % BCASTTEST_CLIENTS]);
+	msgtest_connected++;
+	return ECONNECTION_ALLOW;
+}
+
+int
+test_broadcast_clients()
+{
+	int 		i, j, alive;
+	uint32_t 	received[BCASTTEST_CLIENTS] = {0};
+	netconn_t 	*clients[BCASTTEST_CLIENTS];
+	const struct netsettings settings = { NETTEST_SETTINGS };
+	const struct clievents clievents = { 
+		.onconnect = &msg_cli_onconnect, 
+		.ondisconnect = &cli_ondisconnect, 
+		.onreceivepkt = &msg_cli_onreceivepkt,
+		.onreceivemsg = &msg_cli_onreceivemsg,
+		.onsendpkt = &msg_cli_onsendpkt
+	};
+	const struct srvevents srvevents = {
+		.onconnect = &bcast_onconnect,
+		.ondisconnect = &ondisconnect,
+		.onreceivepkt = &msg_onreceivepkt,
+		.onsendpkt = &msg_onsendpkt,
+		.bonsendpkt = &msg_bonsendpkt,
+		.onsrvclose = &onsrvclose
+	};
+	printf("\n");
+	msgtest_sent = msgtest_connected = 0;
+	nettest_fail = 0;
+	msgtest_broadcast = BCASTTEST_CLIENTS;
+	netconn_t *srv_info = server_init(htonl(INADDR_ANY), htons(25565), srvevents, settings, NULL);
+	for (j = 0; j < BCASTTEST_CLIENTS; j++) {
+		clients[j] = client_init(inet_addr("127.0.0.1"), htons(25565), clievents, settings, &received[j]);
+	}
+
+	for (i = 0; srv_info != NULL && i < 4096; i++) {
+		alive = 0;
+		for (j = 0; j < BCASTTEST_CLIENTS; j++) {
+			/* while a quarter of the messages are sent, the others acknowledge them alone */
+			if (j != BCASTTEST_LATE || msgtest_sent < MSGTEST_COUNT / 4 || msgtest_sent >= MSGTEST_COUNT / 2) {
+				client_process(&clients[j]);
+			}
+			if (clients[j] != NULL && received[j] == MSGTEST_COUNT) {
+				client_disconnect(clients[j]);
+			}
+			alive += clients[j] != NULL;
+		}
+		server_process(&srv_info);
+		if (srv_info != NULL && alive == 0) {
+			server_close(srv_info);
+		}
+		usleep(1000);
+	}
+	msgtest_broadcast = 0;
+	if (srv_info != NULL) {
+		server_free(&srv_info);
+		for (j = 0; j < BCASTTEST_CLIENTS; j++) {
+			client_free(&clients[j]);
+		}
+		printf("FAILED\n\tReceived %u of %u messages by the late client.\n", received[BCASTTEST_LATE], MSGTEST_COUNT);
+		return EXIT_FAILURE;
+	} else if (nettest_fail == 1) {
+		printf("FAILED\n%s",nettest_failmsg);
+		return EXIT_FAILURE;
+	}
+	TEST_CMP(BCASTTEST_CLIENTS, msgtest_connected, %u, {});
+	for (j = 0; j < BCASTTEST_CLIENTS; j++) {
+		TEST_CMP(MSGTEST_COUNT, received[j], %u, {});
+	}
+	return EXIT_SUCCESS;
+}
+
+#ifdef __linux__
+int
+test_io_uring()
+{
+	const struct netsettings settings = { NETTEST_SETTINGS, .io_uring = 1, .tick_rate = 200 };
+	return nettest_run(settings);
+}
+
+int
+test_io_uring_messages()
+{
+	const struct netsettings settings = { NETTEST_SETTINGS, .mtu = 600, .udp_segmentation = 1, .io_uring = 1, .recv_batch_size = 16 };
+	return msgtest_run(settings);
+}
+
+int
+test_nat_rebinding()
+{
+	const struct netsettings settings = { NETTEST_SETTINGS };
+	msgtest_rebind_at = MSGTEST_COUNT / 4;
+	if (msgtest_run(settings) == EXIT_FAILURE) {
+		return EXIT_FAILURE;
+	}
+	/* the server followed the client to its new address instead of seeing a new connection */
+	TEST_CMP(1, msgtest_connected, %u, {});
+	return EXIT_SUCCESS;
+}
+
+/* Runs `msgtest_run` through the lossy proxy */
+int
+lossytest_run(const struct netsettings settings)
+{
+	int 	ret;
+
+	if (lossyproxy_init() != 0) {
+		printf("FAILED\n\tCould not bind the proxy.\n");
+		close(lossyproxy_fd);
+		lossyproxy_fd = -1;
+		return EXIT_FAILURE;
+	}
+	ret = msgtest_run(settings);
+	close(lossyproxy_fd);
+	lossyproxy_fd = -1;
+	return ret;
+}
+
+int
+test_lossy_messages()
+{
+	const struct netsettings settings = { NETTEST_SETTINGS };
+	return lossytest_run(settings);
+}
+
+int
+test_lossy_ring()
+{
+	/* the ring is as big as the window, so new messages wait for the oldest lost one */
+	const struct netsettings settings = { NETTEST_SETTINGS, .message_window = 64 };
+	return lossytest_run(settings);
+}
+
+int
+test_batch_events()
+{
+	int 	ret;
+	/* reordered and fragmented messages are handed over before their buffer is reused */
+	const struct netsettings settings = { NETTEST_SETTINGS };
+	msgtest_batch = 1;
+	ret = lossytest_run(settings);
+	msgtest_batch = 0;
+	if (ret != EXIT_SUCCESS) {
+		return ret;
+	}
+	TEST_CMP(1, (msgtest_acked > 0 && msgtest_acked <= MSGTEST_COUNT), %d, {});
+	return EXIT_SUCCESS;
+}
+
+int
+test_broadcast()
+{
+	int 	ret;
+	/* shared messages are retransmitted, and the big ones are sent in fragments of their own */
+	const struct netsettings settings = { NETTEST_SETTINGS };
+	msgtest_broadcast = 1;
+	ret = lossytest_run(settings);
+	msgtest_broadcast = 0;
+	return ret;
+}
+/* handshake test, with connection requests written by hand */
+/* values the datagrams are written with in src/net.c */
+#define HANDSHAKETEST_MAGIC 		0x5546
+#define HANDSHAKETEST_CONNECTING 	1
+#define HANDSHAKETEST_SRV_COOKIE 	4
+#define HANDSHAKETEST_REPLY_LEN 	11
+/* header and cookie */
+#define HANDSHAKETEST_REQUEST_LEN 	13
+/* ticks after which a cookie expired, two time buckets of src/netcookie.h */
+#define HANDSHAKETEST_EXPIRY 		(2 << 6)
+int handshaketest_connected = 0;
+
+int
+handshake_onconnect(netconn_t *conn, void *userdata, packet_t *p_in, packet_t *p_out, netsrvclient_t *client, void **cliuserdata)
+{
+	handshaketest_connected++;
+	return ECONNECTION_ALLOW;
+}
+
+/* Sends the first `len` bytes of a connection request from `fd` starting with `magic`, with `cookie` if not NULL, padded with zeros. 
+ * Returns the length of the reply of the server, or -1 if there is none, with the cookie it carries in `*reply_cookie` */
+int
+handshaketest_request(int fd, netconn_t **srv_info, const uint16_t magic, const uint64_t *cookie, const uint32_t len, uint64_t *reply_cookie)
+{
+	uint8_t 			buff[256], srv_msg = 0, has_connid = 0;
+	const uint8_t 		zero = 0;
+	const uint16_t 		tick = 0;
+	uint16_t 			srv_tick;
+	ssize_t 			r = -1;
+	int 				i;
+	struct sockaddr_in 	server = {0};
+	packet_t 			*p = packet_init();
+
+	server.sin_family = AF_INET;
+	server.sin_addr.s_addr = inet_addr("127.0.0.1");
+	server.sin_port = htons(25565);
+	packet_w_16_t(p, &magic);
+	packet_w_16_t(p, &tick);
+	packet_w_bits(p, HANDSHAKETEST_CONNECTING, 2);
+	/* no connection id nor token */
+	packet_w_bits(p, 0, 1);
+	packet_w_bits(p, 0, 1);
+	packet_w_bits(p, cookie != NULL, 1);
+	if (cookie != NULL) {
+		packet_w_64_t(p, cookie);
+	}
+	while (packet_get_length(p) < len) {
+		packet_w_8_t(p, &zero);
+	}
+	sendto(fd, packet_get_buff(p), len, 0, (struct sockaddr *)&server, sizeof(server));
+	/* answered in the tick it arrives in, if at all */
+	for (i = 0; i < 16 && r < 0; i++) {
+		server_process(srv_info);
+		usleep(1000);
+		r = recv(fd, buff, sizeof(buff), 0);
+	}
+	if (r > 0) {
+		packet_rewind(p);
+		packet_set_length(p, 0);
+		packet_w(p, buff, r);
+		packet_rewind(p);
+		packet_r_16_t(p, &srv_tick);
+		packet_r_bits(p, &srv_msg, 3);
+		packet_r_bits(p, &has_connid, 1);
+		if (srv_msg != HANDSHAKETEST_SRV_COOKIE || has_connid != 0 || packet_r_64_t(p, reply_cookie) != 0) {
+			r = 0;
+		}
+	}
+	packet_free(&p);
+	return (int)r;
+}
+
+int
+test_handshake()
+{
+	int 		i, fd;
+	uint64_t 	cookie = 0, cookie2 = 0, forged = 0x0123456789ABCDEFULL;
+	const struct netsettings settings = { NETTEST_SETTINGS };
+	const struct srvevents srvevents = {
+		.onconnect = &handshake_onconnect,
+		.ondisconnect = &ondisconnect,
+		.onreceivepkt = &msg_onreceivepkt,
+		.onsendpkt = &msg_onsendpkt,
+		.onsrvclose = &onsrvclose
+	};
+	printf("\n");
+	msgtest_sent = MSGTEST_COUNT;
+	handshaketest_connected = 0;
+	netconn_t *srv_info = server_init(htonl(INADDR_ANY), htons(25565), srvevents, settings, NULL);
+	fd = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+	fcntl(fd, F_SETFL, O_NONBLOCK);
+
+	/* stray traffic, with another magic or too short for one */
+	TEST_CMP(-1, handshaketest_request(fd, &srv_info, 0x1234, NULL, HANDSHAKETEST_REPLY_LEN, &cookie), %d, { close(fd); server_free(&srv_info); });
+	TEST_CMP(-1, handshaketest_request(fd, &srv_info, HANDSHAKETEST_MAGIC, NULL, 1, &cookie), %d, { close(fd); server_free(&srv_info); });
+	/* a request smaller than the reply is not answered, so it can't be amplified */
+	TEST_CMP(-1, handshaketest_request(fd, &srv_info, HANDSHAKETEST_MAGIC, NULL, HANDSHAKETEST_REPLY_LEN - 1, &cookie), %d, { close(fd); server_free(&srv_info); });
+	/* without a cookie, or with a forged one, a cookie comes back instead of a connection */
+	TEST_CMP(HANDSHAKETEST_REPLY_LEN, handshaketest_request(fd, &srv_info, HANDSHAKETEST_MAGIC, NULL, HANDSHAKETEST_REPLY_LEN, &cookie), %d, { close(fd); server_free(&srv_info); });
+	TEST_CMP(HANDSHAKETEST_REPLY_LEN, handshaketest_request(fd, &srv_info, HANDSHAKETEST_MAGIC, &forged, HANDSHAKETEST_REQUEST_LEN, &cookie2), %d, { close(fd); server_free(&srv_info); });
+	TEST_CMP(1, (cookie2 != forged), %d, { close(fd); server_free(&srv_info); });
+	/* the cookie received first expires */
+	for (i = 0; i < HANDSHAKETEST_EXPIRY + (1 << 6); i++) {
+		server_process(&srv_info);
+	}
+	TEST_CMP(HANDSHAKETEST_REPLY_LEN, handshaketest_request(fd, &srv_info, HANDSHAKETEST_MAGIC, &cookie, HANDSHAKETEST_REQUEST_LEN, &cookie2), %d, { close(fd); server_free(&srv_info); });
+	TEST_CMP(1, (cookie2 != cookie), %d, { close(fd); server_free(&srv_info); });
+	close(fd);
+	TEST_CMP(0, handshaketest_connected, %d, server_free(&srv_info));
+	/* no client was allocated either, so the server closes at once */
+	server_close(srv_info);
+	server_process(&srv_info);
+	TEST_CMP(1, (srv_info == NULL), %d, server_free(&srv_info));
+	return EXIT_SUCCESS;
+}
+
+/* fragmentation test */
+#define FRAGTEST_COUNT 	2
+#define FRAGTEST_LEN 	200000
+uint8_t fragtest_buff[FRAGTEST_LEN];
+int fragtest_received = 0;
+int fragtest_acked = 0;
+
+void
+frag_cli_onreceivemsg(netconn_t *conn, void *userdata, packet_t *p_in)
+{
+	uint32_t 	i, len = packet_get_readable(p_in);
+
+	for (i = 0; nettest_fail == 0 && i < len; i++) {
+		if (len != FRAGTEST_LEN || ((uint8_t *)packet_get_buff(p_in))[i] != (uint8_t)(i * 7 + fragtest_received)) {
+			nettest_fail = 1;
+			sprintf(nettest_failmsg, "%d: message %d arrived with %u bytes, wrong at %u.\n", __LINE__, fragtest_received, len, i);
+		}
+	}
+	fragtest_received++;
+}
+void
+frag_onmessageack(netconn_t *conn, void *userdata, uint32_t message_id, netsrvclient_t *client)
+{
+	fragtest_acked++;
+}
+void
+frag_onsendpkt(netconn_t *conn, void *userdata, packet_t *p_out, netsrvclient_t *client, void *cliuserdata)
+{
+	uint32_t 	i;
+
+	if (msgtest_sent < FRAGTEST_COUNT) {
+		for (i = 0; i < FRAGTEST_LEN; i++) {
+			fragtest_buff[i] = (uint8_t)(i * 7 + msgtest_sent);
+		}
+		if (server_cli_sendmessage(client, 0, fragtest_buff, FRAGTEST_LEN) != 0) {
+			msgtest_sent++;
+		}
+	}
+}
+
+int
+test_fragmentation()
+{
+	int 		i;
+	netconn_t 	*cli_info, *srv_info;
+	const struct netsettings settings = { NETTEST_SETTINGS, .mtu = 1200, .udp_segmentation = 1, .message_window = 512 };
+	const struct clievents clievents = { 
+		.onconnect = &msg_cli_onconnect, 
+		.ondisconnect = &cli_ondisconnect, 
+		.onreceivepkt = &msg_cli_onreceivepkt,
+		.onreceivemsg = &frag_cli_onreceivemsg,
+		.onsendpkt = &msg_cli_onsendpkt
+	};
+	const struct srvevents srvevents = {
+		.onconnect = &msg_onconnect,
+		.ondisconnect = &ondisconnect,
+		.onmessageack = &frag_onmessageack,
+		.onreceivepkt = &msg_onreceivepkt,
+		.onsendpkt = &frag_onsendpkt,
+		.onsrvclose = &onsrvclose
+	};
+
+	msgtest_sent = 0;
+	nettest_fail = 0;
+	if (lossyproxy_init() != 0) {
+		printf("FAILED\n\tCould not bind the proxy.\n");
+		return EXIT_FAILURE;
+	}
+	printf("\n");
+	srv_info = server_init(htonl(INADDR_ANY), htons(25565), srvevents, settings, NULL);
+	cli_info = client_init(inet_addr("127.0.0.1"), htons(LOSSYPROXY_PORT), clievents, settings, NULL);
+	for (i = 0; srv_info != NULL && i < 4096; i++) {
+		client_process(&cli_info);
+		usleep(500);
+		lossyproxy_pump();
+		server_process(&srv_info);
+		usleep(500);
+		lossyproxy_pump();
+		if (cli_info != NULL && fragtest_acked == FRAGTEST_COUNT) {
+			client_disconnect(cli_info);
+		} else if (cli_info == NULL) {
+			server_close(srv_info);
+		}
+	}
+	close(lossyproxy_fd);
+	lossyproxy_fd = -1;
+	if (srv_info != NULL) {
+		server_free(&srv_info);
+		client_free(&cli_info);
+		printf("FAILED\n\tReceived %d of %d messages, %d acknowledged.\n", fragtest_received, FRAGTEST_COUNT, fragtest_acked);
+		return EXIT_FAILURE;
+	} else if (nettest_fail == 1) {
+		printf("FAILED\n%s",nettest_failmsg);
+		return EXIT_FAILURE;
+	}
+	/* fragments are acknowledged once per message */
+	TEST_CMP(FRAGTEST_COUNT, fragtest_acked, %d, {});
+	TEST_CMP(FRAGTEST_COUNT, fragtest_received, %d, {});
+	return EXIT_SUCCESS;
+}
+
+/* channels test */
+#define CHANTEST_COUNT 	64
+uint32_t chantest_received[3];
+uint32_t chantest_unordered[CHANTEST_COUNT];
+int32_t chantest_last_sequenced;
+
+void
+chan_cli_onreceivemsg(netconn_t *conn, void *userdata, packet_t *p_in)
+{
+	uint32_t 		i = 0;
+	const uint8_t 	channel = client_get_message_channel(conn);
+
+	packet_r_32_t(p_in, &i);
+	if (nettest_fail == 0 && (channel > 2 
+		|| (channel == ECHANNEL_RELIABLE_ORDERED && i != chantest_received[channel]) 
+		|| (channel == ECHANNEL_RELIABLE_UNORDERED && (i >= CHANTEST_COUNT || chantest_unordered[i]++ != 0)) 
+		|| (channel == ECHANNEL_UNRELIABLE_SEQUENCED && (int32_t)i <= chantest_last_sequenced))) {
+		nettest_fail = 1;
+		sprintf(nettest_failmsg, "%d: message %u arrived in channel %u.\n", __LINE__, i, channel);
+		return;
+	}
+	if (channel == ECHANNEL_UNRELIABLE_SEQUENCED) {
+		chantest_last_sequenced = i;
+	}
+	chantest_received[channel]++;
+}
+void
+chan_onsendpkt(netconn_t *conn, void *userdata, packet_t *p_out, netsrvclient_t *client, void *cliuserdata)
+{
+	uint32_t 	i;
+	uint8_t 	channel;
+
+	/* a message per channel and tick, the channel numbers being their mode */
+	for (channel = 0; msgtest_sent < CHANTEST_COUNT && channel < 3; channel++) {
+		i = htonl(msgtest_sent);
+		if (server_cli_sendmessage(client, channel, &i, sizeof(i)) == 0 && nettest_fail == 0) {
+			nettest_fail = 1;
+			sprintf(nettest_failmsg, "%d: message %u not sent in channel %u.\n", __LINE__, msgtest_sent, channel);
+		}
+	}
+	msgtest_sent++;
+}
+
+int
+test_channels()
+{
+	int 		i;
+	netconn_t 	*cli_info, *srv_info;
+	const struct netsettings settings = { NETTEST_SETTINGS, 
+		.channels = { ECHANNEL_RELIABLE_ORDERED, ECHANNEL_RELIABLE_UNORDERED, ECHANNEL_UNRELIABLE_SEQUENCED } };
+	const struct clievents clievents = { 
+		.onconnect = &msg_cli_onconnect, 
+		.ondisconnect = &cli_ondisconnect, 
+		.onreceivepkt = &msg_cli_onreceivepkt,
+		.onreceivemsg = &chan_cli_onreceivemsg,
+		.onsendpkt = &msg_cli_onsendpkt
+	};
+	const struct srvevents srvevents = {
+		.onconnect = &msg_onconnect,
+		.ondisconnect = &ondisconnect,
+		.onreceivepkt = &msg_onreceivepkt,
+		.onsendpkt = &chan_onsendpkt,
+		.onsrvclose = &onsrvclose
+	};
+
+	msgtest_sent = 0;
+	nettest_fail = 0;
+	chantest_last_sequenced = -1;
+	memset(chantest_received, 0, sizeof(chantest_received));
+	memset(chantest_unordered, 0, sizeof(chantest_unordered));
+	if (lossyproxy_init() != 0) {
+		printf("FAILED\n\tCould not bind the proxy.\n");
+		return EXIT_FAILURE;
+	}
+	printf("\n");
+	srv_info = server_init(htonl(INADDR_ANY), htons(25565), srvevents, settings, NULL);
+	cli_info = client_init(inet_addr("127.0.0.1"), htons(LOSSYPROXY_PORT), clievents, settings, NULL);
+	for (i = 0; srv_info != NULL && i < 4096; i++) {
+		client_process(&cli_info);
+		usleep(500);
+		lossyproxy_pump();
+		server_process(&srv_info);
+		usleep(500);
+		lossyproxy_pump();
+		if (cli_info != NULL && chantest_received[ECHANNEL_RELIABLE_ORDERED] == CHANTEST_COUNT 
+			&& chantest_received[ECHANNEL_RELIABLE_UNORDERED] == CHANTEST_COUNT) {
+			client_disconnect(cli_info);
+		} else if (cli_info == NULL) {
+			server_close(srv_info);
+		}
+	}
+	close(lossyproxy_fd);
+	lossyproxy_fd = -1;
+	if (srv_info != NULL) {
+		server_free(&srv_info);
+		client_free(&cli_info);
+		printf("FAILED\n\tReceived %u and %u of %d messages.\n", chantest_received[0], chantest_received[1], CHANTEST_COUNT);
+		return EXIT_FAILURE;
+	} else if (nettest_fail == 1) {
+		printf("FAILED\n%s",nettest_failmsg);
+		return EXIT_FAILURE;
+	}
+	/* some of the unreliable ones are lost */
+	TEST_CMP(1, (chantest_received[ECHANNEL_UNRELIABLE_SEQUENCED] > 0 && chantest_received[ECHANNEL_UNRELIABLE_SEQUENCED] < CHANTEST_COUNT), %d, {});
+	return EXIT_SUCCESS;
+}
+
+/* priority and expiry tests */
+#define PRIOTEST_COUNT 	32
+#define PRIOTEST_LEN 	500
+uint32_t priotest_received[2];
+uint8_t priotest_high[PRIOTEST_COUNT];
+
+void
+prio_cli_onreceivemsg(netconn_t *conn, void *userdata, packet_t *p_in)
+{
+	uint32_t 		i = 0;
+	const uint8_t 	channel = client_get_message_channel(conn);
+
+	packet_r_32_t(p_in, &i);
+	/* the high priority message of a tick is sent first, even if it was sent last */
+	if (nettest_fail == 0 && (channel < 1 || channel > 2 || i >= PRIOTEST_COUNT || (channel == 1 && priotest_high[i] == 0))) {
+		nettest_fail = 1;
+		sprintf(nettest_failmsg, "%d: message %u in channel %u arrived first.\n", __LINE__, i, channel);
+		return;
+	}
+	if (channel == 2) {
+		priotest_high[i] = 1;
+	}
+	priotest_received[2 - channel]++;
+}
+void
+prio_onsendpkt(netconn_t *conn, void *userdata, packet_t *p_out, netsrvclient_t *client, void *cliuserdata)
+{
+	uint8_t 	buff[PRIOTEST_LEN] = {0};
+
+	/* only one of them fits in a datagram */
+	if (msgtest_sent < PRIOTEST_COUNT) {
+		*(uint32_t *)buff = htonl(msgtest_sent);
+		server_cli_sendmessage_ex(client, 1, buff, sizeof(buff), 0, 0);
+		server_cli_sendmessage_ex(client, 2, buff, sizeof(buff), 1, 0);
+		msgtest_sent++;
+	}
+}
+
+int
+test_message_priority()
+{
+	int 		i;
+	netconn_t 	*cli_info, *srv_info;
+	const struct netsettings settings = { NETTEST_SETTINGS, .mtu = 600, 
+		.channels = { ECHANNEL_RELIABLE_ORDERED, ECHANNEL_RELIABLE_UNORDERED, ECHANNEL_RELIABLE_UNORDERED } };
+	const struct clievents clievents = { 
+		.onconnect = &msg_cli_onconnect, 
+		.ondisconnect = &cli_ondisconnect, 
+		.onreceivepkt = &msg_cli_onreceivepkt,
+		.onreceivemsg = &prio_cli_onreceivemsg,
+		.onsendpkt = &msg_cli_onsendpkt
+	};
+	const struct srvevents srvevents = {
+		.onconnect = &msg_onconnect,
+		.ondisconnect = &ondisconnect,
+		.onreceivepkt = &msg_onreceivepkt,
+		.onsendpkt = &prio_onsendpkt,
+		.onsrvclose = &onsrvclose
+	};
+
+	msgtest_sent = 0;
+	nettest_fail = 0;
+	memset(priotest_received, 0, sizeof(priotest_received));
+	memset(priotest_high, 0, sizeof(priotest_high));
+	printf("\n");
+	srv_info = server_init(htonl(INADDR_ANY), htons(25565), srvevents, settings, NULL);
+	cli_info = client_init(inet_addr("127.0.0.1"), htons(25565), clievents, settings, NULL);
+	for (i = 0; srv_info != NULL && i < 4096; i++) {
+		client_process(&cli_info);
+		server_process(&srv_info);
+		if (cli_info != NULL && priotest_received[1] == PRIOTEST_COUNT) {
+			client_disconnect(cli_info);
+		} else if (cli_info == NULL) {
+			server_close(srv_info);
+		}
+		usleep(1000);
+	}
+	if (srv_info != NULL) {
+		server_free(&srv_info);
+		client_free(&cli_info);
+		printf("FAILED\n\tReceived %u and %u of %d messages.\n", priotest_received[0], priotest_received[1], PRIOTEST_COUNT);
+		return EXIT_FAILURE;
+	} else if (nettest_fail == 1) {
+		printf("FAILED\n%s",nettest_failmsg);
+		return EXIT_FAILURE;
+	}
+	return EXIT_SUCCESS;
+}
+
+#ifdef __linux__
+#define EXPIRETEST_COUNT 	128
+uint32_t expiretest_acked, expiretest_expired, expiretest_received;
+int32_t expiretest_last;
+
+void
+expire_cli_onreceivemsg(netconn_t *conn, void *userdata, packet_t *p_in)
+{
+	uint32_t 	i = 0;
+
+	packet_r_32_t(p_in, &i);
+	/* the ones that expired are skipped, the rest keep their order */
+	if (nettest_fail == 0 && (int32_t)i <= expiretest_last) {
+		nettest_fail = 1;
+		sprintf(nettest_failmsg, "%d: message %u arrived after %d.\n", __LINE__, i, expiretest_last);
+	}
+	expiretest_last = i;
+	expiretest_received++;
+}
+void
+expire_onmessageack(netconn_t *conn, void *userdata, uint32_t message_id, netsrvclient_t *client)
+{
+	expiretest_acked++;
+}
+void
+expire_onmessageexpire(netconn_t *conn, void *userdata, uint32_t message_id, netsrvclient_t *client)
+{
+	expiretest_expired++;
+}
+void
+expire_onsendpkt(netconn_t *conn, void *userdata, packet_t *p_out, netsrvclient_t *client, void *cliuserdata)
+{
+	uint32_t 	i;
+
+	/* sent once, and dropped if lost */
+	if (msgtest_sent < EXPIRETEST_COUNT) {
+		i = htonl(msgtest_sent);
+		server_cli_sendmessage_ex(client, 0, &i, sizeof(i), 0, 1);
+		msgtest_sent++;
+	}
+}
+
+int
+test_message_expiry()
+{
+	int 		i;
+	netconn_t 	*cli_info, *srv_info;
+	const struct netsettings settings = { NETTEST_SETTINGS };
+	const struct clievents clievents = { 
+		.onconnect = &msg_cli_onconnect, 
+		.ondisconnect = &cli_ondisconnect, 
+		.onreceivepkt = &msg_cli_onreceivepkt,
+		.onreceivemsg = &expire_cli_onreceivemsg,
+		.onsendpkt = &msg_cli_onsendpkt
+	};
+	const struct srvevents srvevents = {
+		.onconnect = &msg_onconnect,
+		.ondisconnect = &ondisconnect,
+		.onmessageack = &expire_onmessageack,
+		.onmessageexpire = &expire_onmessageexpire,
+		.onreceivepkt = &msg_onreceivepkt,
+		.onsendpkt = &expire_onsendpkt,
+		.onsrvclose = &onsrvclose
+	};
+
+	msgtest_sent = 0;
+	nettest_fail = 0;
+	expiretest_acked = expiretest_expired = expiretest_received = 0;
+	expiretest_last = -1;
+	if (lossyproxy_init() != 0) {
+		printf("FAILED\n\tCould not bind the proxy.\n");
+		return EXIT_FAILURE;
+	}
+	printf("\n");
+	srv_info = server_init(htonl(INADDR_ANY), htons(25565), srvevents, settings, NULL);
+	cli_info = client_init(inet_addr("127.0.0.1"), htons(LOSSYPROXY_PORT), clievents, settings, NULL);
+	for (i = 0; srv_info != NULL && i < 4096; i++) {
+		client_process(&cli_info);
+		usleep(500);
+		lossyproxy_pump();
+		server_process(&srv_info);
+		usleep(500);
+		lossyproxy_pump();
+		if (cli_info != NULL && expiretest_acked + expiretest_expired == EXPIRETEST_COUNT) {
+			client_disconnect(cli_info);
+		} else if (cli_info == NULL) {
+			server_close(srv_info);
+		}
+	}
+	close(lossyproxy_fd);
+	lossyproxy_fd = -1;
+	if (srv_info != NULL) {
+		server_free(&srv_info);
+		client_free(&cli_info);
+		printf("FAILED\n\t%u acknowledged and %u expired of %d messages.\n", expiretest_acked, expiretest_expired, EXPIRETEST_COUNT);
+		return EXIT_FAILURE;
+	} else if (nettest_fail == 1) {
+		printf("FAILED\n%s",nettest_failmsg);
+		return EXIT_FAILURE;
+	}
+	/* every message is either acknowledged or expired, and the lost ones do not hold the rest back */
+	TEST_CMP(1, (expiretest_expired > 0 && expiretest_acked > 0 && expiretest_received >= expiretest_acked), %d, {});
+	return EXIT_SUCCESS;
+}
+#endif
+
+#ifdef NET_HAS_SERVER_GROUP
+/* server group test */
+#define GROUPTEST_WORKERS 	4
+#define GROUPTEST_CLIENTS 	16
+pthread_mutex_t grouptest_lock = PTHREAD_MUTEX_INITIALIZER;
+int grouptest_connected = 0;
+int grouptest_disconnected = 0;
+
+int
+group_onconnect(netconn_t *conn, void *userdata, packet_t *p_in, packet_t *p_out, netsrvclient_t *client, void **cliuserdata)
+{
+	/* events of different workers run concurrently */
+	pthread_mutex_lock(&grouptest_lock);
+	grouptest_connected++;
+	pthread_mutex_unlock(&grouptest_lock);
+	return ECONNECTION_ALLOW;
+}
+void
+group_ondisconnect(netconn_t *conn, void *userdata, int disconnect_reason, netsrvclient_t *client, void **cliuserdata)
+{
+	pthread_mutex_lock(&grouptest_lock);
+	grouptest_disconnected++;
+	pthread_mutex_unlock(&grouptest_lock);
+}
+
+int
+test_server_group()
+{
+	int i, j, connected, alive;
+	netconn_t *clients[GROUPTEST_CLIENTS];
+	const struct netsettings settings = { NETTEST_SETTINGS, .recv_batch_size = 8 };
+	const struct clievents clievents = { 
+		.onconnect = &msg_cli_onconnect, 
+		.ondisconnect = &cli_ondisconnect, 
+		.onreceivepkt = &msg_cli_onreceivepkt,
+		.onsendpkt = &msg_cli_onsendpkt
+	};
+	const struct srvevents srvevents = {
+		.onconnect = &group_onconnect,
+		.ondisconnect = &group_ondisconnect,
+		.onreceivepkt = &msg_onreceivepkt,
+		.onsendpkt = &msg_onsendpkt,
+		.onsrvclose = &onsrvclose
+	};
+	printf("\n");
+	msgtest_sent = MSGTEST_COUNT;
+	grouptest_connected = grouptest_disconnected = 0;
+	netsrvgroup_t *group = server_group_init(htonl(INADDR_ANY), htons(25565), srvevents, settings, NULL, GROUPTEST_WORKERS);
+	if (group == NULL) {
+		printf("FAILED\n\tserver_group_init failed.\n");
+		return EXIT_FAILURE;
+	}
+	for (j = 0; j < GROUPTEST_CLIENTS; j++) {
+		clients[j] = client_init(inet_addr("127.0.0.1"), htons(25565), clievents, settings, NULL);
+	}
+
+	for (i = 0; group != NULL && i < 2048; i++) {
+		alive = 0;
+		for (j = 0; j < GROUPTEST_CLIENTS; j++) {
+			client_process(&clients[j]);
+			alive += clients[j] != NULL;
+		}
+		server_group_process(&group);
+
+		pthread_mutex_lock(&grouptest_lock);
+		connected = grouptest_connected;
+		pthread_mutex_unlock(&grouptest_lock);
+		if (connected == GROUPTEST_CLIENTS) {
+			for (j = 0; j < GROUPTEST_CLIENTS; j++) {
+				client_disconnect(clients[j]);
+			}
+		}
+		if (alive == 0) {
+			server_group_close(group);
+		}
+		usleep(2000);
+	}
+	if (group != NULL) {
+		server_group_free(&group);
+		for (j = 0; j < GROUPTEST_CLIENTS; j++) {
+			client_free(&clients[j]);
+		}
+		printf("FAILED\n\t%d of %d clients connected.\n", grouptest_connected, GROUPTEST_CLIENTS);
+		return EXIT_FAILURE;
+	}
+	/* a client steered to another worker would show up as a new connection */
+	TEST_CMP(GROUPTEST_CLIENTS, grouptest_connected, %d, {});
+	TEST_CMP(GROUPTEST_CLIENTS, grouptest_disconnected, %d, {});
+	return EXIT_SUCCESS;
+}
+#endif
+#endif
+
+int
+main()
+{
+	INITIALIZE_WINSOCKS();
+
+	int total = 0, ok = 0;
+	srandom(time(NULL));
+
+	TEST(test_packet_rw_bits());
+	TESTPACKET_RW_N_T(8);
+	TESTPACKET_RW_N_T(16);
+	TESTPACKET_RW_N_T(32);
+	TESTPACKET_RW_N_T(64);
+	//slow af in wine
+//	TEST(test_packet_rw_vlen29());
+	TEST(test_packet_all());
+	TEST(test_all());
+	TEST(test_wait());
+	TEST(test_tick_catchup());
+	TEST(test_client_run());
+	TEST(test_recvbatch());
+	TEST(test_sendbatch());
+	TEST(test_messages());
+	TEST(test_message_window());
+	TEST(test_mtu_budget());
+	TEST(test_reserved_messages());
+	TEST(test_message_priority());
+	TEST(test_udp_segmentation());
+	TEST(test_capacity());
+	TEST(test_queue_limit());
+	TEST(test_rate_limit());
+	TEST(test_retransmit());
+	TEST(test_timeouts());
+	TEST(test_many_clients());
+	TEST(test_broadcast_clients());
+#ifdef __linux__
+	TEST(test_io_uring());
+	TEST(test_io_uring_messages());
+	TEST(test_nat_rebinding());
+	TEST(test_lossy_messages());
+	TEST(test_lossy_ring());
+	TEST(test_batch_events());
+	TEST(test_broadcast());
+	TEST(test_handshake());
+	TEST(test_fragmentation());
+	TEST(test_channels());
+	TEST(test_message_expiry());
+#ifdef NET_HAS_SERVER_GROUP
+	TEST(test_server_group());
+#endif
+#endif
 	printf("Total=%d, OK=%d\n", total, ok);
 
 	CLEANUP_WINSOCKS();